@@ -0,0 +1,79 @@
+# Profiler hook cost versus call fan-out and call depth
+#
+# Run with an mruby built with mruby-profiler, mruby-eval and mruby-time:
+#
+#   MRUBY_PROFILER_AUTOSTART=0 MRUBY_PROFILER_DUMP=/dev/null \
+#     mruby bench/fanout.rb
+#
+# Prints nanoseconds per call for a router dispatching to FANOUT distinct
+# handlers, and for a chain of DEPTH distinct methods, with the profiler
+# stopped and in exact mode. The difference is what the hook costs per
+# call; compare it between builds to see how the call tree bookkeeping
+# scales.
+
+CALLS = 200_000
+
+def bench_time
+  t = Time.now
+  yield
+  Time.now - t
+end
+
+# Time the work with the profiler stopped, then running
+def bench_modes(&work)
+  Profiler.stop
+  off = bench_time(&work)
+  Profiler.mode = :exact
+  Profiler.start
+  on = bench_time(&work)
+  Profiler.stop
+  [off, on]
+end
+
+def report(label, n, off, on, calls)
+  printf("%s %5d: off %8.1f  on %8.1f  hook %8.1f ns/call\n", label, n,
+         off * 1e9 / calls, on * 1e9 / calls, (on - off) * 1e9 / calls)
+end
+
+# Every handler needs its own irep, so the methods are generated
+def define_handlers(n)
+  n.times do |i|
+    eval("def handler_#{i}(x); x; end")
+  end
+end
+
+def define_chain(n)
+  n.times do |i|
+    if i == n - 1
+      eval("def chain_#{i}(x); x; end")
+    else
+      eval("def chain_#{i}(x); chain_#{i + 1}(x); end")
+    end
+  end
+end
+
+[1, 4, 16, 64, 256, 1024].each do |fanout|
+  define_handlers(fanout)
+  handlers = (0...fanout).map { |i| :"handler_#{i}" }
+  off, on = bench_modes do
+    i = 0
+    while i < CALLS
+      send(handlers[i % fanout], i)
+      i += 1
+    end
+  end
+  report("fanout", fanout, off, on, CALLS)
+end
+
+[1, 8, 64, 256].each do |depth|
+  define_chain(depth)
+  rounds = CALLS / depth
+  off, on = bench_modes do
+    i = 0
+    while i < rounds
+      chain_0(i)
+      i += 1
+    end
+  end
+  report("depth ", depth, off, on, rounds * depth)
+end
@@ -0,0 +1,181 @@
+# Profiler overhead per workload and mode, with regression gates
+#
+# Run with an mruby built with mruby-profiler and mruby-time:
+#
+#   MRUBY_PROFILER_AUTOSTART=0 MRUBY_PROFILER_DUMP=/dev/null \
+#     mruby bench/overhead.rb [limit=value ...]
+#
+# Each workload runs with the profiler stopped, in exact mode and in
+# sampled mode, the fastest of ROUNDS runs being kept. Prints the slowdown
+# of each mode, the exact mode cost in ns per VM instruction and how the
+# time recorded in exact mode (instructions, GC steps and the subtracted
+# overhead) compares to the wall time.
+#
+# Raises, so mruby exits with a failure, when a limit is exceeded:
+#
+#   exact_ns=N   exact mode ns per instruction                  (150)
+#   exact=X      exact mode slowdown                            (40)
+#   sampled=X    sampled mode slowdown                          (1.5)
+#   drift=F      relative gap between recorded and wall time    (0.25)
+
+ROUNDS = 3
+
+LIMITS = {
+  "exact_ns" => 150.0,
+  "exact"    => 40.0,
+  "sampled"  => 1.5,
+  "drift"    => 0.25,
+}
+ARGV.each do |arg|
+  key, val = arg.split("=", 2)
+  unless LIMITS.key?(key) && val
+    raise ArgumentError, "unknown limit #{arg}, expected one of #{LIMITS.keys.join(', ')}"
+  end
+  LIMITS[key] = val.to_f
+end
+
+def fib(n)
+  n < 2 ? n : fib(n - 1) + fib(n - 2)
+end
+
+class Shape
+  def area; 0; end
+end
+
+class Square < Shape
+  def initialize(s); @s = s; end
+  def area; @s * @s; end
+end
+
+class Rect < Shape
+  def initialize(w, h); @w = w; @h = h; end
+  def area; @w * @h; end
+end
+
+class Circle < Shape
+  def initialize(r); @r = r; end
+  def area; 3 * @r * @r; end
+end
+
+class BenchError < StandardError
+end
+
+def raise_at(depth)
+  if depth == 0
+    raise BenchError, "bench"
+  end
+  raise_at(depth - 1)
+end
+
+WORKLOADS = [
+  ["fib", lambda { fib(24) }],
+  ["dispatch", lambda {
+    shapes = [Square.new(3), Rect.new(2, 5), Circle.new(4), Shape.new]
+    sum = 0
+    i = 0
+    while i < 200_000
+      sum += shapes[i % 4].area
+      i += 1
+    end
+    sum
+  }],
+  ["strings", lambda {
+    s = ""
+    20_000.times do |i|
+      s << "item " << i.to_s << ","
+    end
+    s.size
+  }],
+  ["blocks", lambda {
+    a = (1..1000).to_a
+    sum = 0
+    100.times do
+      sum += a.map { |x| x * 2 }.select { |x| x % 3 == 0 }.inject(0) { |m, x| m + x }
+    end
+    sum
+  }],
+  ["exceptions", lambda {
+    n = 0
+    10_000.times do
+      begin
+        raise_at(5)
+      rescue BenchError
+        n += 1
+      end
+    end
+    n
+  }],
+]
+
+# Fastest and mean time of ROUNDS runs of work
+def bench_time(work)
+  best = nil
+  total = 0.0
+  ROUNDS.times do
+    t = Time.now
+    work.call
+    t = Time.now - t
+    best = t if !best || t < best
+    total += t
+  end
+  [best, total / ROUNDS]
+end
+
+# Run work in a mode, nil stopping the profiler
+def run_mode(mode, work)
+  Profiler.stop
+  if mode
+    Profiler.mode = mode
+    Profiler.reset
+    Profiler.start
+  end
+  t = bench_time(work)
+  Profiler.stop
+  t
+end
+
+# Instructions executed and seconds recorded since the last reset
+def recorded
+  insns = 0
+  time = 0.0
+  Profiler.irep_num.times do |ino|
+    counts, times, _bytes, _objs, gcs = Profiler.irep_counters(ino)
+    counts.each { |c| insns += c }
+    times.each { |t| time += t }
+    gcs.each { |t| time += t } if gcs
+  end
+  [insns, time + Profiler.overhead[2]]
+end
+
+failures = []
+printf("%-11s %9s %8s %8s %9s %7s\n",
+       "workload", "off ms", "exact", "sampled", "ns/insn", "drift")
+WORKLOADS.each do |name, work|
+  # Warm up method caches and the heap
+  run_mode(nil, work)
+
+  off, = run_mode(nil, work)
+  exact, mean = run_mode(:exact, work)
+  # Recorded counts cover every round, not only the fastest
+  insns, rec = recorded
+  insns /= ROUNDS
+  rec /= ROUNDS
+  sampled, = run_mode(:sampled, work)
+
+  slow_exact = exact / off
+  slow_sampled = sampled / off
+  ns = insns > 0 ? (exact - off) * 1e9 / insns : 0.0
+  drift = (rec - mean).abs / mean
+  printf("%-11s %9.2f %7.2fx %7.2fx %9.1f %6.1f%%\n",
+         name, off * 1000, slow_exact, slow_sampled, ns, drift * 100)
+
+  failures << "#{name}: exact #{ns} ns/insn" if ns > LIMITS["exact_ns"]
+  failures << "#{name}: exact slowdown #{slow_exact}" if slow_exact > LIMITS["exact"]
+  failures << "#{name}: sampled slowdown #{slow_sampled}" if slow_sampled > LIMITS["sampled"]
+  failures << "#{name}: recorded time off by #{drift}" if drift > LIMITS["drift"]
+end
+Profiler.mode = :exact
+
+unless failures.empty?
+  raise "profiler overhead regressed:\n  " + failures.join("\n  ")
+end
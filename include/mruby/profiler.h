@@ -0,0 +1,33 @@
+/* Profiler for ruby - C API */
+#ifndef MRUBY_PROFILER_H
+#define MRUBY_PROFILER_H
+
+#include "mruby.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+//Install the profiling hook, collecting into the existing profile
+MRB_API void mrb_profiler_start(mrb_state *mrb);
+//Remove the profiling hook, the VM runs at full speed until restarted
+MRB_API void mrb_profiler_stop(mrb_state *mrb);
+//Whether the profiling hook is installed
+MRB_API mrb_bool mrb_profiler_running_p(mrb_state *mrb);
+//Zero every counter, keeping the call tree
+MRB_API void mrb_profiler_reset(mrb_state *mrb);
+//Copy the profile into a Profiler::Snapshot object
+MRB_API mrb_value mrb_profiler_snapshot(mrb_state *mrb);
+//Combine the profiles of several VMs, each typically run by its own
+//thread, into a Profiler::Snapshot of mrb. The VMs in srcs (which may
+//include mrb) must be idle while they are read.
+MRB_API mrb_value mrb_profiler_merge(mrb_state *mrb, mrb_state **srcs,
+                                     int nsrc);
+//Write the profile to a binary dump, see Profiler.load
+MRB_API void mrb_profiler_dump(mrb_state *mrb, const char *path);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
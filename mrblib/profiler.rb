@@ -1,214 +1,471 @@
 module Profiler
-  #Perform analysis on the collected profile information
-  #
-  # Note: if profiling an embedded mruby instance be aware that the execution
-  #       time of the return instruction leaving the mruby VM will be
-  #       overestimated
-  def self.analyze
-      analyze_normal
-      #analyze_kcached
-  end
+  #Reports over a profile, shared by the live profile (Profiler itself)
+  #and frozen copies of it (Profiler::Snapshot)
+  module Report
+    #Perform analysis on the collected profile information
+    #
+    # Note: if profiling an embedded mruby instance be aware that the execution
+    #       time of the return instruction leaving the mruby VM will be
+    #       overestimated
+    def analyze
+        analyze_normal
+        #analyze_kcached
+    end
 
-  #Produce a kcachegrind compatiable output to STDOUT
-  #
-  #Note: There appears to be some issue in the output including:
-  #      1. Multiple traces of the same method (with different callstacks)
-  #      2. Incorrect estimates of cumulative call costs (see lines after
-  #         'calls='
-  #      3. Multiple methods using the same IREP sequence (it's unclear if mruby
-  #         is mapping different methods to the same IREP instance if the locals
-  #         and VM code sequence is the same. If it is, then IREP pointers are
-  #         no longer a valid UUID for a method call).
-  def self.analyze_kcached
-    ireps = {}
-    ireps2 = {}
-    print("version: 1\n")
-    print("positions: instr\n")
-    print("events: ticks\n")
-    virtuals = []
-
-    #Build map of irep addresses to alias numbers
-    irep_num.times do |ino|
-      insir = get_irep_info(ino)
-      id    = insir[0]
-      meth  = "#{insir[1]}##{insir[2]}"
-      if(ireps.include?(id))
-        if(ireps2[id] == meth)
-          #puts "duplicate address?"
-        else
-          #puts "duplicate and invalid address?"
-          virtuals << meth
+    #Produce a kcachegrind compatiable output to STDOUT
+    #
+    #Note: There appears to be some issue in the output including:
+    #      1. Multiple traces of the same method (with different callstacks)
+    #      2. Multiple methods using the same IREP sequence (it's unclear if mruby
+    #         is mapping different methods to the same IREP instance if the locals
+    #         and VM code sequence is the same. If it is, then IREP pointers are
+    #         no longer a valid UUID for a method call).
+    def analyze_kcached
+      ireps = {}
+      ireps2 = {}
+      print("version: 1\n")
+      print("positions: instr\n")
+      events = event_names
+      print("events: ticks #{events.join(' ')}\n")
+      virtuals = []
+
+      #Build map of irep addresses to alias numbers
+      irep_num.times do |ino|
+        insir = get_irep_info(ino)
+        id    = insir[0]
+        meth  = "#{insir[1]}##{insir[2]}"
+        if(ireps.include?(id))
+          if(ireps2[id] == meth)
+            #puts "duplicate address?"
+          else
+            #puts "duplicate and invalid address?"
+            virtuals << meth
+          end
+        end
+        ireps[id] = ino
+        ireps2[id] = meth
+        print("fl=(#{ino}) #{insir[3]}\n") if insir[3]
+        print("fn=(#{ino}) #{insir[1]}##{insir[2]}\n")
+      end
+
+      irep_num.times do |ino|
+        insir = get_irep_info(ino)
+        irepno = ireps[insir[0]]
+        print("fl=(#{irepno}) #{insir[3]}\n") if insir[3]
+        print("fn=(#{irepno}) #{insir[1]}##{insir[2]}\n")
+
+        counters = irep_counters(ino)
+        counters[1].each_with_index do |time, ioff|
+          next if (time * 10000000).to_i == 0
+          evs = counters[5] ? " #{counters[5][ioff].join(' ')}" : ""
+          print("#{insir[0]} #{(time * 10000000).to_i}#{evs}\n")
+        end
+
+        childs = insir[4]
+        ccalls = insir[5]
+        childs.size.times do |cno|
+          ch_irepno = ireps[childs[cno]]
+          next if(ch_irepno.nil?)
+          ch_irep = get_irep_info(ch_irepno)
+          print("cfl=(#{ch_irepno}) #{ch_irep[3]}\n") if ch_irep[3]
+          print("cfn=(#{ch_irepno}) #{ch_irep[1]}##{ch_irep[2]}\n")
+          #Inclusive cost of the call from this context
+          incl = get_irep_info(insir[9][cno])[7]
+          print("calls=#{ccalls[cno]} +1\n")
+          print("#{ch_irep[0]} #{(incl * 10000000).to_i}\n")
         end
       end
-      ireps[id] = ino
-      ireps2[id] = meth
-      print("fl=(#{ino}) #{insir[3]}\n") if insir[3]
-      print("fn=(#{ino}) #{insir[1]}##{insir[2]}\n")
     end
 
-    irep_num.times do |ino|
-      insir = get_irep_info(ino)
-      irepno = ireps[insir[0]]
-      print("fl=(#{irepno}) #{insir[3]}\n") if insir[3]
-      print("fn=(#{irepno}) #{insir[1]}##{insir[2]}\n")
-
-      ilen(ino).times do |ioff|
-        insin = get_inst_info(ino, ioff)
-        next if (insin[3] * 10000000).to_i == 0
-        print("#{insir[0]} #{(insin[3] * 10000000).to_i}\n")
-      end
-
-      childs = insir[4]
-      ccalls = insir[5]
-      childs.size.times do |cno|
-        ch_irepno = ireps[childs[cno]]
-        next if(ch_irepno.nil?)
-        ch_irep = get_irep_info(ch_irepno)
-        print("cfl=(#{ch_irepno}) #{ch_irep[3]}\n") if ch_irep[3]
-        print("cfn=(#{ch_irepno}) #{ch_irep[1]}##{ch_irep[2]}\n")
-        print("calls=#{ccalls[cno]} +1\n")
-        print("#{ch_irep[0]} 1000\n")
-        #print("1 1000\n")
+    #Print instructions merged across call contexts sharing an irep
+    #
+    #Arguments:
+    # - infos: Array of [irep number, offset, count, time, irep id,
+    #          bytes, objects, GC time, performance counts or nil]
+    # - alloc: Whether to print allocation columns
+    # - gc:    Whether to print the GC time column
+    # - nev:   Number of performance counter columns
+    #Returns:
+    # - Times of the printed instructions above 1us
+    def print_codes(infos, alloc = false, gc = false, nev = 0)
+      codes = {}
+      infos.each do |info|
+        key = "#{info[4]}+#{info[1]}"
+        codes[key] ||= [info[0], info[1], 0, 0.0, 0, 0, 0.0, [0] * nev]
+        codes[key][2] += info[2]
+        codes[key][3] += info[3]
+        codes[key][4] += info[5]
+        codes[key][5] += info[6]
+        codes[key][6] += info[7]
+        if info[8] then
+          nev.times {|i| codes[key][7][i] += info[8][i] }
+        end
+      end
+
+      itimes = []
+      codes.each do |key, val|
+        code = disasm(val[0], val[1])
+        num  = val[2]
+        time = val[3]
+        cols = ""
+        cols += sprintf(" %10d %8d", val[4], val[5]) if alloc
+        cols += sprintf(" GC %-7.5f", val[6]) if gc
+        val[7].each {|cnt| cols += sprintf(" %12d", cnt) }
+        printf("            %10d %-7.5f%s    %s \n" , num, time, cols, code)
+        itimes << time if time > 1e-6
       end
+      itimes
     end
-  end
 
-  #Display normal mixed source level/VM level analysis of traced results
-  #
-  #The default format is:
-  #
-  #LINE TIME_SECONDS SOURCE_LINE
-  #     NUM_EXECUTIONS TIME_SECONDS DECODED_VM_INSTRUCTION
-  def self.analyze_normal
-
-    #Known source
-    files = {}
-    #Methods without corresponding source
-    nosrc = {}
-
-    #Time spent in individual instructions
-    #Used in summary
-    itimes = []
-
-    #Map method/instruction level info to:
-    # - file+line                    OR
-    # - method+instruction offset
-    total_time = 0.0
-    irep_num.times do |ino|
-      fn = get_inst_info(ino, 0)[0]
-      if fn.is_a?(String) then
-        files[fn] ||= {}
-        ilen(ino).times do |ioff|
-          info   = get_inst_info(ino, ioff)
-          total_time += info[3]
-          lineno = info[1]
-          if lineno then
-            files[fn][lineno] ||= []
-            files[fn][lineno].push info
-          end
+    #Display normal mixed source level/VM level analysis of traced results
+    #
+    #The default format is:
+    #
+    #LINE TIME_SECONDS SOURCE_LINE
+    #     NUM_EXECUTIONS TIME_SECONDS DECODED_VM_INSTRUCTION
+    #
+    #If allocations were tracked, instructions also show the bytes and
+    #objects they allocated before the decoded instruction, the time of GC
+    #steps they triggered, which TIME_SECONDS excludes, and the performance
+    #counters named in the header. TIME_SECONDS leaves out the calibrated
+    #cost of the profiler, reported after the total.
+    def analyze_normal
+
+      #Known source
+      files = {}
+      #Methods without corresponding source
+      nosrc = {}
+
+      #Time spent in individual instructions
+      #Used in summary
+      itimes = []
+
+      #Map method/instruction level info to:
+      # - file+line                    OR
+      # - method+instruction offset
+      #
+      #Each instruction is recorded as
+      #[irep number, offset, count, time, irep id, bytes, objects];
+      #disassembly is only fetched for the instructions printed.
+      total_time = 0.0
+      total_bytes = 0
+      total_objs = 0
+      total_gc = 0.0
+      alloc = false
+      events = event_names
+      if events.size > 0 then
+        print("Counters: #{events.join(' ')}\n")
+      end
+      irep_num.times do |ino|
+        insir  = get_irep_info(ino)
+        counts, times, bytes, objs, gcs, evs = irep_counters(ino)
+        if bytes then
+          alloc = true
+          bytes.each {|b| total_bytes += b }
+          objs.each {|o| total_objs += o }
         end
-      else
-        mname = "#{fn[0]}##{fn[1]}"
-        ilen(ino).times do |ioff|
-          info = get_inst_info(ino, ioff)
-          total_time += info[3]
+        gcs.each {|t| total_gc += t } if gcs
+        fn = insir[3]
+        if fn then
+          files[fn] ||= {}
+          lines = irep_lines(ino)
+          times.each_with_index do |time, ioff|
+            total_time += time
+            lineno = lines && lines[ioff]
+            if lineno then
+              files[fn][lineno] ||= []
+              files[fn][lineno].push [ino, ioff, counts[ioff], time, insir[0],
+                                      bytes ? bytes[ioff] : 0,
+                                      objs ? objs[ioff] : 0,
+                                      gcs ? gcs[ioff] : 0.0,
+                                      evs && evs[ioff]]
+            end
+          end
+        else
+          mname = "#{insir[1]}##{insir[2]}"
           nosrc[mname] ||= []
-          nosrc[mname].push info
+          times.each_with_index do |time, ioff|
+            total_time += time
+            nosrc[mname].push [ino, ioff, counts[ioff], time, insir[0],
+                               bytes ? bytes[ioff] : 0,
+                               objs ? objs[ioff] : 0,
+                               gcs ? gcs[ioff] : 0.0,
+                               evs && evs[ioff]]
+          end
         end
       end
-    end
 
-    #Print stats for each line and disassembled VM instructions
-    #which correspond to each line
-    files.each do |fn, infos|
-      lines = read(fn)
-      lines.each_with_index do |lin, i|
-        num = 0
-        time = 0.0
-        if infos[i + 1] then
-          infos[i + 1].each do |info|
-            time += info[3]
-            if num < info[2] then
-              num = info[2]
+      #Print stats for each line and disassembled VM instructions
+      #which correspond to each line
+      files.each do |fn, infos|
+        lines = read(fn)
+        lines.each_with_index do |lin, i|
+          num = 0
+          time = 0.0
+          if infos[i + 1] then
+            infos[i + 1].each do |info|
+              time += info[3]
+              if num < info[2] then
+                num = info[2]
+              end
             end
           end
-        end
 
-        #   Execute Count
-        #        print(sprintf("%04d %10d %s", i, num, lin))
-
-        #   Execute Time
-        print(sprintf("%04d %7.5f %s", i, time, lin))
-
-        #   Execute Time per 1 instruction
-        #        if num != 0 then
-        #          print(sprintf("%04d %4.5f %s", i, time / num, lin))
-        #        else
-        #          print(sprintf("%04d %4.5f %s", i, 0.0, lin))
-        #        end
-        if infos[i + 1] then
-          codes = {}
-          infos[i + 1].each do |info|
-            codes[info[4]] ||= [nil, 0, 0.0]
-            codes[info[4]][0] = info[5]
-            codes[info[4]][1] += info[2]
-            codes[info[4]][2] += info[3]
+          #   Execute Count
+          #        print(sprintf("%04d %10d %s", i, num, lin))
+
+          #   Execute Time
+          print(sprintf("%04d %7.5f %s", i, time, lin))
+
+          #   Execute Time per 1 instruction
+          #        if num != 0 then
+          #          print(sprintf("%04d %4.5f %s", i, time / num, lin))
+          #        else
+          #          print(sprintf("%04d %4.5f %s", i, 0.0, lin))
+          #        end
+          if infos[i + 1] then
+            itimes.concat(print_codes(infos[i + 1], alloc, total_gc > 0,
+                                      events.size))
           end
+        end
+      end
+
+      #Dump stats for lines without any source level information
+      nosrc.each do |mn, infos|
+        method_time = 0.0
+        infos.each do |info|
+          method_time += info[3]
+        end
 
-          codes.each do |val|
-            code = val[1][0]
-            num = val[1][1]
-            time = val[1][2]
-            printf("            %10d %-7.5f    %s \n" , num, time, code)
-            itimes << time if time > 1e-6
+        printf("%s %-7.5f\n", mn, method_time)
+        itimes.concat(print_codes(infos, alloc, total_gc > 0, events.size))
+      end
+      print("Total recorded time = #{total_time} seconds\n")
+      print("GC time = #{total_gc} seconds\n") if total_gc > 0
+      nswitch, switch_time = fiber_switches
+      if nswitch > 0 then
+        print("Fiber switches = #{nswitch} (#{switch_time} seconds)\n")
+      end
+      hook, call, ovh = overhead
+      if ovh > 0 then
+        printf("Profiler overhead = %.5f seconds subtracted (%.1f ns per instruction, %.1f ns per call)\n",
+               ovh, hook * 1e9, call * 1e9)
+      end
+      if alloc then
+        print("Total allocated = #{total_bytes} bytes, #{total_objs} objects\n")
+      end
+      begin
+        itimes = itimes.sort.reverse
+        pr50   = total_time*0.50
+        pr90   = total_time*0.90
+        pr95   = total_time*0.95
+        cum    = 0.0
+        itimes.each_with_index do |t, idx|
+          cum += t
+          if(cum > pr50)
+            print("50% of execution in #{idx+1} VM instructions (above #{t*1000} ms each)\n")
+            pr50 = total_time
+          end
+          if(cum > pr90)
+            print("90% of execution in #{idx+1} VM instructions (above #{t*1000} ms each)\n")
+            pr90 = total_time
+          end
+          if(cum > pr95)
+            print("95% of execution in #{idx+1} VM instructions (above #{t*1000} ms each)\n")
+            break
           end
         end
       end
+      print_latency
     end
 
-    #Dump stats for lines without any source level information
-    nosrc.each do |mn, infos|
-      codes = {}
-      method_time = 0.0
-      infos.each do |info|
-        codes[info[4]] ||= [nil, 0, 0.0]
-        codes[info[4]][0] = info[5]
-        codes[info[4]][1] += info[2]
-        codes[info[4]][2] += info[3]
-        method_time += info[3]
-      end
-
-      printf("%s %-7.5f\n", mn, method_time)
-      codes.each do |val|
-        code = val[1][0]
-        num  = val[1][1]
-        time = val[1][2]
-        printf("            %10d %-7.5f    %s \n" , num, time, code)
-        itimes << time if time > 1e-6
+    #Print the call contexts and instructions with the slowest tails
+    #
+    #Uses the histograms recorded with Profiler.latency_histograms = true
+    #and Profiler.latency_opcodes=, prints nothing without them. Each line
+    #gives the count and the 50th, 90th and 99th percentiles and maximum of
+    #the durations in milliseconds, the slowest 99th percentiles first.
+    #
+    #Arguments:
+    # - top: Number of call contexts and of instructions printed
+    def print_latency(top = 20)
+      meths = []
+      insns = []
+      irep_num.times do |ino|
+        lat = latency(ino)
+        lats = irep_counters(ino)[6]
+        next unless lat || lats
+        insir = get_irep_info(ino)
+        name = "#{insir[1]}##{insir[2]}"
+        meths << [lat, name] if lat
+        next unless lats
+        lines = irep_lines(ino)
+        lats.each_with_index do |l, ioff|
+          next unless l
+          where = insir[3] && lines && lines[ioff] ? " #{insir[3]}:#{lines[ioff]}" : ""
+          insns << [l, "#{name}#{where} #{disasm(ino, ioff)}"]
+        end
+      end
+
+      [["Method latency", meths], ["Instruction latency", insns]].each do |title, rows|
+        next if rows.empty?
+        print("\n#{title} (ms)\n")
+        printf("%10s %9s %9s %9s %9s\n", "count", "p50", "p90", "p99", "max")
+        rows.sort {|x, y| y[0][3] <=> x[0][3] }[0, top].each do |l, name|
+          printf("%10d %9.3f %9.3f %9.3f %9.3f  %s\n", l[0], l[1] * 1000,
+                 l[2] * 1000, l[3] * 1000, l[4] * 1000, name)
+        end
       end
     end
-    print("Total recorded time = #{total_time} seconds\n")
-    begin
-      itimes = itimes.sort.reverse
-      pr50   = total_time*0.50
-      pr90   = total_time*0.90
-      pr95   = total_time*0.95
-      cum    = 0.0
-      itimes.each_with_index do |t, idx|
-        cum += t
-        if(cum > pr50)
-          print("50% of execution in #{idx+1} VM instructions (above #{t*1000} ms each)\n")
-          pr50 = total_time
+
+    #Self times by method, source line and instruction, keyed by names that
+    #don't depend on addresses
+    #
+    #Methods are keyed by the last frame of node_key, lines by file and
+    #line, instructions by method, line, opcode and rank among the same
+    #opcodes of the line, so unchanged code matches across runs.
+    #Returns:
+    # - [methods, lines, instructions, total time], each a Hash of seconds
+    def diff_index
+      meths = {}
+      lines = {}
+      insns = {}
+      opcodes = {}
+      total = 0.0
+      irep_num.times do |ino|
+        insir = get_irep_info(ino)
+        counts, times = irep_counters(ino)
+        frame = node_key(ino).split(";").last
+        src = irep_lines(ino)
+        ops = opcodes[insir[0]]
+        unless ops then
+          #Rank each instruction among the same opcodes of its line
+          ops = []
+          ranks = {}
+          times.size.times do |off|
+            op = "line #{src ? src[off] : '-'} #{disasm(ino, off).split("\t")[0]}"
+            ranks[op] = (ranks[op] || 0) + 1
+            ops << "#{op} ##{ranks[op]}"
+          end
+          opcodes[insir[0]] = ops
         end
-        if(cum > pr90)
-          print("90% of execution in #{idx+1} VM instructions (above #{t*1000} ms each)\n")
-          pr90 = total_time
+        times.each_with_index do |time, off|
+          next if counts[off] == 0 && time == 0.0
+          total += time
+          meths[frame] = (meths[frame] || 0.0) + time
+          if src && insir[3] then
+            line = "#{insir[3]}:#{src[off]}"
+            lines[line] = (lines[line] || 0.0) + time
+          end
+          insn = "#{frame} #{ops[off]}"
+          insns[insn] = (insns[insn] || 0.0) + time
         end
-        if(cum > pr95)
-          print("95% of execution in #{idx+1} VM instructions (above #{t*1000} ms each)\n")
-          break
+      end
+      [meths, lines, insns, total]
+    end
+
+    #Print the entries whose share of the total time changed most
+    #
+    #Arguments:
+    # - title: Name of the level
+    # - old:   Hash of seconds of the base profile
+    # - new:   Hash of seconds of this profile, same keys
+    # - otot:  Total time of the base profile
+    # - ntot:  Total time of this profile
+    # - top:   Number of regressions and of improvements printed
+    def print_diff(title, old, new, otot, ntot, top)
+      rows = []
+      keys = old.keys
+      new.each {|key, _| keys << key unless old.key?(key) }
+      keys.each do |key|
+        otime = old[key] || 0.0
+        ntime = new[key] || 0.0
+        oshare = otot > 0 ? otime / otot : 0.0
+        nshare = ntot > 0 ? ntime / ntot : 0.0
+        rows << [nshare - oshare, oshare, nshare, otime, ntime, key]
+      end
+      rows = rows.sort {|x, y| y[0] <=> x[0] }
+
+      print("\n#{title}\n")
+      ["Regressions", "Improvements"].each do |kind|
+        print("  #{kind}\n")
+        (kind == "Regressions" ? rows : rows.reverse)[0, top].each do |row|
+          delta, oshare, nshare, otime, ntime, key = row
+          next if kind == "Regressions" ? delta <= 0 : delta >= 0
+          printf("  %+7.2f%% %6.2f%% -> %6.2f%% %9.5f -> %9.5f  %s\n",
+                 delta * 100, oshare * 100, nshare * 100, otime, ntime, key)
         end
       end
     end
+
+    #Compare the profile with one of an earlier run
+    #
+    #Methods, source lines and instructions of both profiles are lined up
+    #by name (see diff_index) and compared as shares of each profile's
+    #total time, so runs of different lengths or on different hosts can be
+    #compared. The largest regressions and improvements of each level are
+    #printed with the change of share, both shares and both times in
+    #seconds.
+    #
+    #Arguments:
+    # - base: Profile compared against, such as Profiler.load(path)
+    # - top:  Number of regressions and of improvements printed per level
+    def diff(base, top = 10)
+      old = base.diff_index
+      new = diff_index
+      otot = old[3]
+      ntot = new[3]
+      printf("Total recorded time = %.5f -> %.5f seconds", otot, ntot)
+      printf(" (%+.1f%%)", (ntot - otot) * 100 / otot) if otot > 0
+      print("\n")
+      print_diff("Methods", old[0], new[0], otot, ntot, top)
+      print_diff("Lines", old[1], new[1], otot, ntot, top)
+      print_diff("Instructions", old[2], new[2], otot, ntot, top)
+    end
+  end
+
+  extend Report
+
+  #Print the opcode histogram and the most frequent and most expensive
+  #consecutive opcode pairs collected with Profiler.opcode_stats = true
+  #
+  #The cost of a pair is its count times the mean times of both opcodes,
+  #the time a superinstruction replacing it would stand for.
+  #
+  #Arguments:
+  # - top: Number of pairs listed in each ranking
+  def self.analyze_opcodes(top = 20)
+    counts = opcode_counts
+    total = 0.0
+    mean = {}
+    counts.each do |name, num, time|
+      total += time
+      mean[name] = time / num
+    end
+
+    print("Opcode                  Count    Time(s)    ns/exec      %\n")
+    counts.sort {|x, y| y[2] <=> x[2] }.each do |name, num, time|
+      printf("%-16s %12d %10.5f %10.1f %6.2f\n", name, num, time,
+             time / num * 1e9, total > 0 ? time * 100 / total : 0.0)
+    end
+
+    pairs = opcode_pairs
+    print("\nMost frequent opcode pairs\n")
+    pairs.sort {|x, y| y[2] <=> x[2] }[0, top].each do |op1, op2, num|
+      printf("%-16s %-16s %12d\n", op1, op2, num)
+    end
+
+    print("\nMost expensive opcode pairs\n")
+    costs = pairs.map do |op1, op2, num|
+      [op1, op2, num, num * (mean[op1] + mean[op2].to_f)]
+    end
+    costs.sort {|x, y| y[3] <=> x[3] }[0, top].each do |op1, op2, num, cost|
+      printf("%-16s %-16s %12d %10.5f\n", op1, op2, num, cost)
+    end
+  end
+
+  #Copy of the profile taken by Profiler.snapshot
+  class Snapshot
+    include Report
   end
 end
@@ -0,0 +1,229 @@
+/* Profiler for ruby - bump allocator for profiler metadata */
+#include "mruby.h"
+#include "profiler.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Size of regular arena chunks
+#define PROF_ARENA_CHUNK_SIZE (64 * 1024)
+//Alignment of every allocation, that of the chunk data union
+#define PROF_ARENA_ALIGN 8
+//Requests larger than this get a chunk of their own
+#define PROF_ARENA_BIG (PROF_ARENA_CHUNK_SIZE / 4)
+
+struct prof_arena_chunk {
+  struct prof_arena_chunk *next; //Previously filled chunk
+  size_t size;                   //Usable bytes in data
+  size_t used;                   //Bytes handed out
+  union {
+    uint64_t u;
+    void *p;
+    double d;
+  } data[1];                     //Aligned start of the chunk memory
+};
+
+#define PROF_ARENA_HEADER offsetof(struct prof_arena_chunk, data)
+
+//Report allocation failure without going through the mruby allocator
+static void
+prof_arena_nomem(mrb_state *mrb)
+{
+  mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+}
+
+//Get a new zero filled chunk with size usable bytes
+static struct prof_arena_chunk *
+prof_arena_chunk_new(mrb_state *mrb, size_t size)
+{
+  struct prof_arena_chunk *chunk;
+
+  chunk = (struct prof_arena_chunk *)calloc(1, PROF_ARENA_HEADER + size);
+  if (!chunk) {
+    prof_arena_nomem(mrb);
+  }
+  chunk->size = size;
+
+  return chunk;
+}
+
+//Allocate zero filled memory which lives until mrb_profiler_arena_free
+//
+//Memory comes from the system allocator so the GC never accounts for it
+//and nothing runs inside the VM while the hook allocates.
+//
+//Arguments:
+// - mrb:   mruby state, only used to report allocation failure
+// - arena: arena to allocate from
+// - size:  bytes requested
+void *
+mrb_profiler_arena_alloc(mrb_state *mrb, struct prof_arena *arena,
+                         size_t size)
+{
+  struct prof_arena_chunk *chunk = arena->chunk;
+  void *res;
+
+  size = (size + PROF_ARENA_ALIGN - 1) & ~(size_t)(PROF_ARENA_ALIGN - 1);
+  arena->total += size;
+
+  //Large blocks get a chunk of their own behind the current one, so the
+  //free space left in the current chunk isn't wasted
+  if (size > PROF_ARENA_BIG) {
+    chunk = prof_arena_chunk_new(mrb, size);
+    chunk->used = size;
+    if (arena->chunk) {
+      chunk->next = arena->chunk->next;
+      arena->chunk->next = chunk;
+    }
+    else {
+      arena->chunk = chunk;
+    }
+    return chunk->data;
+  }
+
+  if (!chunk || chunk->size - chunk->used < size) {
+    chunk = prof_arena_chunk_new(mrb, PROF_ARENA_CHUNK_SIZE - PROF_ARENA_HEADER);
+    chunk->next = arena->chunk;
+    arena->chunk = chunk;
+  }
+
+  res = (char *)chunk->data + chunk->used;
+  chunk->used += size;
+
+  return res;
+}
+
+//Find the entry of a table a key stands for
+//
+//The table first grows so that one more entry fits, then the entry
+//matching key is returned, or else the empty slot where it goes. The
+//caller fills that slot and counts it in tab->num.
+//
+//Arguments:
+// - mrb:  mruby state, only used to report allocation failure
+// - tab:  table
+// - type: how its entries are sized, hashed and matched
+// - key:  key type->match compares entries with
+// - hash: hash of key, the one type->hash gives for its entry
+void *
+mrb_profiler_tab_get(mrb_state *mrb, struct prof_tab *tab,
+                     const struct prof_tab_type *type, const void *key,
+                     uint32_t hash)
+{
+  char *ent;
+  uint32_t mask;
+  uint32_t h;
+
+  //Keep the table at most half full, counting the entry about to be added
+  if (tab->capa <= (tab->num + 1) * 2) {
+    uint32_t size = tab->capa ? tab->capa * 2 : type->init;
+    char *slots = (char *)calloc(size, type->size);
+    uint32_t i;
+
+    if (!slots) {
+      prof_arena_nomem(mrb);
+    }
+    for (i = 0; i < tab->capa; i++) {
+      ent = (char *)tab->ent + i * type->size;
+      if (PROF_TAB_USED(ent)) {
+        for (h = type->hash(ent) & (size - 1);
+             PROF_TAB_USED(slots + h * type->size);
+             h = (h + 1) & (size - 1));
+        memcpy(slots + h * type->size, ent, type->size);
+      }
+    }
+    free(tab->ent);
+    tab->ent = slots;
+    tab->capa = size;
+  }
+
+  mask = tab->capa - 1;
+  for (h = hash & mask; ; h = (h + 1) & mask) {
+    ent = (char *)tab->ent + h * type->size;
+    if (!PROF_TAB_USED(ent) || type->match(ent, key)) {
+      return ent;
+    }
+  }
+}
+
+//Release the slots of a table, leaving it empty
+void
+mrb_profiler_tab_free(struct prof_tab *tab)
+{
+  free(tab->ent);
+  memset(tab, 0, sizeof(*tab));
+}
+
+//Hash a C string for the intern table
+static uint32_t
+prof_str_hash(const char *str)
+{
+  uint32_t h = 2166136261u;
+
+  while (*str) {
+    h = (h ^ (unsigned char)*str++) * 16777619u;
+  }
+  return h;
+}
+
+static uint32_t
+prof_str_ent_hash(const void *ent)
+{
+  return prof_str_hash(*(const char * const *)ent);
+}
+
+static mrb_bool
+prof_str_ent_match(const void *ent, const void *key)
+{
+  return strcmp(*(const char * const *)ent, (const char *)key) == 0;
+}
+
+//Interned strings, keyed by their text
+static const struct prof_tab_type prof_str_tab = {
+  sizeof(const char *), 256, prof_str_ent_hash, prof_str_ent_match
+};
+
+//Get a copy of str shared by every equal string interned in arena
+//
+//Arguments:
+// - mrb:   mruby state, only used to report allocation failure
+// - arena: arena holding the copy
+// - str:   NUL terminated string
+const char *
+mrb_profiler_arena_intern(mrb_state *mrb, struct prof_arena *arena,
+                          const char *str)
+{
+  const char **ent;
+  char *copy;
+  size_t len;
+
+  ent = (const char **)mrb_profiler_tab_get(mrb, &arena->strs, &prof_str_tab,
+                                            str, prof_str_hash(str));
+  if (*ent) {
+    return *ent;
+  }
+
+  len = strlen(str);
+  copy = (char *)mrb_profiler_arena_alloc(mrb, arena, len + 1);
+  memcpy(copy, str, len + 1);
+  *ent = copy;
+  arena->strs.num++;
+
+  return copy;
+}
+
+//Release everything allocated from arena at once
+void
+mrb_profiler_arena_free(struct prof_arena *arena)
+{
+  struct prof_arena_chunk *chunk = arena->chunk;
+
+  while (chunk) {
+    struct prof_arena_chunk *next = chunk->next;
+
+    free(chunk);
+    chunk = next;
+  }
+  mrb_profiler_tab_free(&arena->strs);
+  memset(arena, 0, sizeof(*arena));
+}
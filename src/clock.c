@@ -0,0 +1,150 @@
+/* Profiler for ruby - clock selection and calibration */
+#include "mruby.h"
+#include "profiler.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#if defined(CLOCK_MONOTONIC_RAW)
+#define PROF_CLOCK_ID   CLOCK_MONOTONIC_RAW
+#define PROF_CLOCK_NAME "monotonic_raw"
+#else
+#define PROF_CLOCK_ID   CLOCK_MONOTONIC
+#define PROF_CLOCK_NAME "monotonic"
+#endif
+
+//Time spent comparing the TSC against the monotonic clock
+#define PROF_CALIBRATE_NSEC 10000000
+//Number of back to back reads used to measure resolution
+#define PROF_RESOLUTION_READS 1000
+
+struct prof_clock mrb_profiler_clock = {
+  PROF_CLOCK_MONOTONIC, PROF_CLOCK_NAME, PROF_CLOCK_ID, 1e-9, 1e-9
+};
+
+//Read the monotonic clock in nanoseconds
+static uint64_t
+prof_monotonic_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//Check that the TSC ticks at a constant rate across P/C-states
+//and whether rdtscp is available
+static int
+prof_tsc_invariant(int *has_rdtscp)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  *has_rdtscp = 0;
+  if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+    return 0;
+  }
+  if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+    *has_rdtscp = (edx >> 27) & 1;
+  }
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return (edx >> 8) & 1;
+}
+
+//Measure the TSC frequency against CLOCK_MONOTONIC
+static double
+prof_tsc_calibrate(void)
+{
+  uint64_t t0, t1, c0, c1;
+
+  t0 = prof_monotonic_ns();
+  c0 = prof_curtime();
+  do {
+    t1 = prof_monotonic_ns();
+  } while (t1 - t0 < PROF_CALIBRATE_NSEC);
+  c1 = prof_curtime();
+
+  return (double)(t1 - t0) * 1e-9 / (double)(c1 - c0);
+}
+#endif
+
+//Measure the smallest non zero step of the selected clock in seconds
+static double
+prof_clock_resolution(void)
+{
+  uint64_t prev = prof_curtime();
+  uint64_t step = 0;
+  int i;
+
+  for (i = 0; i < PROF_RESOLUTION_READS; i++) {
+    uint64_t now = prof_curtime();
+
+    if (now != prev && (step == 0 || now - prev < step)) {
+      step = now - prev;
+    }
+    prev = now;
+  }
+
+  return PROF_TICK2SEC(step);
+}
+
+//Select and calibrate the clock read by prof_curtime()
+//
+//The TSC is preferred when it is invariant. MRUBY_PROFILER_CLOCK can force
+//"tsc", "rdtscp" or "monotonic".
+static void
+prof_clock_setup(void)
+{
+  const char *env = getenv("MRUBY_PROFILER_CLOCK");
+  struct prof_clock *clk = &mrb_profiler_clock;
+
+#if defined(__x86_64__) || defined(__i386__)
+  {
+    int has_rdtscp;
+    int invariant = prof_tsc_invariant(&has_rdtscp);
+
+    if (env ? strcmp(env, "tsc") == 0 : invariant) {
+      clk->kind = PROF_CLOCK_TSC;
+      clk->name = "tsc";
+    }
+    else if (env && strcmp(env, "rdtscp") == 0 && has_rdtscp) {
+      clk->kind = PROF_CLOCK_TSCP;
+      clk->name = "rdtscp";
+    }
+    if (clk->kind != PROF_CLOCK_MONOTONIC) {
+      clk->sec_per_tick = prof_tsc_calibrate();
+    }
+  }
+#else
+  (void) env;
+#endif
+
+  clk->resolution = prof_clock_resolution();
+}
+
+//Set up the clock once per process
+//
+//VMs opened on several threads at once wait for the first one to finish
+//calibrating rather than reading a clock half set up.
+void
+mrb_profiler_clock_init(void)
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+  pthread_once(&once, prof_clock_setup);
+}
+
+//Read the wall clock in microseconds since the epoch, which dumps record to
+//tell when their counters were taken
+uint64_t
+mrb_profiler_wall_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000;
+}
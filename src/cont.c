@@ -0,0 +1,431 @@
+/* Profiler for ruby - continuous profiling to rotating delta files */
+#include "mruby.h"
+#include "mruby/string.h"
+#include "mruby/throw.h"
+#include "mruby/profiler.h"
+#include "profiler.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//Longest wait of the writer thread in milliseconds, so a long interval
+//can't overflow the poll() timeout
+#define PROF_CONT_MAX_WAIT 3600000
+
+//Commands written to the pipe of the writer thread
+#define PROF_CONT_WRITE  'w' //Deltas were queued
+#define PROF_CONT_SIGNAL 's' //SIGUSR2 was received
+#define PROF_CONT_QUIT   'q' //Write the queued deltas and exit
+
+//Delta serialized by a VM thread, waiting for the writer thread
+struct prof_cont_job {
+  struct prof_cont_job *next;
+  char *path;                  //File to create
+  char *expire;                //File rotated out, NULL if none
+  char *data;                  //Dump
+  size_t len;
+};
+
+//Held while the writer thread is started or stopped
+static pthread_mutex_t prof_cont_life = PTHREAD_MUTEX_INITIALIZER;
+//Guards the queue, the user count and the settings of every state
+static pthread_mutex_t prof_cont_lock = PTHREAD_MUTEX_INITIALIZER;
+static int prof_cont_users = 0;              //States in continuous mode
+static pthread_t prof_cont_thread;
+static int prof_cont_pipe[2] = { -1, -1 };   //Wakes the writer thread
+static struct prof_cont_job *prof_cont_jobs = NULL; //Queue, oldest first
+static struct prof_cont_job **prof_cont_tail = &prof_cont_jobs;
+static struct sigaction prof_cont_oldact;    //SIGUSR2 action replaced
+
+//Read the monotonic clock in milliseconds
+static uint64_t
+prof_cont_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+//Send a command to the writer thread, never blocking
+static void
+prof_cont_wake(char cmd)
+{
+  ssize_t n = write(prof_cont_pipe[1], &cmd, 1);
+
+  //A full pipe already wakes the thread
+  (void) n;
+}
+
+//Take a delta of every state on SIGUSR2
+static void
+prof_cont_signal(int sig)
+{
+  int err = errno;
+  (void) sig;
+
+  prof_cont_wake(PROF_CONT_SIGNAL);
+  errno = err;
+}
+
+static void
+prof_cont_job_free(struct prof_cont_job *job)
+{
+  free(job->path);
+  free(job->expire);
+  free(job->data);
+  free(job);
+}
+
+//Write a delta next to its file and rename it into place, so readers
+//never see a partial dump
+static void
+prof_cont_write(struct prof_cont_job *job)
+{
+  size_t len = strlen(job->path) + sizeof(".tmp");
+  char *tmp = (char *)malloc(len);
+  FILE *fp;
+  int ok;
+
+  if (!tmp) {
+    return;
+  }
+  snprintf(tmp, len, "%s.tmp", job->path);
+  fp = fopen(tmp, "wb");
+  ok = fp && fwrite(job->data, 1, job->len, fp) == job->len;
+  if (fp && fclose(fp) != 0) {
+    ok = 0;
+  }
+  if (!ok || rename(tmp, job->path) != 0) {
+    //No Ruby code to raise in, the profiled program goes on
+    fprintf(stderr, "mruby-profiler: can't write %s\n", job->path);
+    remove(tmp);
+  }
+  else if (job->expire) {
+    remove(job->expire);
+  }
+  free(tmp);
+}
+
+//Times of the next deltas, gathered by prof_cont_tick
+struct prof_cont_tick {
+  uint64_t now;                //Monotonic milliseconds
+  uint64_t next;               //Earliest delta still to come, 0 if none
+  mrb_bool all;                //Whether SIGUSR2 asks every state for one
+};
+
+//Ask a state for a delta when one is due
+static void
+prof_cont_tick(struct prof_state *ps, void *ud)
+{
+  struct prof_cont_tick *tick = (struct prof_cont_tick *)ud;
+  struct prof_cont *pc = &ps->cont;
+
+  if (!pc->prefix) {
+    return;
+  }
+  if (tick->all) {
+    pc->request = 1;
+  }
+  if (pc->interval) {
+    if (pc->due <= tick->now) {
+      pc->request = 1;
+      //A VM busy in C code past several intervals takes a single delta
+      while (pc->due <= tick->now) {
+        pc->due += pc->interval;
+      }
+    }
+    if (!tick->next || pc->due < tick->next) {
+      tick->next = pc->due;
+    }
+  }
+}
+
+//Writer thread
+//
+//Sleeps until the next delta is due or a command arrives, asks the VMs for
+//their deltas and writes those they queued. Files are only written here,
+//so the VM threads never wait for I/O.
+static void *
+prof_cont_main(void *arg)
+{
+  int timeout = -1;
+  mrb_bool quit = FALSE;
+  (void) arg;
+
+  while (!quit) {
+    struct prof_cont_tick tick;
+    struct prof_cont_job *jobs;
+    struct pollfd pfd;
+    char cmd[64];
+    ssize_t n;
+    ssize_t i;
+
+    pfd.fd = prof_cont_pipe[0];
+    pfd.events = POLLIN;
+    poll(&pfd, 1, timeout);
+
+    tick.all = FALSE;
+    while ((n = read(prof_cont_pipe[0], cmd, sizeof(cmd))) > 0) {
+      for (i = 0; i < n; i++) {
+        if (cmd[i] == PROF_CONT_SIGNAL) {
+          tick.all = TRUE;
+        }
+        else if (cmd[i] == PROF_CONT_QUIT) {
+          quit = TRUE;
+        }
+      }
+    }
+
+    tick.now = prof_cont_now();
+    tick.next = 0;
+    pthread_mutex_lock(&prof_cont_lock);
+    mrb_profiler_state_each(prof_cont_tick, &tick);
+    jobs = prof_cont_jobs;
+    prof_cont_jobs = NULL;
+    prof_cont_tail = &prof_cont_jobs;
+    pthread_mutex_unlock(&prof_cont_lock);
+
+    timeout = -1;
+    if (tick.next) {
+      timeout = tick.next - tick.now < PROF_CONT_MAX_WAIT
+        ? (int)(tick.next - tick.now) : PROF_CONT_MAX_WAIT;
+    }
+
+    while (jobs) {
+      struct prof_cont_job *next = jobs->next;
+
+      prof_cont_write(jobs);
+      prof_cont_job_free(jobs);
+      jobs = next;
+    }
+  }
+
+  return NULL;
+}
+
+//Start the writer thread and catch SIGUSR2
+//
+//Returns:
+// - Whether the thread runs
+static mrb_bool
+prof_cont_launch(void)
+{
+  struct sigaction act;
+  int i;
+
+  if (pipe(prof_cont_pipe) != 0) {
+    return FALSE;
+  }
+  for (i = 0; i < 2; i++) {
+    fcntl(prof_cont_pipe[i], F_SETFL,
+          fcntl(prof_cont_pipe[i], F_GETFL) | O_NONBLOCK);
+    fcntl(prof_cont_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+  if (pthread_create(&prof_cont_thread, NULL, prof_cont_main, NULL) != 0) {
+    close(prof_cont_pipe[0]);
+    close(prof_cont_pipe[1]);
+    prof_cont_pipe[0] = prof_cont_pipe[1] = -1;
+    return FALSE;
+  }
+
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = prof_cont_signal;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &act, &prof_cont_oldact);
+
+  return TRUE;
+}
+
+//Start writing deltas of a VM's profile
+//
+//Each delta is a complete dump of the call tree whose counters cover the
+//time since the previous one, the first one the time since the last
+//reset. Deltas are taken every interval and on SIGUSR2, at the next
+//instruction the VM fetches. A VM already in continuous mode writes its
+//last delta under the previous settings first.
+//
+//Arguments:
+// - mrb:      mruby state
+// - ps:       profiler state of mrb
+// - prefix:   files are prefix.NNNNNN.prof, numbered from 0
+// - interval: seconds between deltas, 0 to take them on SIGUSR2 only
+// - keep:     number of files kept, older ones are removed, 0 for all
+void
+mrb_profiler_cont_start(mrb_state *mrb, struct prof_state *ps,
+                        const char *prefix, double interval, uint32_t keep)
+{
+  struct prof_cont *pc = &ps->cont;
+  char *copy;
+
+  if (!(interval >= 0)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "delta interval must not be negative");
+  }
+  mrb_profiler_cont_stop(mrb, ps);
+  copy = strdup(prefix);
+  if (!copy) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+  }
+
+  pthread_mutex_lock(&prof_cont_life);
+  if (prof_cont_users == 0 && !prof_cont_launch()) {
+    pthread_mutex_unlock(&prof_cont_life);
+    free(copy);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't start the profile writer thread");
+  }
+  pthread_mutex_lock(&prof_cont_lock);
+  prof_cont_users++;
+  pc->prefix = copy;
+  pc->interval = (uint64_t)(interval * 1000);
+  pc->due = prof_cont_now() + pc->interval;
+  pc->keep = keep;
+  pc->seq = 0;
+  pc->request = 0;
+  pthread_mutex_unlock(&prof_cont_lock);
+  pthread_mutex_unlock(&prof_cont_life);
+  //The first delta covers the counters so far, which a reset or the
+  //start of the VM dated
+  if (!ps->result.wall_start) {
+    ps->result.wall_start = mrb_profiler_wall_usec();
+  }
+
+  //Have the thread wait for the new deadline
+  prof_cont_wake(PROF_CONT_WRITE);
+}
+
+//Stop writing deltas of a VM's profile
+//
+//The counters since the previous delta are written to a last one. The
+//writer thread exits once no VM is left in continuous mode, after writing
+//every delta queued.
+void
+mrb_profiler_cont_stop(mrb_state *mrb, struct prof_state *ps)
+{
+  struct prof_cont *pc = &ps->cont;
+
+  if (!pc->prefix) {
+    return;
+  }
+  mrb_profiler_cont_flush(mrb, ps);
+  mrb_profiler_dump_rite_free(mrb, &pc->rite);
+
+  pthread_mutex_lock(&prof_cont_life);
+  pthread_mutex_lock(&prof_cont_lock);
+  free(pc->prefix);
+  pc->prefix = NULL;
+  pc->request = 0;
+  prof_cont_users--;
+  pthread_mutex_unlock(&prof_cont_lock);
+  if (prof_cont_users == 0) {
+    sigaction(SIGUSR2, &prof_cont_oldact, NULL);
+    prof_cont_wake(PROF_CONT_QUIT);
+    pthread_join(prof_cont_thread, NULL);
+    close(prof_cont_pipe[0]);
+    close(prof_cont_pipe[1]);
+    prof_cont_pipe[0] = prof_cont_pipe[1] = -1;
+  }
+  pthread_mutex_unlock(&prof_cont_life);
+}
+
+//Take a delta and hand it to the writer thread
+//
+//Called by the hooks when the writer thread asked for one. The dump is
+//built in memory, which needs the VM, then the counters are zeroed for the
+//next delta while the writer thread does the I/O. An error building the
+//dump drops the delta rather than raising in the profiled code.
+//
+//Resolving class names calls to_s, so the hook is taken out meanwhile and
+//that code neither gets profiled nor grows the tree being dumped. The RITE
+//binary of each irep is made once and reused by later deltas.
+//
+//Arguments:
+// - mrb: mruby state
+// - ps:  profiler state of mrb
+void
+mrb_profiler_cont_flush(mrb_state *mrb, struct prof_state *ps)
+{
+  struct prof_cont *pc = &ps->cont;
+  struct prof_cont_job *job;
+  void (*hook)(struct mrb_state *, struct mrb_irep *, mrb_code *,
+               mrb_value *) = mrb->code_fetch_hook;
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+  int ai = mrb_gc_arena_save(mrb);
+  mrb_bool expire;
+  size_t len;
+
+  pc->request = 0;
+  if (!pc->prefix) {
+    return;
+  }
+  expire = pc->keep && pc->seq >= pc->keep;
+  len = strlen(pc->prefix) + sizeof(".4294967295.prof");
+  job = (struct prof_cont_job *)calloc(1, sizeof(struct prof_cont_job));
+  if (job) {
+    job->path = (char *)malloc(len);
+    job->expire = expire ? (char *)malloc(len) : NULL;
+  }
+  if (!job || !job->path || (expire && !job->expire)) {
+    if (job) {
+      prof_cont_job_free(job);
+    }
+    fprintf(stderr, "mruby-profiler: can't build a delta of %s\n",
+            pc->prefix);
+    return;
+  }
+  snprintf(job->path, len, "%s.%06u.prof", pc->prefix, (unsigned)pc->seq);
+  if (expire) {
+    snprintf(job->expire, len, "%s.%06u.prof", pc->prefix,
+             (unsigned)(pc->seq - pc->keep));
+  }
+
+  mrb->code_fetch_hook = NULL;
+  MRB_TRY(&c_jmp) {
+    uint64_t end;
+    mrb_value buf;
+
+    mrb->jmp = &c_jmp;
+    mrb_profiler_sample_flush(mrb, ps);
+    end = ps->result.wall_end = mrb_profiler_wall_usec();
+    buf = mrb_profiler_dump_build(mrb, &ps->result, &pc->rite);
+    job->len = RSTRING_LEN(buf);
+    job->data = (char *)malloc(job->len);
+    if (!job->data) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+    }
+    memcpy(job->data, RSTRING_PTR(buf), job->len);
+    mrb->jmp = prev_jmp;
+
+    //The next delta begins where this one ends
+    mrb_profiler_reset(mrb);
+    ps->result.wall_start = end;
+    ps->result.wall_end = 0;
+    pc->seq++;
+
+    pthread_mutex_lock(&prof_cont_lock);
+    *prof_cont_tail = job;
+    prof_cont_tail = &job->next;
+    pthread_mutex_unlock(&prof_cont_lock);
+    prof_cont_wake(PROF_CONT_WRITE);
+  }
+  MRB_CATCH(&c_jmp) {
+    mrb->jmp = prev_jmp;
+    mrb->exc = NULL;
+    ps->result.wall_end = 0;
+    prof_cont_job_free(job);
+    fprintf(stderr, "mruby-profiler: can't build a delta of %s\n",
+            pc->prefix);
+  }
+  MRB_END_EXC(&c_jmp);
+  mrb->code_fetch_hook = hook;
+
+  mrb_gc_arena_restore(mrb, ai);
+}
@@ -0,0 +1,872 @@
+/* Profiler for ruby - binary profile dumps */
+#include "mruby.h"
+#include "mruby/irep.h"
+#include "mruby/string.h"
+#include "mruby/dump.h"
+#include "mruby/throw.h"
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Dump file layout, all integers little endian:
+//
+//  header  "MRBPROF\0" u32 version
+//  section tag[4] u32 size payload[size], repeated until tag "END\0"
+//
+//  "CLCK"  u64 bits of the double seconds per tick
+//  "OVHD"  u64 calibrated ticks of a fetch and of a fetch entering or
+//          leaving a method, u64 total ticks taken out of the counters
+//  "FIBR"  u32 fiber switches, u64 ticks spent switching
+//  "TIME"  u64 wall clock microseconds since the epoch when counting began
+//          and when the dump was taken, left out if the start is unknown
+//  "STRS"  NUL terminated names, referenced by byte offset
+//  "IREP"  u32 count, then count times u32 size and the RITE binary of one
+//          irep without its child ireps (mrb_dump_irep with debug info)
+//  "NODE"  u32 count, then for each node in allocation order (parents
+//          first): u32 irep, u32 method name, u32 class name, u32 parent
+//          (PROF_DUMP_NONE for the root), u32 calls from the parent and
+//          ilen times u32 count and u64 ticks
+//  "NSTA"  for each node of NODE: u32 activations, u64 inclusive ticks and
+//          u64 ticks of the longest activation
+//  "ALOC"  for each node of NODE: u32 1 followed by ilen times u64 bytes and
+//          u32 objects if allocations were tracked in it, else u32 0
+//  "GCTM"  for each node of NODE: u32 1 followed by ilen times u64 ticks of
+//          GC steps if the node ran any, else u32 0
+//  "EVNT"  u32 number of performance counters, their u32 names, then for
+//          each node of NODE: u32 1 followed by ilen times the u64 count of
+//          each counter if they were read in it, else u32 0
+//  "HIST"  for each node of NODE: u32 1 followed by the histogram of its
+//          activations if recorded, else u32 0, then u32 1 followed by ilen
+//          times u32 1 and the histogram of the instruction or u32 0 if
+//          instructions were recorded in it, else u32 0. A histogram is u64
+//          longest ticks, u32 number of buckets used and for each u32
+//          bucket and u32 count, buckets being those of struct prof_hist.
+//          Left out if nothing was recorded
+//
+//Nodes sharing the counters of another one in flat mode are written with
+//zero counts and without ALOC, GCTM, EVNT and instruction HIST counters.
+//
+//Readers skip sections they don't know, so sections can be added without
+//a new version.
+#define PROF_DUMP_MAGIC   "MRBPROF"
+#define PROF_DUMP_VERSION 1
+#define PROF_DUMP_NONE    0xffffffffu
+
+//Dump index assigned to a pointer
+struct prof_dump_ent {
+  const void *key;
+  uint32_t val;
+};
+
+static uint32_t
+prof_dump_hash(const void *ent)
+{
+  return PROF_PTR_HASH(((const struct prof_dump_ent *)ent)->key);
+}
+
+static mrb_bool
+prof_dump_match(const void *ent, const void *key)
+{
+  return ((const struct prof_dump_ent *)ent)->key == key;
+}
+
+//Dump indexes, keyed by pointer
+static const struct prof_tab_type prof_dump_map = {
+  sizeof(struct prof_dump_ent), 256, prof_dump_hash, prof_dump_match
+};
+
+//Get the entry of ptr, key NULL in it if it has no index yet
+static struct prof_dump_ent *
+prof_dump_map_get(mrb_state *mrb, struct prof_tab *map, const void *ptr)
+{
+  return (struct prof_dump_ent *)
+      mrb_profiler_tab_get(mrb, map, &prof_dump_map, ptr, PROF_PTR_HASH(ptr));
+}
+
+static void
+prof_put_u32(mrb_state *mrb, mrb_value buf, uint32_t v)
+{
+  uint8_t b[4];
+
+  b[0] = v; b[1] = v >> 8; b[2] = v >> 16; b[3] = v >> 24;
+  mrb_str_cat(mrb, buf, (const char *)b, sizeof(b));
+}
+
+static void
+prof_put_u64(mrb_state *mrb, mrb_value buf, uint64_t v)
+{
+  prof_put_u32(mrb, buf, (uint32_t)v);
+  prof_put_u32(mrb, buf, (uint32_t)(v >> 32));
+}
+
+//Start a section, returning the offset of its size field
+static size_t
+prof_put_section(mrb_state *mrb, mrb_value buf, const char *tag)
+{
+  size_t off;
+
+  mrb_str_cat(mrb, buf, tag, 4);
+  off = RSTRING_LEN(buf);
+  prof_put_u32(mrb, buf, 0);
+  return off;
+}
+
+//Overwrite the u32 written at off
+static void
+prof_patch_u32(mrb_value buf, size_t off, uint32_t v)
+{
+  uint8_t *p = (uint8_t *)RSTRING_PTR(buf) + off;
+
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+//Fill in the size of the section started at off
+static void
+prof_end_section(mrb_value buf, size_t off)
+{
+  prof_patch_u32(buf, off, (uint32_t)(RSTRING_LEN(buf) - off - 4));
+}
+
+//Get the string table offset of a name, appending it on first use
+static uint32_t
+prof_dump_str(mrb_state *mrb, mrb_value strs, struct prof_tab *map,
+              const char *str)
+{
+  struct prof_dump_ent *ent = prof_dump_map_get(mrb, map, str);
+
+  if (!ent->key) {
+    ent->key = str;
+    ent->val = (uint32_t)RSTRING_LEN(strs);
+    map->num++;
+    mrb_str_cat(mrb, strs, str, strlen(str) + 1);
+  }
+  return ent->val;
+}
+
+static uint32_t
+prof_rite_hash(const void *ent)
+{
+  return PROF_PTR_HASH(((const struct prof_rite *)ent)->irep);
+}
+
+static mrb_bool
+prof_rite_match(const void *ent, const void *key)
+{
+  return ((const struct prof_rite *)ent)->irep == key;
+}
+
+//RITE binaries, keyed by irep
+static const struct prof_tab_type prof_rite_tab = {
+  sizeof(struct prof_rite), 64, prof_rite_hash, prof_rite_match
+};
+
+//Append the RITE binary of irep alone, without its child ireps
+//
+//Arguments:
+// - mrb:  mruby state
+// - buf:  dump being built
+// - irep: irep to append
+// - rite: binaries kept from previous dumps, or NULL to keep none
+static void
+prof_dump_irep(mrb_state *mrb, mrb_value buf, mrb_irep *irep,
+               struct prof_tab *rite)
+{
+  struct prof_rite *ent = NULL;
+  uint8_t *bin = NULL;
+  size_t binsize = 0;
+  size_t rlen = irep->rlen;
+  int ret;
+
+  if (rite) {
+    ent = (struct prof_rite *)
+        mrb_profiler_tab_get(mrb, rite, &prof_rite_tab, irep,
+                             PROF_PTR_HASH(irep));
+    if (ent->irep) {
+      prof_put_u32(mrb, buf, (uint32_t)ent->size);
+      mrb_str_cat(mrb, buf, (const char *)ent->bin, ent->size);
+      return;
+    }
+  }
+
+  //Only the instructions of the irep itself are reported
+  irep->rlen = 0;
+  ret = mrb_dump_irep(mrb, irep, DUMP_DEBUG_INFO, &bin, &binsize);
+  irep->rlen = rlen;
+  if (ret != MRB_DUMP_OK) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't dump profiled irep");
+  }
+  if (ent) {
+    //Released by mrb_profiler_dump_rite_free
+    irep->refcnt++;
+    ent->irep = irep;
+    ent->bin = bin;
+    ent->size = binsize;
+    rite->num++;
+  }
+  prof_put_u32(mrb, buf, (uint32_t)binsize);
+  mrb_str_cat(mrb, buf, (const char *)bin, binsize);
+  if (!ent) {
+    mrb_free(mrb, bin);
+  }
+}
+
+//Release the RITE binaries kept by dumps and the ireps they stand for
+void
+mrb_profiler_dump_rite_free(mrb_state *mrb, struct prof_tab *rite)
+{
+  struct prof_rite *tab = (struct prof_rite *)rite->ent;
+  uint32_t i;
+
+  for (i = 0; i < rite->capa; i++) {
+    if (tab[i].irep) {
+      mrb_free(mrb, tab[i].bin);
+      mrb_irep_decref(mrb, tab[i].irep);
+    }
+  }
+  mrb_profiler_tab_free(rite);
+}
+
+//Write a histogram, the buckets used only
+static void
+prof_dump_hist(mrb_state *mrb, mrb_value buf, const struct prof_hist *h)
+{
+  size_t count;
+  uint32_t used = 0;
+  int i;
+
+  prof_put_u64(mrb, buf, h->max);
+  count = RSTRING_LEN(buf);
+  prof_put_u32(mrb, buf, 0);
+  for (i = 0; i < PROF_HIST_BUCKETS; i++) {
+    if (h->count[i]) {
+      prof_put_u32(mrb, buf, (uint32_t)i);
+      prof_put_u32(mrb, buf, h->count[i]);
+      used++;
+    }
+  }
+  prof_patch_u32(buf, count, used);
+}
+
+//Build the dump of a call tree in memory
+//
+//Arguments:
+// - mrb:  mruby state
+// - pr:   call tree
+// - rite: RITE binaries of the ireps to reuse and add to, or NULL to dump
+//         every irep afresh
+mrb_value
+mrb_profiler_dump_build(mrb_state *mrb, struct prof_result *pr,
+                        struct prof_tab *rite)
+{
+  mrb_value buf = mrb_str_buf_new(mrb, 4096);
+  mrb_value strs = mrb_str_buf_new(mrb, 1024);
+  struct prof_tab names = { NULL, 0, 0 };
+  struct prof_tab ireps = { NULL, 0, 0 };
+  uint64_t bits;
+  size_t sec;
+  size_t count;
+  int i;
+  int j;
+
+  mrb_str_cat(mrb, buf, PROF_DUMP_MAGIC, sizeof(PROF_DUMP_MAGIC));
+  prof_put_u32(mrb, buf, PROF_DUMP_VERSION);
+
+  sec = prof_put_section(mrb, buf, "CLCK");
+  memcpy(&bits, &mrb_profiler_clock.sec_per_tick, sizeof(bits));
+  prof_put_u64(mrb, buf, bits);
+  prof_end_section(buf, sec);
+
+  sec = prof_put_section(mrb, buf, "OVHD");
+  prof_put_u64(mrb, buf, pr->hook_ticks);
+  prof_put_u64(mrb, buf, pr->call_ticks);
+  prof_put_u64(mrb, buf, pr->overhead);
+  prof_end_section(buf, sec);
+
+  sec = prof_put_section(mrb, buf, "FIBR");
+  prof_put_u32(mrb, buf, pr->switch_num);
+  prof_put_u64(mrb, buf, pr->switch_ticks);
+  prof_end_section(buf, sec);
+
+  if (pr->wall_start) {
+    sec = prof_put_section(mrb, buf, "TIME");
+    prof_put_u64(mrb, buf, pr->wall_start);
+    prof_put_u64(mrb, buf,
+                 pr->wall_end ? pr->wall_end : mrb_profiler_wall_usec());
+    prof_end_section(buf, sec);
+  }
+
+  //Ireps are shared by every node running them
+  sec = prof_put_section(mrb, buf, "IREP");
+  count = RSTRING_LEN(buf);
+  prof_put_u32(mrb, buf, 0);
+  for (i = 0; i < pr->irep_num; i++) {
+    mrb_irep *irep = pr->irep_tab[i]->irep;
+    struct prof_dump_ent *ent = prof_dump_map_get(mrb, &ireps, irep);
+
+    if (!ent->key) {
+      ent->key = irep;
+      ent->val = ireps.num++;
+      prof_dump_irep(mrb, buf, irep, rite);
+    }
+  }
+  prof_patch_u32(buf, count, ireps.num);
+  prof_end_section(buf, sec);
+
+  sec = prof_put_section(mrb, buf, "NODE");
+  prof_put_u32(mrb, buf, pr->irep_num);
+  for (i = 0; i < pr->irep_num; i++) {
+    struct prof_irep *prof = pr->irep_tab[i];
+    mrb_bool own = !PROF_SHARED(prof);
+
+    prof_put_u32(mrb, buf, prof_dump_map_get(mrb, &ireps, prof->irep)->val);
+    prof_put_u32(mrb, buf, prof_dump_str(mrb, strs, &names,
+                                         mrb_profiler_irep_mname(mrb, prof)));
+    prof_put_u32(mrb, buf, prof_dump_str(mrb, strs, &names,
+                                         mrb_profiler_irep_klass(mrb, prof)));
+    if (prof->parent) {
+      prof_put_u32(mrb, buf, prof->parent->no);
+      prof_put_u32(mrb, buf, prof->parent->ccall_num[prof->child_idx]);
+    }
+    else {
+      prof_put_u32(mrb, buf, PROF_DUMP_NONE);
+      prof_put_u32(mrb, buf, 0);
+    }
+    for (j = 0; j < (int)prof->irep->ilen; j++) {
+      prof_put_u32(mrb, buf, own ? prof->num[j] : 0);
+      prof_put_u64(mrb, buf, own ? prof->time[j] : 0);
+    }
+  }
+  prof_end_section(buf, sec);
+
+  sec = prof_put_section(mrb, buf, "NSTA");
+  for (i = 0; i < pr->irep_num; i++) {
+    struct prof_irep *prof = pr->irep_tab[i];
+
+    prof_put_u32(mrb, buf, prof->calls);
+    prof_put_u64(mrb, buf, prof->incl);
+    prof_put_u64(mrb, buf, prof->max);
+  }
+  prof_end_section(buf, sec);
+
+  sec = prof_put_section(mrb, buf, "ALOC");
+  for (i = 0; i < pr->irep_num; i++) {
+    struct prof_irep *prof = pr->irep_tab[i];
+    struct prof_alloc *alloc = PROF_SHARED(prof) ? NULL : prof->alloc;
+
+    prof_put_u32(mrb, buf, alloc != NULL);
+    for (j = 0; alloc && j < (int)prof->irep->ilen; j++) {
+      prof_put_u64(mrb, buf, alloc[j].bytes);
+      prof_put_u32(mrb, buf, alloc[j].objs);
+    }
+  }
+  prof_end_section(buf, sec);
+
+  sec = prof_put_section(mrb, buf, "GCTM");
+  for (i = 0; i < pr->irep_num; i++) {
+    struct prof_irep *prof = pr->irep_tab[i];
+    uint64_t *gc = PROF_SHARED(prof) ? NULL : prof->gc;
+
+    prof_put_u32(mrb, buf, gc != NULL);
+    for (j = 0; gc && j < (int)prof->irep->ilen; j++) {
+      prof_put_u64(mrb, buf, gc[j]);
+    }
+  }
+  prof_end_section(buf, sec);
+
+  if (pr->event_num > 0) {
+    sec = prof_put_section(mrb, buf, "EVNT");
+    prof_put_u32(mrb, buf, pr->event_num);
+    for (i = 0; i < pr->event_num; i++) {
+      prof_put_u32(mrb, buf, prof_dump_str(mrb, strs, &names,
+                                           pr->event_name[i]));
+    }
+    for (i = 0; i < pr->irep_num; i++) {
+      struct prof_irep *prof = pr->irep_tab[i];
+      uint64_t *ev = PROF_SHARED(prof) ? NULL : prof->events;
+
+      prof_put_u32(mrb, buf, ev != NULL);
+      for (j = 0; ev && j < (int)prof->irep->ilen * pr->event_num; j++) {
+        prof_put_u64(mrb, buf, ev[j]);
+      }
+    }
+    prof_end_section(buf, sec);
+  }
+
+  for (i = 0; i < pr->irep_num; i++) {
+    if (pr->irep_tab[i]->hist || pr->irep_tab[i]->insn_hist) {
+      break;
+    }
+  }
+  if (i < pr->irep_num) {
+    sec = prof_put_section(mrb, buf, "HIST");
+    for (i = 0; i < pr->irep_num; i++) {
+      struct prof_irep *prof = pr->irep_tab[i];
+      struct prof_hist **ih = PROF_SHARED(prof) ? NULL : prof->insn_hist;
+
+      prof_put_u32(mrb, buf, prof->hist != NULL);
+      if (prof->hist) {
+        prof_dump_hist(mrb, buf, prof->hist);
+      }
+      prof_put_u32(mrb, buf, ih != NULL);
+      for (j = 0; ih && j < (int)prof->irep->ilen; j++) {
+        prof_put_u32(mrb, buf, ih[j] != NULL);
+        if (ih[j]) {
+          prof_dump_hist(mrb, buf, ih[j]);
+        }
+      }
+    }
+    prof_end_section(buf, sec);
+  }
+
+  sec = prof_put_section(mrb, buf, "STRS");
+  mrb_str_cat(mrb, buf, RSTRING_PTR(strs), RSTRING_LEN(strs));
+  prof_end_section(buf, sec);
+
+  sec = prof_put_section(mrb, buf, "END");
+  prof_end_section(buf, sec);
+
+  mrb_profiler_tab_free(&names);
+  mrb_profiler_tab_free(&ireps);
+
+  return buf;
+}
+
+//Write a call tree to a dump file
+//
+//The dump is built in memory and written at once, so producing it costs
+//no formatting and a single write.
+//
+//Arguments:
+// - mrb:  mruby state
+// - pr:   call tree
+// - path: file to create
+void
+mrb_profiler_dump_result(mrb_state *mrb, struct prof_result *pr,
+                         const char *path)
+{
+  mrb_value buf = mrb_profiler_dump_build(mrb, pr, NULL);
+  FILE *fp = fopen(path, "wb");
+  size_t len = RSTRING_LEN(buf);
+
+  if (!fp) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "can't open %S",
+               mrb_str_new_cstr(mrb, path));
+  }
+  if (fwrite(RSTRING_PTR(buf), 1, len, fp) != len) {
+    fclose(fp);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "can't write %S",
+               mrb_str_new_cstr(mrb, path));
+  }
+  if (fclose(fp) != 0) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "can't write %S",
+               mrb_str_new_cstr(mrb, path));
+  }
+}
+
+//Cursor over a dump being loaded
+struct prof_reader {
+  mrb_state *mrb;
+  const uint8_t *p;
+  const uint8_t *end;
+};
+
+static void
+prof_read_error(struct prof_reader *rd)
+{
+  mrb_state *mrb = rd->mrb;
+
+  mrb_raise(mrb, E_RUNTIME_ERROR, "broken profiler dump");
+}
+
+static const uint8_t *
+prof_read_bytes(struct prof_reader *rd, size_t len)
+{
+  const uint8_t *p = rd->p;
+
+  if ((size_t)(rd->end - rd->p) < len) {
+    prof_read_error(rd);
+  }
+  rd->p += len;
+  return p;
+}
+
+static uint32_t
+prof_read_u32(struct prof_reader *rd)
+{
+  const uint8_t *p = prof_read_bytes(rd, 4);
+
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+         (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t
+prof_read_u64(struct prof_reader *rd)
+{
+  uint64_t lo = prof_read_u32(rd);
+
+  return lo | (uint64_t)prof_read_u32(rd) << 32;
+}
+
+//Read the whole file at path into a string
+static mrb_value
+prof_read_file(mrb_state *mrb, const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  mrb_value buf;
+  long size;
+
+  if (!fp) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "can't open %S",
+               mrb_str_new_cstr(mrb, path));
+  }
+  if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0) {
+    fclose(fp);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "can't read %S",
+               mrb_str_new_cstr(mrb, path));
+  }
+  rewind(fp);
+  buf = mrb_str_new(mrb, NULL, size);
+  if (fread(RSTRING_PTR(buf), 1, size, fp) != (size_t)size) {
+    fclose(fp);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "can't read %S",
+               mrb_str_new_cstr(mrb, path));
+  }
+  fclose(fp);
+
+  return buf;
+}
+
+//Get a name of the string table
+static const char *
+prof_read_str(struct prof_reader *rd, struct prof_reader *strs,
+              struct prof_result *res)
+{
+  uint32_t off = prof_read_u32(rd);
+  const char *str = (const char *)strs->p + off;
+
+  if (off >= (uint32_t)(strs->end - strs->p) ||
+      !memchr(str, '\0', strs->end - strs->p - off)) {
+    prof_read_error(rd);
+  }
+  return mrb_profiler_arena_intern(rd->mrb, &res->arena, str);
+}
+
+//Read a histogram, adding it to h with its ticks scaled to this host's
+static void
+prof_read_hist(struct prof_reader *rd, struct prof_hist *h, double scale)
+{
+  struct prof_hist tmp;
+  uint32_t used;
+  uint32_t i;
+
+  memset(&tmp, 0, sizeof(tmp));
+  tmp.max = prof_read_u64(rd);
+  used = prof_read_u32(rd);
+  for (i = 0; i < used; i++) {
+    uint32_t idx = prof_read_u32(rd);
+
+    if (idx >= PROF_HIST_BUCKETS) {
+      prof_read_error(rd);
+    }
+    tmp.count[idx] = prof_read_u32(rd);
+  }
+  mrb_profiler_hist_add(h, &tmp, scale);
+}
+
+//Load the call tree of a dump into a snapshot
+//
+//Arguments:
+// - mrb:   mruby state
+// - klass: Profiler::Snapshot
+// - path:  dump file
+mrb_value
+mrb_profiler_load_result(mrb_state *mrb, struct RClass *klass,
+                         const char *path)
+{
+  mrb_value file = prof_read_file(mrb, path);
+  mrb_value snap;
+  struct prof_result *res;
+  struct prof_reader rd;
+  struct prof_reader strs = { NULL, NULL, NULL };
+  struct prof_reader nodes = { NULL, NULL, NULL };
+  struct prof_reader ireps = { NULL, NULL, NULL };
+  struct prof_reader stats = { NULL, NULL, NULL };
+  struct prof_reader allocs = { NULL, NULL, NULL };
+  struct prof_reader gcs = { NULL, NULL, NULL };
+  struct prof_reader events = { NULL, NULL, NULL };
+  struct prof_reader overhead = { NULL, NULL, NULL };
+  struct prof_reader fibers = { NULL, NULL, NULL };
+  struct prof_reader period = { NULL, NULL, NULL };
+  struct prof_reader hists = { NULL, NULL, NULL };
+  struct mrb_jmpbuf *prev_jmp;
+  struct mrb_jmpbuf c_jmp;
+  double sec_per_tick = 0;
+  double scale;
+  mrb_irep **tab;
+  uint32_t nirep;
+  uint32_t nnode;
+  uint32_t i;
+  uint32_t j;
+
+  rd.mrb = mrb;
+  rd.p = (const uint8_t *)RSTRING_PTR(file);
+  rd.end = rd.p + RSTRING_LEN(file);
+  if (memcmp(prof_read_bytes(&rd, sizeof(PROF_DUMP_MAGIC)), PROF_DUMP_MAGIC,
+             sizeof(PROF_DUMP_MAGIC)) != 0) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "%S is not a profiler dump",
+               mrb_str_new_cstr(mrb, path));
+  }
+  if (prof_read_u32(&rd) != PROF_DUMP_VERSION) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "unsupported profiler dump version in %S",
+               mrb_str_new_cstr(mrb, path));
+  }
+
+  //Locate the sections
+  for (;;) {
+    const uint8_t *tag = prof_read_bytes(&rd, 4);
+    uint32_t size = prof_read_u32(&rd);
+    struct prof_reader sec;
+
+    sec.mrb = mrb;
+    sec.p = prof_read_bytes(&rd, size);
+    sec.end = sec.p + size;
+    if (memcmp(tag, "END", 4) == 0) {
+      break;
+    }
+    else if (memcmp(tag, "CLCK", 4) == 0) {
+      uint64_t bits = prof_read_u64(&sec);
+
+      memcpy(&sec_per_tick, &bits, sizeof(bits));
+    }
+    else if (memcmp(tag, "STRS", 4) == 0) {
+      strs = sec;
+    }
+    else if (memcmp(tag, "IREP", 4) == 0) {
+      ireps = sec;
+    }
+    else if (memcmp(tag, "NODE", 4) == 0) {
+      nodes = sec;
+    }
+    else if (memcmp(tag, "NSTA", 4) == 0) {
+      stats = sec;
+    }
+    else if (memcmp(tag, "ALOC", 4) == 0) {
+      allocs = sec;
+    }
+    else if (memcmp(tag, "GCTM", 4) == 0) {
+      gcs = sec;
+    }
+    else if (memcmp(tag, "EVNT", 4) == 0) {
+      events = sec;
+    }
+    else if (memcmp(tag, "OVHD", 4) == 0) {
+      overhead = sec;
+    }
+    else if (memcmp(tag, "FIBR", 4) == 0) {
+      fibers = sec;
+    }
+    else if (memcmp(tag, "TIME", 4) == 0) {
+      period = sec;
+    }
+    else if (memcmp(tag, "HIST", 4) == 0) {
+      hists = sec;
+    }
+  }
+  if (!nodes.p || !ireps.p || !strs.p || !(sec_per_tick > 0)) {
+    prof_read_error(&rd);
+  }
+  //Ticks of the dumping host converted to ticks of this one
+  scale = sec_per_tick / mrb_profiler_clock.sec_per_tick;
+
+  snap = mrb_profiler_snapshot_alloc(mrb, klass, &res);
+
+  nirep = prof_read_u32(&ireps);
+  if (nirep > (uint32_t)(ireps.end - ireps.p) / 4) {
+    prof_read_error(&ireps);
+  }
+  tab = (mrb_irep **)
+    mrb_profiler_arena_alloc(mrb, &res->arena, (nirep + 1) * sizeof(mrb_irep *));
+  //A broken dump leaves the ireps read and the partial tree to release
+  prev_jmp = mrb->jmp;
+  MRB_TRY(&c_jmp) {
+    mrb->jmp = &c_jmp;
+    for (i = 0; i < nirep; i++) {
+      uint32_t size = prof_read_u32(&ireps);
+      const uint8_t *bin = prof_read_bytes(&ireps, size);
+      const struct rite_binary_header *header;
+
+      //mrb_read_irep trusts the size in the header, hold it to the record
+      if (size < sizeof(struct rite_binary_header)) {
+        prof_read_error(&ireps);
+      }
+      header = (const struct rite_binary_header *)bin;
+      if (bin_to_uint32(header->binary_size) <
+          sizeof(struct rite_binary_header) ||
+          bin_to_uint32(header->binary_size) > size) {
+        prof_read_error(&ireps);
+      }
+      tab[i] = mrb_read_irep(mrb, bin);
+      if (!tab[i]) {
+        prof_read_error(&ireps);
+      }
+    }
+
+    nnode = prof_read_u32(&nodes);
+    for (i = 0; i < nnode; i++) {
+      struct prof_class *cls;
+      struct prof_irep *node;
+      struct prof_irep *parent = NULL;
+      const char *mname;
+      uint32_t irepno = prof_read_u32(&nodes);
+      uint32_t parentno;
+      uint32_t calls;
+
+      if (irepno >= nirep) {
+        prof_read_error(&nodes);
+      }
+      mname = prof_read_str(&nodes, &strs, res);
+      cls = (struct prof_class *)
+        mrb_profiler_arena_alloc(mrb, &res->arena, sizeof(struct prof_class));
+      cls->name = prof_read_str(&nodes, &strs, res);
+      parentno = prof_read_u32(&nodes);
+      calls = prof_read_u32(&nodes);
+
+      if (parentno != PROF_DUMP_NONE) {
+        if (parentno >= (uint32_t)res->irep_num) {
+          prof_read_error(&nodes);
+        }
+        parent = res->irep_tab[parentno];
+        node = mrb_profiler_add_child(mrb, res, parent, tab[irepno], 0, cls);
+        parent->ccall_num[node->child_idx] = calls;
+      }
+      else if (!res->irep_root) {
+        node = mrb_profiler_alloc_prof_irep(mrb, res, tab[irepno], NULL, 0,
+                                            cls);
+        res->irep_root = node;
+      }
+      else {
+        prof_read_error(&nodes);
+      }
+      node->mname = mname;
+
+      for (j = 0; j < node->irep->ilen; j++) {
+        node->num[j]  = prof_read_u32(&nodes);
+        node->time[j] = (uint64_t)((double)prof_read_u64(&nodes) * scale);
+      }
+    }
+
+    if (overhead.p) {
+      res->hook_ticks = (uint64_t)((double)prof_read_u64(&overhead) * scale);
+      res->call_ticks = (uint64_t)((double)prof_read_u64(&overhead) * scale);
+      res->overhead = (uint64_t)((double)prof_read_u64(&overhead) * scale);
+    }
+    if (fibers.p) {
+      res->switch_num = prof_read_u32(&fibers);
+      res->switch_ticks = (uint64_t)((double)prof_read_u64(&fibers) * scale);
+    }
+    if (period.p) {
+      res->wall_start = prof_read_u64(&period);
+      res->wall_end = prof_read_u64(&period);
+    }
+
+    //Dumps written before NSTA existed leave these zero
+    if (stats.p) {
+      for (i = 0; i < nnode; i++) {
+        struct prof_irep *node = res->irep_tab[i];
+
+        node->calls = prof_read_u32(&stats);
+        node->incl = (uint64_t)((double)prof_read_u64(&stats) * scale);
+        node->max  = (uint64_t)((double)prof_read_u64(&stats) * scale);
+      }
+    }
+    if (allocs.p) {
+      for (i = 0; i < nnode; i++) {
+        struct prof_irep *node = res->irep_tab[i];
+        struct prof_alloc *alloc;
+
+        if (!prof_read_u32(&allocs)) {
+          continue;
+        }
+        alloc = mrb_profiler_alloc_counters(mrb, res, node);
+        for (j = 0; j < node->irep->ilen; j++) {
+          alloc[j].bytes = prof_read_u64(&allocs);
+          alloc[j].objs  = prof_read_u32(&allocs);
+        }
+      }
+    }
+    if (gcs.p) {
+      for (i = 0; i < nnode; i++) {
+        struct prof_irep *node = res->irep_tab[i];
+        uint64_t *gc;
+
+        if (!prof_read_u32(&gcs)) {
+          continue;
+        }
+        gc = mrb_profiler_gc_counters(mrb, res, node);
+        for (j = 0; j < node->irep->ilen; j++) {
+          gc[j] = (uint64_t)((double)prof_read_u64(&gcs) * scale);
+        }
+      }
+    }
+    if (events.p) {
+      uint32_t nevent = prof_read_u32(&events);
+
+      if (nevent > PROF_EVENT_MAX) {
+        prof_read_error(&events);
+      }
+      for (i = 0; i < nevent; i++) {
+        res->event_name[i] = prof_read_str(&events, &strs, res);
+      }
+      res->event_num = nevent;
+      for (i = 0; i < nnode; i++) {
+        struct prof_irep *node = res->irep_tab[i];
+        uint64_t *ev;
+
+        if (!prof_read_u32(&events)) {
+          continue;
+        }
+        ev = mrb_profiler_event_counters(mrb, res, node);
+        for (j = 0; j < node->irep->ilen * nevent; j++) {
+          ev[j] = prof_read_u64(&events);
+        }
+      }
+    }
+
+    if (hists.p) {
+      for (i = 0; i < nnode; i++) {
+        struct prof_irep *node = res->irep_tab[i];
+
+        if (prof_read_u32(&hists)) {
+          prof_read_hist(&hists, mrb_profiler_call_hist(mrb, res, node), scale);
+        }
+        if (!prof_read_u32(&hists)) {
+          continue;
+        }
+        for (j = 0; j < node->irep->ilen; j++) {
+          if (prof_read_u32(&hists)) {
+            prof_read_hist(&hists, mrb_profiler_insn_hist(mrb, res, node, j),
+                           scale);
+          }
+        }
+      }
+    }
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp) {
+    mrb->jmp = prev_jmp;
+    for (i = 0; i < nirep && tab[i]; i++) {
+      mrb_irep_decref(mrb, tab[i]);
+    }
+    mrb_profiler_result_free(mrb, res);
+    mrb_exc_raise(mrb, mrb_obj_value(mrb->exc));
+  }
+  MRB_END_EXC(&c_jmp);
+
+  //Nodes hold their own references
+  for (i = 0; i < nirep; i++) {
+    mrb_irep_decref(mrb, tab[i]);
+  }
+
+  return snap;
+}
@@ -0,0 +1,410 @@
+/* Profiler for ruby - flame graph and speedscope exporters */
+#include "mruby.h"
+#include "mruby/irep.h"
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Walk of a call tree, depth first from the root
+//
+//The arrays are indexed by depth and describe the path to the node being
+//visited.
+struct prof_export {
+  mrb_state *mrb;
+  FILE *fp;
+  struct prof_irep **node; //Nodes of the path
+  int *child;              //Next child of each node to visit
+  int *frame;              //Speedscope frame of each node
+  size_t *pathlen;         //Length of the folded path up to each node
+  int capa;
+  char *path;              //Folded path, frames separated by ';'
+  size_t path_capa;
+  struct prof_tab frames;  //Speedscope frames, keyed by irep and method
+  int frame_num;
+  int printed;             //Elements printed in the current JSON array
+};
+
+static void
+prof_export_nomem(struct prof_export *ex)
+{
+  mrb_state *mrb = ex->mrb;
+
+  mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+}
+
+static void
+prof_export_free(struct prof_export *ex)
+{
+  free(ex->node);
+  free(ex->child);
+  free(ex->frame);
+  free(ex->pathlen);
+  free(ex->path);
+  mrb_profiler_tab_free(&ex->frames);
+}
+
+//Make room for a path of depth nodes
+static void
+prof_export_reserve(struct prof_export *ex, int depth)
+{
+  int size;
+
+  if (depth < ex->capa) {
+    return;
+  }
+  size = ex->capa ? ex->capa * 2 : 64;
+  ex->node = (struct prof_irep **)realloc(ex->node, size * sizeof(*ex->node));
+  ex->child = (int *)realloc(ex->child, size * sizeof(int));
+  ex->frame = (int *)realloc(ex->frame, size * sizeof(int));
+  ex->pathlen = (size_t *)realloc(ex->pathlen, size * sizeof(size_t));
+  if (!ex->node || !ex->child || !ex->frame || !ex->pathlen) {
+    prof_export_nomem(ex);
+  }
+  ex->capa = size;
+}
+
+//Time spent in the instructions of a node itself in nanoseconds
+//
+//GC steps run by the instructions are included, so the graph adds up to
+//the time profiled. In flat mode the shared counters all go to the node
+//owning them.
+static uint64_t
+prof_self_ns(struct prof_irep *node)
+{
+  uint64_t ticks = 0;
+  size_t i;
+
+  if (PROF_SHARED(node)) {
+    return 0;
+  }
+  for (i = 0; i < node->irep->ilen; i++) {
+    ticks += node->time[i];
+    if (node->gc) {
+      ticks += node->gc[i];
+    }
+  }
+  return (uint64_t)(PROF_TICK2SEC(ticks) * 1e9);
+}
+
+//Visit every node of a call tree, parents before children
+//
+//Arguments:
+// - ex:    walk state
+// - pr:    call tree
+// - visit: called for each node with its depth, the path to it is in ex
+static void
+prof_export_walk(struct prof_export *ex, struct prof_result *pr,
+                 void (*visit)(struct prof_export *ex, int depth))
+{
+  int depth = 0;
+
+  if (!pr->irep_root) {
+    return;
+  }
+  prof_export_reserve(ex, 0);
+  ex->node[0] = pr->irep_root;
+  ex->child[0] = 0;
+  visit(ex, 0);
+
+  while (depth >= 0) {
+    struct prof_irep *node = ex->node[depth];
+
+    if (ex->child[depth] < node->child_num) {
+      struct prof_irep *child = node->child[ex->child[depth]++];
+
+      depth++;
+      prof_export_reserve(ex, depth);
+      ex->node[depth] = child;
+      ex->child[depth] = 0;
+      visit(ex, depth);
+    }
+    else {
+      depth--;
+    }
+  }
+}
+
+//Format the frame name of a node: Class#method, or the file and line of
+//top level code and blocks outside methods
+static void
+prof_frame_name(mrb_state *mrb, struct prof_irep *node, char *buf,
+                size_t len)
+{
+  const char *klass = mrb_profiler_irep_klass(mrb, node);
+  const char *mname = mrb_profiler_irep_mname(mrb, node);
+  mrb_irep *irep = node->irep;
+
+  if (*mname) {
+    snprintf(buf, len, "%s#%s", *klass ? klass : "?", mname);
+  }
+  else if (irep->filename) {
+    snprintf(buf, len, "<top> %s:%d", irep->filename,
+             irep->lines ? irep->lines[0] : 0);
+  }
+  else {
+    snprintf(buf, len, "<top>");
+  }
+}
+
+//Open the output of an exporter, "-" being stdout
+static FILE *
+prof_export_open(mrb_state *mrb, const char *path)
+{
+  FILE *fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+
+  if (!fp) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "can't open %S",
+               mrb_str_new_cstr(mrb, path));
+  }
+  return fp;
+}
+
+static void
+prof_export_close(struct prof_export *ex, const char *path)
+{
+  int err = ferror(ex->fp);
+
+  if (ex->fp == stdout) {
+    err |= fflush(ex->fp);
+  }
+  else {
+    err |= fclose(ex->fp);
+  }
+  prof_export_free(ex);
+  if (err) {
+    mrb_state *mrb = ex->mrb;
+
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "can't write %S",
+               mrb_str_new_cstr(mrb, path));
+  }
+}
+
+//Append the frame of the node at depth to the folded path and print the
+//path with the node's self time
+static void
+prof_folded_visit(struct prof_export *ex, int depth)
+{
+  struct prof_irep *node = ex->node[depth];
+  size_t off = depth > 0 ? ex->pathlen[depth - 1] : 0;
+  char name[512];
+  size_t len;
+  uint64_t self;
+
+  prof_frame_name(ex->mrb, node, name, sizeof(name));
+  len = strlen(name);
+  if (ex->path_capa < off + len + 2) {
+    size_t size = ex->path_capa ? ex->path_capa : 4096;
+
+    while (size < off + len + 2) {
+      size *= 2;
+    }
+    ex->path = (char *)realloc(ex->path, size);
+    if (!ex->path) {
+      prof_export_nomem(ex);
+    }
+    ex->path_capa = size;
+  }
+  if (depth > 0) {
+    ex->path[off++] = ';';
+  }
+  memcpy(ex->path + off, name, len);
+  ex->pathlen[depth] = off + len;
+
+  self = prof_self_ns(node);
+  if (self > 0) {
+    fwrite(ex->path, 1, ex->pathlen[depth], ex->fp);
+    fprintf(ex->fp, " %llu\n", (unsigned long long)self);
+  }
+}
+
+//Write the call tree in the folded stack format of flamegraph.pl
+//
+//One line per node with self time: the frames from the root separated by
+//';' and the self time in nanoseconds. Inclusive times are the sums over
+//the lines sharing a prefix.
+//
+//Arguments:
+// - mrb:  mruby state
+// - pr:   call tree
+// - path: file to create, "-" for stdout
+void
+mrb_profiler_export_folded(mrb_state *mrb, struct prof_result *pr,
+                           const char *path)
+{
+  struct prof_export ex;
+
+  memset(&ex, 0, sizeof(ex));
+  ex.mrb = mrb;
+  ex.fp = prof_export_open(mrb, path);
+  prof_export_walk(&ex, pr, prof_folded_visit);
+  prof_export_close(&ex, path);
+}
+
+//Write a string as a JSON string literal
+static void
+prof_json_str(FILE *fp, const char *str)
+{
+  putc('"', fp);
+  for (; *str; str++) {
+    unsigned char c = (unsigned char)*str;
+
+    if (c == '"' || c == '\\') {
+      putc('\\', fp);
+      putc(c, fp);
+    }
+    else if (c < 0x20) {
+      fprintf(fp, "\\u%04x", c);
+    }
+    else {
+      putc(c, fp);
+    }
+  }
+  putc('"', fp);
+}
+
+//Speedscope frame, standing for the first node seen running its method
+struct prof_export_frame {
+  struct prof_irep *node;
+  int no;
+};
+
+static uint32_t
+prof_export_frame_hash(const void *ent)
+{
+  return PROF_PTR_HASH(((const struct prof_export_frame *)ent)->node->irep);
+}
+
+//Names were resolved before lookup, so matching calls no Ruby code
+static mrb_bool
+prof_export_frame_match(const void *ent, const void *key)
+{
+  const struct prof_irep *a = ((const struct prof_export_frame *)ent)->node;
+  const struct prof_irep *b = (const struct prof_irep *)key;
+
+  return a->irep == b->irep &&
+         strcmp(a->mname, b->mname) == 0 &&
+         strcmp(a->klass->name, b->klass->name) == 0;
+}
+
+//Speedscope frames, keyed by irep and method
+static const struct prof_tab_type prof_export_frame_tab = {
+  sizeof(struct prof_export_frame), 256, prof_export_frame_hash,
+  prof_export_frame_match
+};
+
+//Get the speedscope frame of a node, printing it when first seen
+//
+//Nodes running the same irep as the same method share a frame.
+static int
+prof_speedscope_frame(struct prof_export *ex, struct prof_irep *node)
+{
+  struct prof_export_frame *ent;
+  char name[512];
+
+  mrb_profiler_irep_mname(ex->mrb, node);
+  mrb_profiler_irep_klass(ex->mrb, node);
+  ent = (struct prof_export_frame *)
+      mrb_profiler_tab_get(ex->mrb, &ex->frames, &prof_export_frame_tab, node,
+                           PROF_PTR_HASH(node->irep));
+  if (ent->node) {
+    return ent->no;
+  }
+  ent->node = node;
+  ent->no = ex->frame_num;
+  ex->frames.num++;
+
+  prof_frame_name(ex->mrb, node, name, sizeof(name));
+  fputs(ex->frame_num ? ",\n{\"name\":" : "\n{\"name\":", ex->fp);
+  prof_json_str(ex->fp, name);
+  if (node->irep->filename) {
+    fputs(",\"file\":", ex->fp);
+    prof_json_str(ex->fp, node->irep->filename);
+    if (node->irep->lines) {
+      fprintf(ex->fp, ",\"line\":%d", node->irep->lines[0]);
+    }
+  }
+  putc('}', ex->fp);
+
+  return ex->frame_num++;
+}
+
+//Pass 1: print the frames
+static void
+prof_speedscope_frames_visit(struct prof_export *ex, int depth)
+{
+  ex->frame[depth] = prof_speedscope_frame(ex, ex->node[depth]);
+}
+
+//Pass 2: print the stacks of nodes with self time
+static void
+prof_speedscope_samples_visit(struct prof_export *ex, int depth)
+{
+  int i;
+
+  ex->frame[depth] = prof_speedscope_frame(ex, ex->node[depth]);
+  if (prof_self_ns(ex->node[depth]) == 0) {
+    return;
+  }
+  fputs(ex->printed++ ? ",\n[" : "\n[", ex->fp);
+  for (i = 0; i <= depth; i++) {
+    fprintf(ex->fp, i ? ",%d" : "%d", ex->frame[i]);
+  }
+  putc(']', ex->fp);
+}
+
+//Pass 3: print the self times of those nodes
+static void
+prof_speedscope_weights_visit(struct prof_export *ex, int depth)
+{
+  uint64_t self = prof_self_ns(ex->node[depth]);
+
+  if (self > 0) {
+    fprintf(ex->fp, ex->printed++ ? ",%llu" : "%llu",
+            (unsigned long long)self);
+  }
+}
+
+//Write the call tree as a speedscope profile
+//
+//Each node with self time becomes a sample of its call stack weighted by
+//that time, so speedscope derives self and inclusive times from the tree
+//itself. Output is streamed in three walks of the tree.
+//
+//Arguments:
+// - mrb:  mruby state
+// - pr:   call tree
+// - path: file to create, "-" for stdout
+void
+mrb_profiler_export_speedscope(mrb_state *mrb, struct prof_result *pr,
+                               const char *path)
+{
+  struct prof_export ex;
+  uint64_t total = 0;
+  int i;
+
+  for (i = 0; i < pr->irep_num; i++) {
+    total += prof_self_ns(pr->irep_tab[i]);
+  }
+
+  memset(&ex, 0, sizeof(ex));
+  ex.mrb = mrb;
+  ex.fp = prof_export_open(mrb, path);
+
+  fputs("{\"$schema\":\"https://www.speedscope.app/file-format-schema.json\",\n"
+        "\"exporter\":\"mruby-profiler\",\"name\":\"mruby\","
+        "\"activeProfileIndex\":0,\n"
+        "\"shared\":{\"frames\":[", ex.fp);
+  prof_export_walk(&ex, pr, prof_speedscope_frames_visit);
+  fprintf(ex.fp, "]},\n\"profiles\":[{\"type\":\"sampled\",\"name\":\"mruby\","
+          "\"unit\":\"nanoseconds\",\"startValue\":0,\"endValue\":%llu,\n"
+          "\"samples\":[", (unsigned long long)total);
+  ex.printed = 0;
+  prof_export_walk(&ex, pr, prof_speedscope_samples_visit);
+  fputs("],\n\"weights\":[", ex.fp);
+  ex.printed = 0;
+  prof_export_walk(&ex, pr, prof_speedscope_weights_visit);
+  fputs("]}]}\n", ex.fp);
+
+  prof_export_close(&ex, path);
+}
@@ -0,0 +1,390 @@
+/* Profiler for ruby - include and exclude filters */
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/irep.h"
+#include "mruby/string.h"
+#include "mruby/throw.h"
+#include "mruby/variable.h"
+#include "profiler.h"
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Predicates of the filter rules, kept from the GC in the Profiler module
+#define PROF_FILTERS_SYM mrb_intern_lit(mrb, "__profiler_filters__")
+
+//Names a rule is matched against, looked up on first use
+struct prof_filter_names {
+  struct RClass *klass;   //Class implementing the method
+  const char *file;       //Source file, NULL if unknown
+  const char *cname;      //Class name, NULL if none or not looked up yet
+  const char *mname;      //Method name, "" outside methods
+  mrb_bool cname_done;    //Whether cname was looked up
+};
+
+static const char *prof_filter_kinds[] = { "file", "class", "method", "proc" };
+
+//Get the name of the class implementing the code filtered
+static const char *
+prof_filter_cname(mrb_state *mrb, struct prof_filter_names *nm)
+{
+  if (!nm->cname_done) {
+    struct RClass *klass = nm->klass;
+
+    if (klass && klass->tt == MRB_TT_ICLASS) {
+      klass = klass->c;
+    }
+    nm->cname = klass ? mrb_class_name(mrb, klass) : NULL;
+    nm->cname_done = TRUE;
+  }
+  return nm->cname;
+}
+
+//Call the predicate of a rule
+//
+//The hook is removed while the predicate runs, which is then neither
+//profiled nor filtered itself, like an expression mruby's debugger
+//evaluates from the same hook. A predicate that raises leaves the code
+//profiled.
+static mrb_bool
+prof_filter_call(mrb_state *mrb, struct prof_state *ps, int idx,
+                 struct prof_filter_names *nm)
+{
+  void (*hook)(struct mrb_state *, struct mrb_irep *, mrb_code *,
+               mrb_value *) = mrb->code_fetch_hook;
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+  volatile mrb_bool res = FALSE;
+  int ai = mrb_gc_arena_save(mrb);
+
+  mrb->code_fetch_hook = NULL;
+  MRB_TRY(&c_jmp) {
+    mrb_value procs = mrb_iv_get(mrb, ps->module, PROF_FILTERS_SYM);
+    const char *cname = prof_filter_cname(mrb, nm);
+    mrb_value args[3];
+
+    mrb->jmp = &c_jmp;
+    args[0] = nm->file ? mrb_str_new_cstr(mrb, nm->file) : mrb_nil_value();
+    args[1] = cname ? mrb_str_new_cstr(mrb, cname) : mrb_nil_value();
+    args[2] = mrb_str_new_cstr(mrb, nm->mname);
+    res = mrb_test(mrb_funcall_argv(mrb, mrb_ary_ref(mrb, procs, idx),
+                                    mrb_intern_lit(mrb, "call"), 3, args));
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp) {
+    mrb->jmp = prev_jmp;
+    mrb->exc = NULL;
+    res = ps->filter.rules[idx].exclude ? FALSE : TRUE;
+  }
+  MRB_END_EXC(&c_jmp);
+  mrb->code_fetch_hook = hook;
+  mrb_gc_arena_restore(mrb, ai);
+
+  return res;
+}
+
+//Whether a rule matches some code
+static mrb_bool
+prof_filter_match(mrb_state *mrb, struct prof_state *ps, int idx,
+                  struct prof_filter_names *nm)
+{
+  struct prof_filter_rule *rule = &ps->filter.rules[idx];
+  const char *cname;
+
+  switch (rule->kind) {
+  case PROF_FILTER_FILE:
+    return nm->file && fnmatch(rule->pattern, nm->file, 0) == 0;
+  case PROF_FILTER_CLASS:
+    cname = prof_filter_cname(mrb, nm);
+    return cname && fnmatch(rule->pattern, cname, 0) == 0;
+  case PROF_FILTER_METHOD:
+    return fnmatch(rule->pattern, nm->mname, 0) == 0;
+  case PROF_FILTER_PROC:
+    return prof_filter_call(mrb, ps, idx, nm);
+  }
+
+  return FALSE;
+}
+
+//Decide whether code is profiled
+//
+//It is when it matches an include rule, or there are none, and matches no
+//exclude rule.
+static mrb_bool
+prof_filter_eval(mrb_state *mrb, struct prof_state *ps,
+                 struct prof_filter_names *nm)
+{
+  struct prof_filter *pf = &ps->filter;
+  mrb_bool on = !pf->includes;
+  int i;
+
+  for (i = 0; i < pf->num && !on; i++) {
+    if (!pf->rules[i].exclude && prof_filter_match(mrb, ps, i, nm)) {
+      on = TRUE;
+    }
+  }
+  for (i = 0; i < pf->num && on; i++) {
+    if (pf->rules[i].exclude && prof_filter_match(mrb, ps, i, nm)) {
+      on = FALSE;
+    }
+  }
+
+  return on;
+}
+
+static uint32_t
+prof_filter_hash(const void *ent)
+{
+  return PROF_PTR_HASH(((const struct prof_filter_ent *)ent)->irep);
+}
+
+static mrb_bool
+prof_filter_ent_match(const void *ent, const void *key)
+{
+  return ((const struct prof_filter_ent *)ent)->irep == key;
+}
+
+//Decisions taken, keyed by irep
+static const struct prof_tab_type prof_filter_tab = {
+  sizeof(struct prof_filter_ent), 64, prof_filter_hash, prof_filter_ent_match
+};
+
+//Whether an irep is profiled by the filters
+//
+//The decision is taken the first time the irep is seen and kept until the
+//rules change, so each predicate runs once per irep. A block follows the
+//method it was called in, whose name and class it shares.
+//
+//Arguments:
+// - mrb:   mruby state
+// - ps:    profiler state of mrb
+// - irep:  code run, an irep standing for a C method for one
+// - klass: class implementing the method running irep
+// - mid:   method name, 0 outside methods
+mrb_bool
+mrb_profiler_filter_pass(mrb_state *mrb, struct prof_state *ps,
+                         mrb_irep *irep, struct RClass *klass, mrb_sym mid)
+{
+  struct prof_filter *pf = &ps->filter;
+  struct prof_filter_ent *ent;
+  struct prof_filter_names nm;
+  mrb_bool on;
+
+  if (pf->num == 0) {
+    return TRUE;
+  }
+
+  ent = (struct prof_filter_ent *)
+      mrb_profiler_tab_get(mrb, &pf->tab, &prof_filter_tab, irep,
+                           PROF_PTR_HASH(irep));
+  if (ent->irep) {
+    return ent->on;
+  }
+
+  memset(&nm, 0, sizeof(nm));
+  nm.klass = klass;
+  nm.file  = PROF_NATIVE_P(irep) ? NULL : irep->filename;
+  nm.mname = mid ? mrb_sym2name(mrb, mid) : "";
+  on = prof_filter_eval(mrb, ps, &nm);
+
+  //A predicate may have changed the rules, look for a free slot again
+  ent = (struct prof_filter_ent *)
+      mrb_profiler_tab_get(mrb, &pf->tab, &prof_filter_tab, irep,
+                           PROF_PTR_HASH(irep));
+  ent->irep = irep;
+  ent->on = on;
+  irep->refcnt++;
+  pf->tab.num++;
+
+  return on;
+}
+
+//Forget the decisions taken, after the rules changed
+static void
+prof_filter_forget(mrb_state *mrb, struct prof_state *ps)
+{
+  struct prof_filter *pf = &ps->filter;
+  struct prof_filter_ent *tab = (struct prof_filter_ent *)pf->tab.ent;
+  uint32_t i;
+
+  for (i = 0; i < pf->tab.capa; i++) {
+    if (tab[i].irep) {
+      mrb_irep_decref(mrb, tab[i].irep);
+      tab[i].irep = NULL;
+    }
+  }
+  pf->tab.num = 0;
+  pf->last = NULL;
+  pf->ci = NULL;
+  pf->proc = NULL;
+  pf->pc = NULL;
+  pf->folded = FALSE;
+}
+
+//Add a filter rule
+//
+//Arguments:
+// - mrb:     mruby state
+// - ps:      profiler state of mrb
+// - exclude: whether matching code is left out, else only matching code
+//            is profiled
+// - kind:    what the rule matches
+// - pattern: glob matched with fnmatch(), NULL for PROF_FILTER_PROC
+// - proc:    predicate called with the file, class name and method name,
+//            for PROF_FILTER_PROC
+void
+mrb_profiler_filter_add(mrb_state *mrb, struct prof_state *ps,
+                        mrb_bool exclude, enum prof_filter_kind kind,
+                        const char *pattern, mrb_value proc)
+{
+  struct prof_filter *pf = &ps->filter;
+  struct prof_filter_rule *rule;
+
+  if (pf->num == pf->capa) {
+    int size = pf->capa ? pf->capa * 2 : 8;
+    struct prof_filter_rule *rules;
+
+    rules = (struct prof_filter_rule *)realloc(pf->rules,
+                                               size * sizeof(*rules));
+    if (!rules) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+    }
+    pf->rules = rules;
+    pf->capa = size;
+  }
+  rule = &pf->rules[pf->num];
+  rule->exclude = exclude;
+  rule->kind = kind;
+  rule->pattern = NULL;
+  if (kind != PROF_FILTER_PROC) {
+    rule->pattern = strdup(pattern);
+    if (!rule->pattern) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+    }
+  }
+
+  //Predicates sit at the index of their rule
+  {
+    mrb_value procs = mrb_iv_get(mrb, ps->module, PROF_FILTERS_SYM);
+
+    if (!mrb_array_p(procs)) {
+      procs = mrb_ary_new(mrb);
+      mrb_iv_set(mrb, ps->module, PROF_FILTERS_SYM, procs);
+    }
+    mrb_ary_set(mrb, procs, pf->num, proc);
+  }
+
+  pf->num++;
+  if (!exclude) {
+    pf->includes = TRUE;
+  }
+  prof_filter_forget(mrb, ps);
+}
+
+//Add the rules of a comma separated list of kind:pattern, like
+//"file:*/lib/*,class:Foo*"
+//
+//Arguments:
+// - mrb:     mruby state
+// - ps:      profiler state of mrb
+// - exclude: whether the rules exclude
+// - spec:    the list, items of unknown kinds are reported and skipped
+void
+mrb_profiler_filter_parse(mrb_state *mrb, struct prof_state *ps,
+                          mrb_bool exclude, const char *spec)
+{
+  while (*spec) {
+    const char *end = strchr(spec, ',');
+    size_t len = end ? (size_t)(end - spec) : strlen(spec);
+    char item[256];
+    char *pattern;
+    int kind;
+
+    if (len > 0 && len < sizeof(item)) {
+      memcpy(item, spec, len);
+      item[len] = '\0';
+      pattern = strchr(item, ':');
+      if (pattern) {
+        *pattern++ = '\0';
+      }
+      for (kind = PROF_FILTER_FILE; kind < PROF_FILTER_PROC; kind++) {
+        if (strcmp(item, prof_filter_kinds[kind]) == 0) {
+          break;
+        }
+      }
+      if (pattern && kind < PROF_FILTER_PROC) {
+        mrb_profiler_filter_add(mrb, ps, exclude,
+                                (enum prof_filter_kind)kind, pattern,
+                                mrb_nil_value());
+      }
+      else {
+        fprintf(stderr, "mruby-profiler: bad filter %s, expected "
+                "file:GLOB, class:GLOB or method:GLOB\n", item);
+      }
+    }
+    spec += len;
+    if (*spec) {
+      spec++;
+    }
+  }
+}
+
+//Remove every filter rule, profiling all code again
+void
+mrb_profiler_filter_clear(mrb_state *mrb, struct prof_state *ps)
+{
+  struct prof_filter *pf = &ps->filter;
+  int i;
+
+  prof_filter_forget(mrb, ps);
+  for (i = 0; i < pf->num; i++) {
+    free(pf->rules[i].pattern);
+  }
+  pf->num = 0;
+  pf->includes = FALSE;
+  mrb_iv_set(mrb, ps->module, PROF_FILTERS_SYM, mrb_nil_value());
+}
+
+//Release the rules and decisions
+void
+mrb_profiler_filter_free(mrb_state *mrb, struct prof_state *ps)
+{
+  mrb_profiler_filter_clear(mrb, ps);
+  free(ps->filter.rules);
+  mrb_profiler_tab_free(&ps->filter.tab);
+  memset(&ps->filter, 0, sizeof(ps->filter));
+}
+
+//Describe the filter rules
+//
+//Returns:
+// - Array of [action, kind, pattern] in the order added, action being
+//   :include or :exclude, kind :file, :class, :method or :proc and pattern
+//   a glob or the predicate
+mrb_value
+mrb_profiler_filter_list(mrb_state *mrb, struct prof_state *ps)
+{
+  struct prof_filter *pf = &ps->filter;
+  mrb_value procs = mrb_iv_get(mrb, ps->module, PROF_FILTERS_SYM);
+  mrb_value res = mrb_ary_new_capa(mrb, pf->num);
+  int i;
+
+  for (i = 0; i < pf->num; i++) {
+    struct prof_filter_rule *rule = &pf->rules[i];
+    mrb_value ent = mrb_ary_new_capa(mrb, 3);
+
+    mrb_ary_push(mrb, ent, mrb_symbol_value(rule->exclude
+                                            ? mrb_intern_lit(mrb, "exclude")
+                                            : mrb_intern_lit(mrb, "include")));
+    mrb_ary_push(mrb, ent, mrb_symbol_value(
+                   mrb_intern_cstr(mrb, prof_filter_kinds[rule->kind])));
+    mrb_ary_push(mrb, ent, rule->pattern
+                           ? mrb_str_new_cstr(mrb, rule->pattern)
+                           : mrb_ary_ref(mrb, procs, i));
+    mrb_ary_push(mrb, res, ent);
+  }
+
+  return res;
+}
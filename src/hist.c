@@ -0,0 +1,135 @@
+/* Profiler for ruby - latency histograms */
+#include "mruby.h"
+#include "mruby/array.h"
+#include "profiler.h"
+#include <string.h>
+
+//Smallest duration falling in a bucket
+static uint64_t
+prof_hist_low(int idx)
+{
+  int shift;
+
+  if (idx < PROF_HIST_SUB) {
+    return (uint64_t)idx;
+  }
+  shift = idx / PROF_HIST_SUB - 1;
+  return (uint64_t)(PROF_HIST_SUB + idx % PROF_HIST_SUB) << shift;
+}
+
+//Duration standing for the values of a bucket, its middle
+static uint64_t
+prof_hist_mid(int idx)
+{
+  uint64_t low = prof_hist_low(idx);
+
+  if (idx < PROF_HIST_SUB) {
+    return low;
+  }
+  return low + (((uint64_t)1 << (idx / PROF_HIST_SUB - 1)) >> 1);
+}
+
+//Number of durations recorded
+uint64_t
+mrb_profiler_hist_count(const struct prof_hist *h)
+{
+  uint64_t n = 0;
+  int i;
+
+  for (i = 0; i < PROF_HIST_BUCKETS; i++) {
+    n += h->count[i];
+  }
+  return n;
+}
+
+//Get a percentile of the durations recorded
+//
+//The duration is the middle of its bucket, within 1/16 of the exact one,
+//and never above the longest recorded.
+//
+//Arguments:
+// - h: histogram
+// - q: fraction of the durations at or below the result, 0 to 1
+//Returns:
+// - Ticks, 0 if nothing was recorded
+uint64_t
+mrb_profiler_hist_value(const struct prof_hist *h, double q)
+{
+  uint64_t n = mrb_profiler_hist_count(h);
+  uint64_t rank;
+  uint64_t cum = 0;
+  int i;
+
+  if (n == 0) {
+    return 0;
+  }
+  rank = (uint64_t)(q * (double)n + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  for (i = 0; i < PROF_HIST_BUCKETS; i++) {
+    cum += h->count[i];
+    if (cum >= rank) {
+      uint64_t mid = prof_hist_mid(i);
+
+      return mid < h->max ? mid : h->max;
+    }
+  }
+  return h->max;
+}
+
+//Add the durations of a histogram to another
+//
+//Arguments:
+// - to:    destination
+// - from:  durations added
+// - scale: ticks of to per tick of from, durations being moved to the
+//          buckets of their scaled middle unless it is 1
+void
+mrb_profiler_hist_add(struct prof_hist *to, const struct prof_hist *from,
+                      double scale)
+{
+  uint64_t max = from->max;
+  int i;
+
+  if (scale == 1.0) {
+    for (i = 0; i < PROF_HIST_BUCKETS; i++) {
+      to->count[i] += from->count[i];
+    }
+  }
+  else {
+    for (i = 0; i < PROF_HIST_BUCKETS; i++) {
+      if (from->count[i]) {
+        uint64_t mid = (uint64_t)((double)prof_hist_mid(i) * scale);
+
+        to->count[prof_hist_bucket(mid)] += from->count[i];
+      }
+    }
+    max = (uint64_t)((double)max * scale);
+  }
+  if (to->max < max) {
+    to->max = max;
+  }
+}
+
+//Summarize a histogram for reports
+//
+//Returns:
+// - [count, p50, p90, p99, max], durations in seconds
+mrb_value
+mrb_profiler_hist_summary(mrb_state *mrb, const struct prof_hist *h)
+{
+  static const double qs[] = { 0.5, 0.9, 0.99 };
+  mrb_value res = mrb_ary_new_capa(mrb, 5);
+  int i;
+
+  mrb_ary_push(mrb, res,
+               mrb_fixnum_value((mrb_int)mrb_profiler_hist_count(h)));
+  for (i = 0; i < 3; i++) {
+    mrb_ary_push(mrb, res, mrb_float_value(mrb,
+        PROF_TICK2SEC(mrb_profiler_hist_value(h, qs[i]))));
+  }
+  mrb_ary_push(mrb, res, mrb_float_value(mrb, PROF_TICK2SEC(h->max)));
+
+  return res;
+}
@@ -0,0 +1,175 @@
+/* Profiler for ruby - opcode statistics */
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/opcode.h"
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROF_OPNAME(op) [op] = #op
+
+//Opcode names, NULL for unused opcodes
+static const char *prof_opnames[PROF_OPCODES] = {
+  PROF_OPNAME(OP_NOP), PROF_OPNAME(OP_MOVE), PROF_OPNAME(OP_LOADL),
+  PROF_OPNAME(OP_LOADI), PROF_OPNAME(OP_LOADSYM), PROF_OPNAME(OP_LOADNIL),
+  PROF_OPNAME(OP_LOADSELF), PROF_OPNAME(OP_LOADT), PROF_OPNAME(OP_LOADF),
+  PROF_OPNAME(OP_GETGLOBAL), PROF_OPNAME(OP_SETGLOBAL),
+  PROF_OPNAME(OP_GETSPECIAL), PROF_OPNAME(OP_SETSPECIAL),
+  PROF_OPNAME(OP_GETIV), PROF_OPNAME(OP_SETIV), PROF_OPNAME(OP_GETCV),
+  PROF_OPNAME(OP_SETCV), PROF_OPNAME(OP_GETCONST), PROF_OPNAME(OP_SETCONST),
+  PROF_OPNAME(OP_GETMCNST), PROF_OPNAME(OP_SETMCNST),
+  PROF_OPNAME(OP_GETUPVAR), PROF_OPNAME(OP_SETUPVAR),
+  PROF_OPNAME(OP_JMP), PROF_OPNAME(OP_JMPIF), PROF_OPNAME(OP_JMPNOT),
+  PROF_OPNAME(OP_ONERR), PROF_OPNAME(OP_RESCUE), PROF_OPNAME(OP_POPERR),
+  PROF_OPNAME(OP_RAISE), PROF_OPNAME(OP_EPUSH), PROF_OPNAME(OP_EPOP),
+  PROF_OPNAME(OP_SEND), PROF_OPNAME(OP_SENDB), PROF_OPNAME(OP_FSEND),
+  PROF_OPNAME(OP_CALL), PROF_OPNAME(OP_SUPER), PROF_OPNAME(OP_ARGARY),
+  PROF_OPNAME(OP_ENTER), PROF_OPNAME(OP_KARG), PROF_OPNAME(OP_KDICT),
+  PROF_OPNAME(OP_RETURN), PROF_OPNAME(OP_TAILCALL), PROF_OPNAME(OP_BLKPUSH),
+  PROF_OPNAME(OP_ADD), PROF_OPNAME(OP_ADDI), PROF_OPNAME(OP_SUB),
+  PROF_OPNAME(OP_SUBI), PROF_OPNAME(OP_MUL), PROF_OPNAME(OP_DIV),
+  PROF_OPNAME(OP_EQ), PROF_OPNAME(OP_LT), PROF_OPNAME(OP_LE),
+  PROF_OPNAME(OP_GT), PROF_OPNAME(OP_GE), PROF_OPNAME(OP_ARRAY),
+  PROF_OPNAME(OP_ARYCAT), PROF_OPNAME(OP_ARYPUSH), PROF_OPNAME(OP_AREF),
+  PROF_OPNAME(OP_ASET), PROF_OPNAME(OP_APOST), PROF_OPNAME(OP_STRING),
+  PROF_OPNAME(OP_STRCAT), PROF_OPNAME(OP_HASH), PROF_OPNAME(OP_LAMBDA),
+  PROF_OPNAME(OP_RANGE), PROF_OPNAME(OP_OCLASS), PROF_OPNAME(OP_CLASS),
+  PROF_OPNAME(OP_MODULE), PROF_OPNAME(OP_EXEC), PROF_OPNAME(OP_METHOD),
+  PROF_OPNAME(OP_SCLASS), PROF_OPNAME(OP_TCLASS), PROF_OPNAME(OP_DEBUG),
+  PROF_OPNAME(OP_STOP), PROF_OPNAME(OP_ERR),
+};
+
+//Get the name of an opcode as a Ruby string
+mrb_value
+mrb_profiler_opcode_name(mrb_state *mrb, int op)
+{
+  char buf[32];
+
+  if (prof_opnames[op]) {
+    return mrb_str_new_cstr(mrb, prof_opnames[op]);
+  }
+  snprintf(buf, sizeof(buf), "OP_unknown_%d", op);
+  return mrb_str_new_cstr(mrb, buf);
+}
+
+//Get an opcode from its name, like "OP_SEND"
+//
+//Returns:
+// - Opcode, -1 if none has the name
+int
+mrb_profiler_opcode_of(const char *name)
+{
+  int op;
+
+  for (op = 0; op < PROF_OPCODES; op++) {
+    if (prof_opnames[op] && strcmp(prof_opnames[op], name) == 0) {
+      return op;
+    }
+  }
+  return -1;
+}
+
+//Start or stop collecting opcode statistics
+//
+//The tables are kept when collection stops, so they can still be
+//reported.
+//
+//Arguments:
+// - mrb: mruby state
+// - ps:  profiler state of mrb
+// - on:  whether to collect them
+void
+mrb_profiler_opstat_enable(mrb_state *mrb, struct prof_state *ps, mrb_bool on)
+{
+  if (on && !ps->opstat) {
+    ps->opstat = (struct prof_opstat *)calloc(1, sizeof(struct prof_opstat));
+    if (!ps->opstat) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+    }
+  }
+  ps->opstat_on = on && ps->opstat;
+}
+
+//Zero the opcode statistics
+void
+mrb_profiler_opstat_reset(struct prof_state *ps)
+{
+  if (ps->opstat) {
+    memset(ps->opstat, 0, sizeof(struct prof_opstat));
+  }
+}
+
+//Release the opcode statistics
+void
+mrb_profiler_opstat_free(struct prof_state *ps)
+{
+  free(ps->opstat);
+  ps->opstat = NULL;
+  ps->opstat_on = FALSE;
+}
+
+//Get the executions and time of every opcode executed
+//
+//Returns:
+// - Array of [name, executions, seconds] in opcode order
+mrb_value
+mrb_profiler_opstat_counts(mrb_state *mrb, struct prof_state *ps)
+{
+  struct prof_opstat *os = ps->opstat;
+  mrb_value res = mrb_ary_new(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+  int op;
+
+  for (op = 0; os && op < PROF_OPCODES; op++) {
+    mrb_value ent;
+
+    if (os->num[op] == 0) {
+      continue;
+    }
+    ent = mrb_ary_new_capa(mrb, 3);
+    mrb_ary_push(mrb, ent, mrb_profiler_opcode_name(mrb, op));
+    mrb_ary_push(mrb, ent, mrb_fixnum_value((mrb_int)os->num[op]));
+    mrb_ary_push(mrb, ent,
+                 mrb_float_value(mrb, PROF_TICK2SEC(os->time[op])));
+    mrb_ary_push(mrb, res, ent);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  return res;
+}
+
+//Get the counts of consecutive opcode pairs
+//
+//Returns:
+// - Array of [first name, second name, count] for the pairs seen
+mrb_value
+mrb_profiler_opstat_pairs(mrb_state *mrb, struct prof_state *ps)
+{
+  struct prof_opstat *os = ps->opstat;
+  mrb_value res = mrb_ary_new(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+  int a;
+  int b;
+
+  for (a = 0; os && a < PROF_OPCODES; a++) {
+    if (os->num[a] == 0) {
+      continue;
+    }
+    for (b = 0; b < PROF_OPCODES; b++) {
+      mrb_value ent;
+
+      if (os->pair[a][b] == 0) {
+        continue;
+      }
+      ent = mrb_ary_new_capa(mrb, 3);
+      mrb_ary_push(mrb, ent, mrb_profiler_opcode_name(mrb, a));
+      mrb_ary_push(mrb, ent, mrb_profiler_opcode_name(mrb, b));
+      mrb_ary_push(mrb, ent, mrb_fixnum_value((mrb_int)os->pair[a][b]));
+      mrb_ary_push(mrb, res, ent);
+      mrb_gc_arena_restore(mrb, ai);
+    }
+  }
+
+  return res;
+}
@@ -0,0 +1,245 @@
+/* Profiler for ruby - performance counters */
+#include "mruby.h"
+#include "profiler.h"
+#include <string.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+
+//Counter read for each instruction
+struct prof_event {
+  const char *name;   //Name shown in reports
+  uint32_t type;      //perf_event_attr type
+  uint64_t config;    //perf_event_attr config
+};
+
+static const struct prof_event prof_hw_events[] = {
+  { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "cache_misses",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+//Used where the hardware counters are hidden, as in most VMs and
+//containers
+static const struct prof_event prof_sw_events[] = {
+  { "task_clock",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+  { "page_faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+  { "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+#define PROF_EVENTS(tab) (int)(sizeof(tab) / sizeof((tab)[0]))
+
+//Open a group of counters of the calling thread
+//
+//Events the CPU or the kernel refuses are left out.
+//
+//Arguments:
+// - pmu:   counters, must be closed
+// - ev:    events to count
+// - n:     number of events
+// - names: names of the events opened
+//Returns:
+// - Number of events opened
+static int
+prof_pmu_open_group(struct prof_pmu *pmu, const struct prof_event *ev, int n,
+                    const char **names)
+{
+  long pagesize = sysconf(_SC_PAGESIZE);
+  int i;
+
+  pmu->rdpmc = TRUE;
+  for (i = 0; i < n && pmu->num < PROF_EVENT_MAX; i++) {
+    struct perf_event_attr attr;
+    int fd;
+    void *page;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = ev[i].type;
+    attr.config = ev[i].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1,
+                      pmu->num ? pmu->fd[0] : -1, 0);
+    if (fd < 0) {
+      continue;
+    }
+
+    page = mmap(NULL, pagesize, PROT_READ, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+      page = NULL;
+    }
+    if (!page || !((struct perf_event_mmap_page *)page)->cap_user_rdpmc) {
+      pmu->rdpmc = FALSE;
+    }
+    pmu->fd[pmu->num] = fd;
+    pmu->page[pmu->num] = page;
+    names[pmu->num] = ev[i].name;
+    pmu->num++;
+  }
+#if !defined(__x86_64__) && !defined(__i386__)
+  pmu->rdpmc = FALSE;
+#endif
+
+  return pmu->num;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//Read a counter from user space
+//
+//Returns:
+// - Whether the counter was read, it isn't while not on a PMU
+static int
+prof_rdpmc(volatile struct perf_event_mmap_page *pc, uint64_t *val)
+{
+  uint32_t seq;
+  uint32_t idx;
+  uint32_t lo;
+  uint32_t hi;
+  uint64_t raw;
+  int shift;
+
+  do {
+    seq = pc->lock;
+    __sync_synchronize();
+    idx = pc->index;
+    if (!pc->cap_user_rdpmc || idx == 0) {
+      return 0;
+    }
+    __asm__ volatile ("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx - 1));
+    raw = ((uint64_t)hi << 32) | lo;
+    //Sign extend the counter width
+    shift = 64 - pc->pmc_width;
+    *val = pc->offset + (uint64_t)((int64_t)(raw << shift) >> shift);
+    __sync_synchronize();
+  } while (pc->lock != seq);
+
+  return 1;
+}
+#endif
+
+#endif
+
+//Open the performance counters of the calling thread
+//
+//The hardware events are tried first, then the software ones. A call tree
+//keeps the counts of one event set, counts of another one are dropped.
+//
+//Arguments:
+// - mrb:      mruby state
+// - ps:       profiler state of mrb
+// - hardware: whether to try the hardware events
+//Returns:
+// - Number of counters open, 0 if none is available
+int
+mrb_profiler_pmu_open(mrb_state *mrb, struct prof_state *ps,
+                      mrb_bool hardware)
+{
+  struct prof_result *pr = &ps->result;
+  const char *names[PROF_EVENT_MAX];
+  int n = 0;
+  int i;
+
+  mrb_profiler_pmu_close(ps);
+#if defined(__linux__)
+  if (hardware) {
+    n = prof_pmu_open_group(&ps->pmu, prof_hw_events,
+                            PROF_EVENTS(prof_hw_events), names);
+  }
+  if (n == 0) {
+    n = prof_pmu_open_group(&ps->pmu, prof_sw_events,
+                            PROF_EVENTS(prof_sw_events), names);
+  }
+#else
+  (void) hardware;
+#endif
+  if (n == 0) {
+    return 0;
+  }
+
+  for (i = 0; i < n && i < pr->event_num; i++) {
+    if (strcmp(pr->event_name[i], names[i]) != 0) {
+      break;
+    }
+  }
+  if (i != n || n != pr->event_num) {
+    for (i = 0; i < pr->irep_num; i++) {
+      pr->irep_tab[i]->events = NULL;
+    }
+    pr->event_num = n;
+    memcpy(pr->event_name, names, n * sizeof(names[0]));
+  }
+  if (ps->current) {
+    mrb_profiler_event_counters(mrb, pr, ps->current);
+  }
+  mrb_profiler_pmu_read(&ps->pmu, ps->pmu.old);
+
+  return n;
+}
+
+//Close the performance counters, the counts stay in the call tree
+void
+mrb_profiler_pmu_close(struct prof_state *ps)
+{
+#if defined(__linux__)
+  struct prof_pmu *pmu = &ps->pmu;
+  long pagesize = sysconf(_SC_PAGESIZE);
+  int i;
+
+  for (i = 0; i < pmu->num; i++) {
+    if (pmu->page[i]) {
+      munmap(pmu->page[i], pagesize);
+    }
+    close(pmu->fd[i]);
+  }
+#endif
+  memset(&ps->pmu, 0, sizeof(ps->pmu));
+}
+
+//Read every open counter
+//
+//rdpmc is used when the kernel allows it, otherwise a read of the group
+//costs one system call.
+//
+//Arguments:
+// - pmu: open counters
+// - val: values [pmu->num]
+void
+mrb_profiler_pmu_read(struct prof_pmu *pmu, uint64_t *val)
+{
+#if defined(__linux__)
+  struct {
+    uint64_t nr;
+    uint64_t val[PROF_EVENT_MAX];
+  } group;
+  int i;
+
+#if defined(__x86_64__) || defined(__i386__)
+  if (pmu->rdpmc) {
+    for (i = 0; i < pmu->num; i++) {
+      if (!prof_rdpmc(pmu->page[i], &val[i])) {
+        break;
+      }
+    }
+    if (i == pmu->num) {
+      return;
+    }
+  }
+#endif
+  if (read(pmu->fd[0], &group, sizeof(group)) > 0) {
+    for (i = 0; i < pmu->num && i < (int)group.nr; i++) {
+      val[i] = group.val[i];
+    }
+  }
+#else
+  (void) pmu;
+  (void) val;
+#endif
+}
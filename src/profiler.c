@@ -8,377 +8,2020 @@
 #include "mruby/opcode.h"
 #include "mruby/string.h"
 #include "mruby/proc.h"
+#include "mruby/data.h"
+#include "mruby/profiler.h"
+#include "profiler.h"
 #include <time.h>
-#include <sys/time.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 
-struct prof_counter {
-  double time;  //Total execution time in seconds
-  uint32_t num; //Total number of executions
-};
+#define PROF_ALLOC(size) \
+  mrb_profiler_arena_alloc(mrb, &pr->arena, (size))
+#define PROF_INTERN(str) \
+  mrb_profiler_arena_intern(mrb, &pr->arena, (str))
+#define TO_S(x) PROF_INTERN(mrb_string_value_ptr(mrb, mrb_obj_value(x)))
+
+//Ivar of the Profiler module keeping the classes referenced by nodes alive
+#define PROF_CLASSES_SYM mrb_intern_lit(mrb, "__profiled_classes__")
+//Free slots kept at the end of it beyond as many as are used
+#define PROF_CLASSES_SPARE 64
+
+//Make room for the classes the hook may reference next
+//
+//The array of classes is padded with nil up to twice the classes kept plus
+//some, so the hook fills slots in place without allocating. It is called
+//outside the hook, when profiling starts, is reset or snapshot.
+static void
+prof_class_reserve(mrb_state *mrb, struct prof_state *ps)
+{
+  mrb_value classes = mrb_iv_get(mrb, ps->module, PROF_CLASSES_SYM);
+  mrb_int want = (mrb_int)ps->class_rooted * 2 + PROF_CLASSES_SPARE;
+
+  if (mrb_array_p(classes) && RARRAY_LEN(classes) < want) {
+    mrb_ary_set(mrb, classes, want - 1, mrb_nil_value());
+  }
+}
+
+//Reference a class from the Profiler module
+//
+//Arguments:
+//  - mrb:   mruby state
+//  - ps:    profiler state of mrb
+//  - klass: class first seen by the hook
+static void
+prof_class_root(mrb_state *mrb, struct prof_state *ps, struct RClass *klass)
+{
+  mrb_value classes = mrb_iv_get(mrb, ps->module, PROF_CLASSES_SYM);
+  mrb_int i = ps->class_rooted;
+
+  if (!mrb_array_p(classes)) {
+    return;
+  }
+  if (i < RARRAY_LEN(classes)) {
+    mrb_ary_set(mrb, classes, i, mrb_obj_value(klass));
+  }
+  else {
+    //More new classes than reserved: the array grows, which doesn't
+    //allocate objects nor run the GC, and the bytes aren't charged to the
+    //instruction
+    mrb_bool track = ps->track_alloc;
+
+    ps->track_alloc = FALSE;
+    mrb_ary_set(mrb, classes, i, mrb_obj_value(klass));
+    ps->track_alloc = track;
+  }
+  ps->class_rooted++;
+}
 
-struct prof_irep {
-  mrb_irep *irep;           //VM instructions
-  const char *mname;        //Method name
-  const char *klass;        //Class implementing method
-  struct prof_counter *cnt; //Profiler results
+static uint32_t
+prof_class_hash(const void *ent)
+{
+  return PROF_PTR_HASH((*(struct prof_class * const *)ent)->klass);
+}
 
-  int child_num;            //Number of called methods
-  int child_capa;           //Child array capacity
-  struct prof_irep **child; //Children VM instructions/methods [child_num elements]
+static mrb_bool
+prof_class_match(const void *ent, const void *key)
+{
+  return (*(struct prof_class * const *)ent)->klass == key;
+}
 
-  int *ccall_num;           //Number of calls to each child [child_num elements]
-  struct prof_irep *parent;
+//Classes referenced by nodes, keyed by class
+static const struct prof_tab_type prof_class_tab = {
+  sizeof(struct prof_class *), 64, prof_class_hash, prof_class_match
 };
 
-struct prof_result {
-  struct prof_irep *irep_root; //First irep profiled
-  int irep_num;                //Number of ireps profiled
-  int irep_capa;               //Capacity of irep array
-  struct prof_irep **irep_tab; //Profiler results, one irep each
+//Get the profiler's record of a class, creating it on first sight
+//
+//Only the class pointer is recorded, its name is resolved when reported so
+//the hook never calls back into Ruby. The class is referenced from the
+//Profiler module so it outlives every node pointing to it, in a slot
+//reserved beforehand.
+//
+//Arguments:
+//  - mrb:   mruby state
+//  - ps:    profiler state of mrb
+//  - klass: class implementing a method (NULL if unknown)
+static struct prof_class *
+prof_class_get(mrb_state *mrb, struct prof_state *ps, struct RClass *klass)
+{
+  struct prof_result *pr = &ps->result;
+  struct prof_class **ent;
+  struct prof_class *ref;
+
+  //Methods of included modules run with the include class as target
+  if (klass && klass->tt == MRB_TT_ICLASS) {
+    klass = klass->c;
+  }
+
+  ent = (struct prof_class **)mrb_profiler_tab_get(mrb, &ps->classes,
+                                                   &prof_class_tab, klass,
+                                                   PROF_PTR_HASH(klass));
+  if (*ent) {
+    return *ent;
+  }
+
+  ref = (struct prof_class *)PROF_ALLOC(sizeof(struct prof_class));
+  ref->klass = klass;
+  *ent = ref;
+  ps->classes.num++;
+  if (klass) {
+    prof_class_root(mrb, ps, klass);
+  }
+
+  return ref;
+}
+
+//Get the name of the method run by a node
+//
+//Nodes of snapshots have their names resolved when copied, so only live
+//nodes of mrb's profile get here with a name missing.
+const char *
+mrb_profiler_irep_mname(mrb_state *mrb, struct prof_irep *prof)
+{
+  if (!prof->mname) {
+    struct prof_result *pr = &mrb_profiler_state(mrb)->result;
+    const char *name = mrb_sym2name(mrb, prof->mid);
+
+    prof->mname = PROF_INTERN(name ? name : "");
+  }
+  return prof->mname;
+}
+
+//Get the name of the class implementing the method run by a node
+const char *
+mrb_profiler_irep_klass(mrb_state *mrb, struct prof_irep *prof)
+{
+  struct prof_class *ref = prof->klass;
+
+  if (!ref->name) {
+    struct prof_result *pr = &mrb_profiler_state(mrb)->result;
+
+    ref->name = ref->klass ? TO_S(ref->klass) : PROF_INTERN("");
+  }
+  return ref->name;
+}
+
+static uint32_t
+prof_owner_hash(const void *ent)
+{
+  return PROF_PTR_HASH((*(struct prof_irep * const *)ent)->irep);
+}
+
+static mrb_bool
+prof_owner_match(const void *ent, const void *key)
+{
+  return (*(struct prof_irep * const *)ent)->irep == key;
+}
+
+//Nodes owning the counters of each irep in flat mode, keyed by irep
+static const struct prof_tab_type prof_owner_tab = {
+  sizeof(struct prof_irep *), 64, prof_owner_hash, prof_owner_match
 };
 
-//Profiling results
-static struct prof_result result;
-//Current method
-static struct prof_irep *current_prof_irep = NULL;
-//Last profiled instruction
-static mrb_code *old_pc = NULL;
-//Time that last instruction was fetched at
-static double old_time = 0.0;
-//Profiler module
-static mrb_value prof_module;
-
-#define TO_S(x) strdup(mrb_string_value_ptr(mrb, mrb_obj_value(x)))
-
-//Get class which appears to define the current method
-//
-//Arguments:
-//  - mrb: mruby state
-//  - irep: active method
-static const char *
-get_class(mrb_state *mrb, struct mrb_irep *irep)
-{
-  //Get root class from VM stack
-  struct RClass *c    = mrb_class(mrb, mrb->c->stack[0]);
-  struct RClass *cc   = c;
-  struct RProc  *proc;
-
-  //Get class#method
-#if (MRUBY_RELEASE_MAJOR == 1 && MRUBY_RELEASE_MINOR >= 4) || MRUBY_RELEASE_MAJOR > 1
-  #if defined(MRB_METHOD_TABLE_INLINE)
-    mrb_raise(mrb, mrb->eException_class, "profiling not supported when using MRB_METHOD_TABLE_INLINE");
-  #else
-    mrb_method_t meth = mrb_method_search_vm(mrb, &cc, mrb->c->ci->mid);
-    proc = meth.proc;
-  #endif
-#else
-  proc = mrb_method_search_vm(mrb, &cc, mrb->c->ci->mid);
-#endif
-  const  mrb_sym m    = mrb_intern_cstr(mrb, "to_s");
-
-  //If method couldn't be retrieved or it's invalid, just use the original class
-  //(mruby bug?)
-  if(!proc || !mrb_respond_to(mrb, mrb_obj_value(cc), m)) {
-    return TO_S(c);
-  }
-
-
-  //While the method definition doesn't match, try superclasses
-  while(proc->body.irep != irep) {
-    cc = cc->super;
-#if (MRUBY_RELEASE_MAJOR == 1 && MRUBY_RELEASE_MINOR >= 4) || MRUBY_RELEASE_MAJOR > 1
-    #if defined(MRB_METHOD_TABLE_INLINE)
-      mrb_raise(mrb, mrb->eException_class, "profiling not supported when using MRB_METHOD_TABLE_INLINE");
-    #else
-      meth = mrb_method_search_vm(mrb, &cc, mrb->c->ci->mid);
-      proc = meth.proc;
-    #endif
-#else
-    proc = mrb_method_search_vm(mrb, &cc, mrb->c->ci->mid);
-#endif
-    if(!cc || !proc || !mrb_respond_to(mrb, mrb_obj_value(cc), m)) {
-      return TO_S(c);
-    }
-  }
-
-  return TO_S(cc);
+//Get the slot of the flat mode table for the node owning the counters of
+//irep, NULL in the slot if none does yet
+static struct prof_irep **
+prof_owner_slot(mrb_state *mrb, struct prof_result *pr, struct mrb_irep *irep)
+{
+  return (struct prof_irep **)mrb_profiler_tab_get(mrb, &pr->owners,
+                                                   &prof_owner_tab, irep,
+                                                   PROF_PTR_HASH(irep));
 }
 
 //Allocate a new set of profiler metadata for a new method's irep
 //
+//In flat mode the instruction counters of an irep are allocated once and
+//shared by all its nodes, which only keep their own call statistics.
+//
 //Arguments:
 // - mrb:    Mruby state
+// - pr:     Call tree the node belongs to
 // - irep:   Method irep
 // - parent: Calling method
+// - mid:    Method name
+// - klass:  Class implementing method
+//
+//Names aren't resolved here, see mrb_profiler_irep_mname/klass.
 struct prof_irep *
 mrb_profiler_alloc_prof_irep(mrb_state* mrb,
+                             struct prof_result *pr,
                              struct mrb_irep *irep,
-                             struct prof_irep *parent)
+                             struct prof_irep *parent,
+                             mrb_sym mid,
+                             struct prof_class *klass)
 {
-  size_t i;
   struct prof_irep *res;
+  struct prof_irep *node;
+  struct prof_irep **owner = NULL;
+
+  //Make room in the node table first, so a failure leaves pr consistent
+  if (pr->irep_capa <= pr->irep_num) {
+    int size = pr->irep_capa ? pr->irep_capa * 2 : 64;
+    struct prof_irep **tab = (struct prof_irep**)
+        realloc(pr->irep_tab, size * sizeof(struct prof_irep *));
+
+    if (!tab) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+    }
+    pr->irep_tab = tab;
+    pr->irep_capa = size;
+  }
+  if (pr->flat) {
+    owner = prof_owner_slot(mrb, pr, irep);
+  }
 
-  res = (struct prof_irep*)mrb_malloc(mrb, sizeof(struct prof_irep));
+  //Arena memory comes zero filled
+  res = (struct prof_irep*)PROF_ALLOC(sizeof(struct prof_irep));
 
   res->parent = parent;
   res->irep = irep;
 
-  //Grab a copy of the method name and class
-  res->mname = mrb_sym2name(mrb, mrb->c->ci->mid);
-  if(res->mname)
-    res->mname = strdup(res->mname);
-  else
-    res->mname = strdup("");
-  res->klass = get_class(mrb, irep);
-  irep->refcnt++;
+  res->mid = mid;
+  res->klass = klass;
+
+  //Count the recursion level, bounded by the folding in prof_fold
+  for (node = parent; node; node = node->parent) {
+    if (node->irep == irep) {
+      res->rec = node->rec + 1;
+      break;
+    }
+  }
 
   //Allocate per instruction counters
-  res->cnt = (struct prof_counter*)
-      mrb_malloc(mrb, irep->ilen * sizeof(struct prof_counter));
-  for (i = 0; i < irep->ilen; i++) {
-    res->cnt[i].num = 0;
-    res->cnt[i].time = 0.0;
+  if (owner && *owner) {
+    res->owner = *owner;
+    res->time = res->owner->time;
+    res->num = res->owner->num;
+    res->alloc = res->owner->alloc;
+    res->gc = res->owner->gc;
+    res->events = res->owner->events;
+    res->insn_hist = res->owner->insn_hist;
+  }
+  else {
+    res->owner = res;
+    res->time = (uint64_t*)PROF_ALLOC(irep->ilen * sizeof(uint64_t));
+    res->num = (uint32_t*)PROF_ALLOC(irep->ilen * sizeof(uint32_t));
+    if (owner) {
+      *owner = res;
+      pr->owners.num++;
+    }
   }
 
   //Preallocate child array
   res->child_num  = 0;
   res->child_capa = 4;
   res->child      = (struct prof_irep**)
-      mrb_malloc(mrb, res->child_capa * sizeof(struct prof_irep *));
-  res->ccall_num  = (int*)mrb_malloc(mrb, res->child_capa * sizeof(int));
+      PROF_ALLOC(res->child_capa * sizeof(struct prof_irep *));
+  res->ccall_num  = (int*)PROF_ALLOC(res->child_capa * sizeof(int));
+  res->child_idx  = 0;
+  res->last_child = -1;
+  res->child_hash = (int*)PROF_ALLOC(res->child_capa * 2 * sizeof(int));
 
-  //Add to the global profiler results
-  if (result.irep_capa <= result.irep_num) {
-    int size = result.irep_capa * 2;
-    result.irep_tab = (struct prof_irep**)
-        mrb_realloc(mrb, result.irep_tab, size * sizeof(struct prof_irep *));
-    result.irep_capa = size;
-  }
-  result.irep_tab[result.irep_num] = res;
-  result.irep_num++;
+  //Released by mrb_profiler_result_free
+  irep->refcnt++;
+  res->no = pr->irep_num;
+  pr->irep_tab[pr->irep_num] = res;
+  pr->irep_num++;
 
   return res;
 }
 
-//Get current time in seconds
-static inline double
-prof_curtime()
+//Get the allocation counters of a node, creating them on first use
+//
+//Arguments:
+// - mrb:  Mruby state
+// - pr:   Call tree of prof
+// - prof: Node
+struct prof_alloc *
+mrb_profiler_alloc_counters(mrb_state *mrb, struct prof_result *pr,
+                            struct prof_irep *prof)
 {
-  double curtime;
-
-#ifdef __i386__
-  unsigned long ctimehi;
-  unsigned long ctimelo;
+  if (!prof->alloc) {
+    if (!prof->owner->alloc) {
+      prof->owner->alloc = (struct prof_alloc *)
+        PROF_ALLOC(prof->irep->ilen * sizeof(struct prof_alloc));
+    }
+    prof->alloc = prof->owner->alloc;
+  }
 
-  asm volatile ("rdtsc\n\t"
-      :
-      :
-      : "%eax", "%edx");
-  asm volatile ("mov %%eax, %0\n\t"
-      :"=r"(ctimelo));
-  asm volatile ("mov %%edx, %0\n\t"
-      :"=r"(ctimehi));
-  curtime = ((double)ctimehi) * 256.0;
-  curtime += ((double)ctimelo / (65536.0 * 256.0));
-#else
-  struct timeval tv;
+  return prof->alloc;
+}
 
-  gettimeofday(&tv, NULL);
-  curtime = ((double)tv.tv_sec) + ((double)tv.tv_usec * 1e-6);
-#endif
+//Get the GC time counters of a node, creating them on first use
+//
+//Arguments:
+// - mrb:  Mruby state
+// - pr:   Call tree of prof
+// - prof: Node
+uint64_t *
+mrb_profiler_gc_counters(mrb_state *mrb, struct prof_result *pr,
+                         struct prof_irep *prof)
+{
+  if (!prof->gc) {
+    if (!prof->owner->gc) {
+      prof->owner->gc = (uint64_t *)
+        PROF_ALLOC(prof->irep->ilen * sizeof(uint64_t));
+    }
+    prof->gc = prof->owner->gc;
+  }
 
-  return curtime;
+  return prof->gc;
 }
 
-//VM Execution Hook
-//
-//This function is called before the VM executes each instruction
+//Get the performance counter counts of a node, creating them on first use
 //
 //Arguments:
-// - mrb: mruby state
-// - irep: current instruction context
-// - pc:   current VM instruction
-// - regs: current VM registers (unused)
+// - mrb:  Mruby state
+// - pr:   Call tree of prof
+// - prof: Node
+uint64_t *
+mrb_profiler_event_counters(mrb_state *mrb, struct prof_result *pr,
+                            struct prof_irep *prof)
+{
+  if (!prof->events) {
+    if (!prof->owner->events) {
+      prof->owner->events = (uint64_t *)
+        PROF_ALLOC(prof->irep->ilen * pr->event_num * sizeof(uint64_t));
+    }
+    prof->events = prof->owner->events;
+  }
+
+  return prof->events;
+}
+
+//Get the histogram of the activation durations of a node, allocating it
+//on first use
+struct prof_hist *
+mrb_profiler_call_hist(mrb_state *mrb, struct prof_result *pr,
+                       struct prof_irep *prof)
+{
+  if (!prof->hist) {
+    prof->hist = (struct prof_hist *)PROF_ALLOC(sizeof(struct prof_hist));
+  }
+
+  return prof->hist;
+}
+
+//Get the histogram of the durations of an instruction of a node,
+//allocating it on first use
+//
+//Shared in flat mode like the other instruction counters.
+struct prof_hist *
+mrb_profiler_insn_hist(mrb_state *mrb, struct prof_result *pr,
+                       struct prof_irep *prof, int off)
+{
+  if (!prof->insn_hist) {
+    if (!prof->owner->insn_hist) {
+      prof->owner->insn_hist = (struct prof_hist **)
+        PROF_ALLOC(prof->irep->ilen * sizeof(struct prof_hist *));
+    }
+    prof->insn_hist = prof->owner->insn_hist;
+  }
+  if (!prof->insn_hist[off]) {
+    prof->insn_hist[off] = (struct prof_hist *)
+      PROF_ALLOC(sizeof(struct prof_hist));
+  }
+
+  return prof->insn_hist[off];
+}
+
+//Release the ireps referenced by a call tree and the tree itself
 void
-prof_code_fetch_hook(struct mrb_state *mrb,
-                     struct mrb_irep *irep,
-                     mrb_code *pc,
-                     mrb_value *regs)
+mrb_profiler_result_free(mrb_state *mrb, struct prof_result *pr)
 {
-  double curtime;
-  struct prof_irep *newirep;
+  int i;
 
-  int off;
-  (void) regs;
+  for (i = 0; i < pr->irep_num; i++) {
+    mrb_irep_decref(mrb, pr->irep_tab[i]->irep);
+  }
+  free(pr->irep_tab);
+  mrb_profiler_tab_free(&pr->owners);
+  mrb_profiler_arena_free(&pr->arena);
+  memset(pr, 0, sizeof(*pr));
+}
 
-  curtime = prof_curtime();
+//Look up the child of parent which runs irep
+//
+//Arguments:
+// - parent: Calling method
+// - irep:   Called method irep
+//Returns:
+// - Child node or NULL
+static inline struct prof_irep *
+prof_find_child(struct prof_irep *parent, struct mrb_irep *irep)
+{
+  uint32_t mask;
+  uint32_t h;
+  int idx;
+
+  //Calls from a given site tend to repeat the same method
+  if (parent->last_child >= 0 &&
+      parent->child[parent->last_child]->irep == irep) {
+    return parent->child[parent->last_child];
+  }
 
-  if (irep->ilen == 1) {
-    /* CALL ISEQ */
-    return;
+  mask = parent->child_capa * 2 - 1;
+  for (h = PROF_PTR_HASH(irep) & mask;
+       (idx = parent->child_hash[h]) != 0;
+       h = (h + 1) & mask) {
+    if (parent->child[idx - 1]->irep == irep) {
+      parent->last_child = idx - 1;
+      return parent->child[idx - 1];
+    }
   }
 
-  if (current_prof_irep) {
-    newirep = current_prof_irep;
+  return NULL;
+}
 
-    //Executing a new method
-    if (current_prof_irep->irep != irep) {
-      int i;
+//Insert a child index into the child table of parent
+static void
+prof_hash_child(struct prof_irep *parent, int idx)
+{
+  uint32_t mask = parent->child_capa * 2 - 1;
+  uint32_t h;
 
-      //Update info from calling instruction
-      //XXX - wouldn't it be simplier to store the last fetched
-      //instruction and assume that it was used to get to the new irep?
-      //Though, there would be the issue of 'return' statements...
-      for (i = 0; i < current_prof_irep->child_num; i++) {
-        if (current_prof_irep->child[i]->irep == irep) {
-          current_prof_irep->ccall_num[i]++;
-          newirep = current_prof_irep->child[i];
-          goto finish;
-        }
-      }
+  for (h = PROF_PTR_HASH(parent->child[idx]->irep) & mask;
+       parent->child_hash[h] != 0;
+       h = (h + 1) & mask);
+  parent->child_hash[h] = idx + 1;
+}
 
-      //XXX - check for circular dependency?
-      for (newirep = current_prof_irep->parent;
-          newirep && newirep->irep != irep;
-          newirep = newirep->parent);
-      if (newirep) {
-        goto finish;
-      }
+//Append a newly called method to the children of parent
+//
+//Arguments:
+// - mrb:    Mruby state
+// - pr:     Call tree of parent
+// - parent: Calling method
+// - irep:   Called method irep
+// - mid:    Called method name
+// - klass:  Class implementing called method
+struct prof_irep *
+mrb_profiler_add_child(mrb_state *mrb, struct prof_result *pr,
+                       struct prof_irep *parent, struct mrb_irep *irep,
+                       mrb_sym mid, struct prof_class *klass)
+{
+  struct prof_irep *newirep;
+  int off;
 
-      //Extend child irep list
-      if (current_prof_irep->child_capa <= current_prof_irep->child_num) {
-        struct prof_irep **tab;
-        int *ccall;
-        int size = current_prof_irep->child_capa * 2;
-
-        current_prof_irep->child_capa = size;
-        tab = (struct prof_irep**)
-          mrb_realloc(mrb, current_prof_irep->child,
-                      size * sizeof(struct prof_irep *));
-        current_prof_irep->child = tab;
-        ccall = (int*)
-          mrb_realloc(mrb, current_prof_irep->ccall_num, size * sizeof(int));
-        current_prof_irep->ccall_num = ccall;
-      }
+  //Extend child irep list, the table is kept at most half full. The old
+  //arrays stay in the arena, which bounds the waste to the final size.
+  if (parent->child_capa <= parent->child_num) {
+    struct prof_irep **tab;
+    int *ccall;
+    int size = parent->child_capa * 2;
+    int i;
+
+    tab = (struct prof_irep**)PROF_ALLOC(size * sizeof(struct prof_irep *));
+    memcpy(tab, parent->child,
+           parent->child_num * sizeof(struct prof_irep *));
+    parent->child = tab;
+    ccall = (int*)PROF_ALLOC(size * sizeof(int));
+    memcpy(ccall, parent->ccall_num, parent->child_num * sizeof(int));
+    parent->ccall_num = ccall;
+    parent->child_capa = size;
+
+    parent->child_hash = (int*)PROF_ALLOC(size * 2 * sizeof(int));
+    for (i = 0; i < parent->child_num; i++) {
+      prof_hash_child(parent, i);
+    }
+  }
+
+  newirep = mrb_profiler_alloc_prof_irep(mrb, pr, irep, parent, mid, klass);
+  off = parent->child_num;
+  parent->child[off] = newirep;
+  parent->ccall_num[off] = 1;
+  parent->child_num++;
+  newirep->child_idx = off;
+  prof_hash_child(parent, off);
+  parent->last_child = off;
+
+  return newirep;
+}
+
+//Get the node a recursive call of irep from parent folds into
+//
+//Each method keeps PROF_MAX_RECURSION nested nodes, calls beyond that go
+//back to the deepest one so deep recursion keeps a bounded tree. Folded
+//calls aren't edges of the tree, which stays acyclic.
+//
+//Arguments:
+// - parent: Calling method
+// - irep:   Called method irep
+//Returns:
+// - Running ancestor node, or NULL if the call gets a node of its own
+static struct prof_irep *
+prof_fold(struct prof_irep *parent, struct mrb_irep *irep)
+{
+  struct prof_irep *node;
 
-      newirep = mrb_profiler_alloc_prof_irep(mrb, irep, current_prof_irep);
-      off = current_prof_irep->child_num;
-      current_prof_irep->child[off] = newirep;
-      current_prof_irep->ccall_num[off] = 1;
-      current_prof_irep->child_num++;
+  for (node = parent; node; node = node->parent) {
+    if (node->irep == irep) {
+      return node->rec + 1 >= PROF_MAX_RECURSION ? node : NULL;
     }
   }
-  else {
-    //First VM instruction
-    newirep = mrb_profiler_alloc_prof_irep(mrb, irep, NULL);
-    current_prof_irep = result.irep_root = newirep;
-    old_pc = irep->iseq;
-    old_time = curtime;
+
+  return NULL;
+}
+
+//Find or create the node of a call of the method of frame from parent
+//
+//Arguments:
+// - mrb:    Mruby state
+// - ps:     Profiler state of mrb
+// - parent: Calling method
+// - frame:  Called method
+struct prof_irep *
+mrb_profiler_get_child(mrb_state *mrb, struct prof_state *ps,
+                       struct prof_irep *parent,
+                       const struct prof_frame *frame)
+{
+  struct prof_irep *child = prof_find_child(parent, frame->irep);
+
+  if (child) {
+    parent->ccall_num[child->child_idx]++;
+    return child;
+  }
+  child = prof_fold(parent, frame->irep);
+  if (child) {
+    return child;
   }
 
-finish:
-  //Update instruction level profilt info
-  off = old_pc - current_prof_irep->irep->iseq;
-  current_prof_irep->cnt[off].time += (curtime - old_time);
-  current_prof_irep->cnt[off].num++;
-  old_pc = pc;
-  current_prof_irep = newirep;
-  old_time = prof_curtime();
+  return mrb_profiler_add_child(mrb, &ps->result, parent, frame->irep,
+                                frame->mid, frame->klass);
 }
 
-//Get total number of profiled ireps
-static mrb_value
-mrb_mruby_profiler_irep_num(mrb_state *mrb, mrb_value self)
+static mrb_code prof_native_iseq[1] = { PROF_NATIVE_CODE };
+
+static uint32_t
+prof_native_hash(const void *ent)
 {
-  (void) mrb;
-  (void) self;
-  return mrb_fixnum_value(result.irep_num);
+  const struct prof_native *native = (const struct prof_native *)ent;
+
+  return PROF_PTR_HASH(native->klass) ^ native->mid;
 }
 
-//Get number of instructions in a given irep/method
-static mrb_value
-mrb_mruby_profiler_ilen(mrb_state *mrb, mrb_value self)
+static mrb_bool
+prof_native_match(const void *ent, const void *key)
 {
-  mrb_int irepno;
-  mrb_get_args(mrb, "i", &irepno);
-  (void) self;
+  const struct prof_native *native = (const struct prof_native *)ent;
+  const struct prof_native *want = (const struct prof_native *)key;
 
-  return mrb_fixnum_value(result.irep_tab[irepno]->irep->ilen);
+  return native->klass == want->klass && native->mid == want->mid;
 }
 
-//Get number of instructions in a given irep/method
-static mrb_value
-mrb_mruby_profiler_irep_id(mrb_state *mrb, void *v)
+//Ireps of C methods, keyed by class and method name
+static const struct prof_tab_type prof_native_tab = {
+  sizeof(struct prof_native), 64, prof_native_hash, prof_native_match
+};
+
+//Get the irep standing for a method implemented in C
+//
+//Each method gets an irep of its own, so its nodes are found, folded,
+//shared in flat mode, dumped and merged like those of Ruby methods. The
+//ireps are kept until the profiler is freed.
+//
+//Arguments:
+// - mrb:   Mruby state
+// - ps:    Profiler state of mrb
+// - klass: Class implementing the method
+// - mid:   Method name
+static mrb_irep *
+prof_native_irep(mrb_state *mrb, struct prof_state *ps, struct RClass *klass,
+                 mrb_sym mid)
 {
-  char addr[128];
-  snprintf(addr, sizeof(addr), "%p", v);
-  return mrb_str_new_cstr(mrb, addr);
+  struct prof_native key;
+  struct prof_native *ent;
+  mrb_irep *irep;
+  mrb_bool track;
+
+  if (klass && klass->tt == MRB_TT_ICLASS) {
+    klass = klass->c;
+  }
+
+  key.klass = klass;
+  key.mid = mid;
+  ent = (struct prof_native *)
+      mrb_profiler_tab_get(mrb, &ps->natives, &prof_native_tab, &key,
+                           prof_native_hash(&key));
+  if (ent->irep) {
+    return ent->irep;
+  }
+
+  //The class keys the entry, so it is rooted before its address could be
+  //reused by another class
+  prof_class_get(mrb, ps, klass);
+
+  //The irep is the profiler's, its bytes aren't charged to the instruction
+  track = ps->track_alloc;
+  ps->track_alloc = FALSE;
+  irep = mrb_add_irep(mrb);
+  ps->track_alloc = track;
+  irep->flags |= MRB_ISEQ_NO_FREE;
+  irep->iseq = prof_native_iseq;
+  irep->ilen = 1;
+  ent->irep = irep;
+  ent->klass = klass;
+  ent->mid = mid;
+  ps->natives.num++;
+
+  return irep;
 }
 
-//Read source file
+//Get the child of parent for a call of a method implemented in C
 //
 //Arguments:
-// - file name
-//Returns:
-// - Array of files's contents split by newline
-static mrb_value
-mrb_mruby_profiler_read(mrb_state *mrb, mrb_value self)
+// - mrb:    Mruby state
+// - ps:     Profiler state of mrb
+// - parent: Calling method
+// - klass:  Class implementing the called method
+// - mid:    Called method name
+static struct prof_irep *
+prof_native_child(mrb_state *mrb, struct prof_state *ps,
+                  struct prof_irep *parent, struct RClass *klass, mrb_sym mid)
 {
-  char *fn;
-  int len;
-  mrb_value res;
-  FILE *fp;
-  char buf[256];
-  (void) self;
+  struct prof_frame frame;
 
-  mrb_get_args(mrb, "s", &fn, &len);
-  fn[len] = '\0';
+  frame.irep  = prof_native_irep(mrb, ps, klass, mid);
+  frame.mid   = mid;
+  frame.klass = prof_class_get(mrb, ps, klass);
 
-  res = mrb_ary_new_capa(mrb, 5);
-  fp = fopen(fn, "r");
-  while (fgets(buf, 255, fp)) {
-    int ai = mrb_gc_arena_save(mrb);
-    mrb_value ele = mrb_str_new_cstr(mrb, buf);
+  return mrb_profiler_get_child(mrb, ps, parent, &frame);
+}
 
-    mrb_ary_push(mrb, res, ele);
-    mrb_gc_arena_restore(mrb, ai);
-  }
-  fclose(fp);
-  return res;
+//Whether the filters let a call of a C method be profiled
+static mrb_bool
+prof_native_on(mrb_state *mrb, struct prof_state *ps, struct RClass *klass,
+               mrb_sym mid)
+{
+  return ps->filter.num == 0 ||
+    mrb_profiler_filter_pass(mrb, ps, prof_native_irep(mrb, ps, klass, mid),
+                             klass, mid);
 }
 
-//Produce String representation of provided irep code
-//Arguments
-//  - mrb:  mruby state
-//  - irep: VM instruction's irep
-//  - c:    VM instruction
-static mrb_value
-mrb_mruby_profiler_disasm_once(mrb_state *mrb, mrb_irep *irep, mrb_code c)
+//Capture the Ruby level call chain of the running fiber
+//
+//Methods implemented in C, the trampoline ireps used by Proc#call and code
+//the filters leave out are skipped. If the chain is deeper than capa, the
+//outermost frames are kept and the innermost frame replaces the last of
+//them.
+//
+//Arguments:
+// - mrb:    Mruby state
+// - ps:     Profiler state of mrb
+// - frames: Destination, outermost frame first
+// - capa:   Number of elements of frames
+// - pc:     Instruction running, replaced by the call instruction of the
+//           innermost frame kept when the code above it was left out
+//Returns:
+// - Number of frames stored
+int
+mrb_profiler_callchain(mrb_state *mrb, struct prof_state *ps,
+                       struct prof_frame *frames, int capa, mrb_code **pc)
 {
-  int    i = 0;
-  char   buf[256] = {0};
-  size_t len = sizeof(buf);
+  mrb_callinfo *ci;
+  mrb_callinfo *last = NULL;
+  int n = 0;
 
-  switch (GET_OPCODE(c)) {
-  case OP_NOP:
-    snprintf(buf, len, "OP_NOP\n");
-    break;
-  case OP_MOVE:
-    snprintf(buf, len, "OP_MOVE\tR%d\tR%d", GETARG_A(c), GETARG_B(c));
-    break;
-  case OP_LOADL:
-    {
-      mrb_value v = irep->pool[GETARG_Bx(c)];
-      mrb_value s = mrb_inspect(mrb, v);
-      snprintf(buf, len, "OP_LOADL\tR%d\tL(%d)\t; %s",
-          GETARG_A(c), GETARG_Bx(c), RSTRING_PTR(s));
+  for (ci = mrb->c->cibase; ci <= mrb->c->ci; ci++) {
+    struct RProc *proc = ci->proc;
+
+    if (!proc || MRB_PROC_CFUNC_P(proc) || proc->body.irep->ilen == 1) {
+      continue;
     }
-    break;
-  case OP_LOADI:
+    if (ps->filter.num > 0 &&
+        !mrb_profiler_filter_pass(mrb, ps, proc->body.irep, ci->target_class,
+                                  ci->mid)) {
+      continue;
+    }
+    if (n == capa) {
+      n--;
+    }
+    frames[n].irep  = proc->body.irep;
+    frames[n].mid   = ci->mid;
+    frames[n].klass = prof_class_get(mrb, ps, ci->target_class);
+    n++;
+    last = ci;
+  }
+  if (last && last != mrb->c->ci) {
+    *pc = last[1].pc - 1;
+  }
+
+  return n;
+}
+
+//Get profiler metadata for a call chain, creating missing nodes
+//
+//A chain that doesn't start with the root irep is attached below the root,
+//like a method fetched after the first profiled irep in exact mode.
+//
+//Arguments:
+// - mrb:     Mruby state
+// - ps:      Profiler state of mrb
+// - frames:  Call chain, outermost frame first
+// - nframes: Number of frames (at least one)
+struct prof_irep *
+mrb_profiler_callchain_node(mrb_state *mrb, struct prof_state *ps,
+                            const struct prof_frame *frames, int nframes)
+{
+  struct prof_irep *node;
+  int i = 0;
+
+  if (!ps->result.irep_root) {
+    ps->result.irep_root =
+      mrb_profiler_alloc_prof_irep(mrb, &ps->result, frames[0].irep, NULL,
+                                   frames[0].mid, frames[0].klass);
+  }
+  node = ps->result.irep_root;
+  if (node->irep == frames[0].irep) {
+    i = 1;
+  }
+  for (; i < nframes; i++) {
+    node = mrb_profiler_get_child(mrb, ps, node, &frames[i]);
+  }
+
+  return node;
+}
+
+//Make room for capa callers on the shadow stack
+static void
+prof_stack_reserve(mrb_state *mrb, struct prof_state *ps, int capa)
+{
+  if (ps->stack_capa < capa) {
+    int size = ps->stack_capa ? ps->stack_capa : 64;
+    struct prof_call *stack;
+
+    while (size < capa) {
+      size *= 2;
+    }
+    stack = (struct prof_call *)
+      realloc(ps->stack, size * sizeof(struct prof_call));
+    if (!stack) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+    }
+    ps->stack = stack;
+    ps->stack_capa = size;
+  }
+}
+
+//Enter a method called by the current one at time now
+//
+//Arguments:
+// - mrb:    Mruby state
+// - ps:     Profiler state of mrb
+// - callee: Called method
+// - depth:  VM call depth of the callee
+// - now:    Current time
+static inline void
+prof_stack_push(mrb_state *mrb, struct prof_state *ps,
+                struct prof_irep *callee, int depth, uint64_t now)
+{
+  struct prof_call *call;
+
+  if (ps->stack_depth == ps->stack_capa) {
+    prof_stack_reserve(mrb, ps, ps->stack_depth + 1);
+  }
+  call = &ps->stack[ps->stack_depth++];
+  call->node = ps->current;
+  call->enter = ps->enter;
+  call->ci_depth = ps->ci_depth;
+  ps->enter = now;
+  ps->ci_depth = depth;
+  callee->calls++;
+  callee->active++;
+  if (ps->hist_on && !callee->hist) {
+    mrb_profiler_call_hist(mrb, &ps->result, callee);
+  }
+}
+
+//Account an activation of node ending at now
+//
+//Folded recursion puts a node on the stack several times, only the
+//outermost activation is timed so callees aren't counted twice.
+static inline void
+prof_leave(struct prof_irep *node, uint64_t enter, uint64_t now)
+{
+  uint64_t ticks = now - enter;
+
+  if (--node->active > 0) {
+    return;
+  }
+  node->incl += ticks;
+  if (node->max < ticks) {
+    node->max = ticks;
+  }
+}
+
+//Record the duration of an activation returned from in the histogram of
+//its node
+//
+//Like the longest activation, only the outermost activation of a
+//recursive node is recorded. Activations cut by a stop or a resync aren't.
+static inline void
+prof_record_call(struct prof_state *ps, struct prof_irep *node,
+                 uint64_t enter, uint64_t now)
+{
+  if (ps->hist_on && node->hist && node->active == 0) {
+    prof_hist_record(node->hist, now - enter);
+  }
+}
+
+//Return from the current method and the callers above stack index depth,
+//resuming the caller at depth
+static inline struct prof_irep *
+prof_stack_pop(struct prof_state *ps, int depth, uint64_t now)
+{
+  int i;
+
+  prof_leave(ps->current, ps->enter, now);
+  prof_record_call(ps, ps->current, ps->enter, now);
+  for (i = ps->stack_depth - 1; i > depth; i--) {
+    prof_leave(ps->stack[i].node, ps->stack[i].enter, now);
+    prof_record_call(ps, ps->stack[i].node, ps->stack[i].enter, now);
+  }
+  ps->stack_depth = depth;
+  ps->enter = ps->stack[depth].enter;
+  ps->ci_depth = ps->stack[depth].ci_depth;
+  ps->current = ps->stack[depth].node;
+
+  return ps->current;
+}
+
+//End every open activation at now, as if all methods returned
+static void
+prof_stack_close(struct prof_state *ps, uint64_t now)
+{
+  int i;
+
+  if (!ps->current) {
+    return;
+  }
+  prof_leave(ps->current, ps->enter, now);
+  for (i = 0; i < ps->stack_depth; i++) {
+    prof_leave(ps->stack[i].node, ps->stack[i].enter, now);
+  }
+  ps->current = NULL;
+  ps->stack_depth = 0;
+}
+
+//Rebuild the shadow stack from the VM call stack
+//
+//Used on the first instruction, after switching to exact mode and when
+//the VM moved in a way the shadow stack can't follow. Methods already
+//running are only timed from now on.
+//
+//Arguments:
+// - mrb: Mruby state
+// - ps:  Profiler state of mrb
+// - now: Current time
+static void
+prof_resync(mrb_state *mrb, struct prof_state *ps, uint64_t now)
+{
+  struct prof_result *pr = &ps->result;
+  struct prof_irep *node = NULL;
+  mrb_callinfo *ci;
+  int depth = -1;
+
+  prof_stack_close(ps, now);
+  for (ci = mrb->c->cibase; ci <= mrb->c->ci; ci++) {
+    struct RProc *proc = ci->proc;
+    struct prof_frame frame;
+    struct prof_irep *child;
+    struct prof_call *call;
+
+    if (!proc) {
+      continue;
+    }
+    if (MRB_PROC_CFUNC_P(proc)) {
+      //C methods between Ruby frames, like Array#each running a block
+      if (!node || !prof_native_on(mrb, ps, ci->target_class, ci->mid)) {
+        continue;
+      }
+      frame.irep = prof_native_irep(mrb, ps, ci->target_class, ci->mid);
+    }
+    else if (proc->body.irep->ilen == 1 ||
+             (ps->filter.num > 0 &&
+              !mrb_profiler_filter_pass(mrb, ps, proc->body.irep,
+                                        ci->target_class, ci->mid))) {
+      continue;
+    }
+    else {
+      frame.irep = proc->body.irep;
+    }
+    frame.mid   = ci->mid;
+    frame.klass = prof_class_get(mrb, ps, ci->target_class);
+
+    if (!node) {
+      if (!pr->irep_root) {
+        pr->irep_root =
+          mrb_profiler_alloc_prof_irep(mrb, pr, frame.irep, NULL, frame.mid,
+                                       frame.klass);
+      }
+      node = pr->irep_root;
+      //Otherwise the root stays below the outermost frame, at depth -1
+      if (node->irep == frame.irep) {
+        depth = ci - mrb->c->cibase;
+        continue;
+      }
+    }
+
+    child = prof_find_child(node, frame.irep);
+    if (!child) {
+      child = mrb_profiler_get_child(mrb, ps, node, &frame);
+    }
+    prof_stack_reserve(mrb, ps, ps->stack_depth + 1);
+    call = &ps->stack[ps->stack_depth++];
+    call->node = node;
+    call->enter = now;
+    call->ci_depth = depth;
+    node->active++;
+    node = child;
+    depth = ci - mrb->c->cibase;
+  }
+
+  node->active++;
+  ps->current = node;
+  ps->enter = now;
+  ps->ci_depth = depth;
+  if (pr->irep_root->calls == 0) {
+    pr->irep_root->calls = 1;
+  }
+}
+
+//Follow the VM from the current activation to the one running irep at
+//VM call depth depth
+//
+//Arguments:
+// - mrb:   Mruby state
+// - ps:    Profiler state of mrb
+// - irep:  Irep of the fetched instruction
+// - depth: VM call depth of the fetched instruction
+// - now:   Current time
+//Returns:
+// - New current method, NULL if the shadow stack lost track of the VM
+static struct prof_irep *
+prof_transfer(mrb_state *mrb, struct prof_state *ps, struct mrb_irep *irep,
+              int depth, uint64_t now)
+{
+  struct prof_irep *caller;
+  struct prof_irep *callee;
+  int i;
+
+  if (depth < ps->ci_depth) {
+    //Returning, through several frames at once when an exception or a
+    //break from a block unwinds the VM stack
+    for (i = ps->stack_depth - 1; i >= 0 && ps->stack[i].ci_depth > depth; i--);
+    if (i < 0 || ps->stack[i].ci_depth != depth ||
+        ps->stack[i].node->irep != irep) {
+      return NULL;
+    }
+    return prof_stack_pop(ps, i, now);
+  }
+
+  if (depth == ps->ci_depth) {
+    //The current activation ended and a new one took its frame, like
+    //successive blocks called by a method implemented in C
+    if (ps->stack_depth == 0) {
+      return NULL;
+    }
+    prof_stack_pop(ps, ps->stack_depth - 1, now);
+  }
+
+  //C methods the call went through, like Array#each calling a block, are
+  //entered as they started during the last instruction
+  for (i = ps->ci_depth + 1; i < depth; i++) {
+    mrb_callinfo *ci = mrb->c->cibase + i;
+
+    if (ci->proc && MRB_PROC_CFUNC_P(ci->proc) &&
+        prof_native_on(mrb, ps, ci->target_class, ci->mid)) {
+      callee = prof_native_child(mrb, ps, ps->current, ci->target_class,
+                                 ci->mid);
+      prof_stack_push(mrb, ps, callee, i, ps->old_time);
+      ps->current = callee;
+    }
+  }
+
+  //Calling a method
+  caller = ps->current;
+  callee = prof_find_child(caller, irep);
+  if (callee) {
+    caller->ccall_num[callee->child_idx]++;
+  }
+  else {
+    struct prof_frame frame;
+
+    frame.irep  = irep;
+    frame.mid   = mrb->c->ci->mid;
+    frame.klass = prof_class_get(mrb, ps, mrb->c->ci->target_class);
+    callee = mrb_profiler_get_child(mrb, ps, caller, &frame);
+  }
+  prof_stack_push(mrb, ps, callee, depth, now);
+
+  return callee;
+}
+
+//Charge the objects the instruction at off of node allocated
+//
+//Objects come from the GC heap pages rather than the allocator, so they
+//are counted from the growth of the live object count. A GC sweep during
+//the instruction hides the objects it allocated.
+static inline void
+prof_count_objects(mrb_state *mrb, struct prof_state *ps,
+                   struct prof_irep *node, int off)
+{
+  size_t live = mrb->gc.live;
+
+  if (live > ps->old_live) {
+    node->alloc[off].objs += live - ps->old_live;
+  }
+  ps->old_live = live;
+}
+
+//Charge the performance counter increments since the instruction at off
+//of node began to it
+static inline void
+prof_count_events(struct prof_state *ps, struct prof_irep *node, int off)
+{
+  struct prof_pmu *pmu = &ps->pmu;
+  uint64_t val[PROF_EVENT_MAX];
+  uint64_t *ev = node->events + off * pmu->num;
+  int i;
+
+  mrb_profiler_pmu_read(pmu, val);
+  for (i = 0; i < pmu->num; i++) {
+    ev[i] += val[i] - pmu->old[i];
+    pmu->old[i] = val[i];
+  }
+}
+
+//Create the optional counters the current settings fill for node
+static void
+prof_node_counters(mrb_state *mrb, struct prof_state *ps,
+                   struct prof_irep *node)
+{
+  if (ps->track_alloc) {
+    mrb_profiler_alloc_counters(mrb, &ps->result, node);
+  }
+  if (ps->pmu.num) {
+    mrb_profiler_event_counters(mrb, &ps->result, node);
+  }
+}
+
+//Remember the GC progress before an instruction runs
+static inline void
+prof_gc_mark(mrb_state *mrb, struct prof_state *ps)
+{
+  ps->gc_threshold = mrb->gc.threshold;
+  ps->gc_state = mrb->gc.state;
+}
+
+//Whether the GC ran a step since prof_gc_mark
+//
+//Every incremental step and full collection recomputes the threshold, and
+//a step that leaves it unchanged still moves the GC state.
+static inline mrb_bool
+prof_gc_ran(mrb_state *mrb, struct prof_state *ps)
+{
+  return mrb->gc.threshold != ps->gc_threshold ||
+    (int)mrb->gc.state != ps->gc_state;
+}
+
+//Take the GC step run by the instruction at off of node out of its time
+//
+//The GC has no hook, so the instruction is assumed to take its mean time
+//over the previous executions and the rest of the interval is the GC's.
+//All of it is on the first execution.
+//
+//Arguments:
+// - mrb:   Mruby state
+// - ps:    Profiler state of mrb
+// - node:  Method of the instruction
+// - off:   Offset of the instruction
+// - ticks: Time between the fetch of the instruction and the next one
+//Returns:
+// - Time of the instruction itself
+static uint64_t
+prof_split_gc(mrb_state *mrb, struct prof_state *ps, struct prof_irep *node,
+              int off, uint64_t ticks)
+{
+  uint64_t own = node->num[off] > 0 ? node->time[off] / node->num[off] : 0;
+  uint64_t *gc = mrb_profiler_gc_counters(mrb, &ps->result, node);
+
+  if (own > ticks) {
+    own = ticks;
+  }
+  gc[off] += ticks - own;
+  prof_gc_mark(mrb, ps);
+
+  return own;
+}
+
+static uint32_t
+prof_fiber_hash(const void *ent)
+{
+  return PROF_PTR_HASH(((const struct prof_fiber *)ent)->c);
+}
+
+static mrb_bool
+prof_fiber_match(const void *ent, const void *key)
+{
+  return ((const struct prof_fiber *)ent)->c == key;
+}
+
+//Shadow stacks of fibers, keyed by context
+static const struct prof_tab_type prof_fiber_tab = {
+  sizeof(struct prof_fiber), 16, prof_fiber_hash, prof_fiber_match
+};
+
+//Get the slot of the shadow stack of a fiber, an empty one for c if none
+static struct prof_fiber *
+prof_fiber_slot(mrb_state *mrb, struct prof_state *ps, struct mrb_context *c)
+{
+  struct prof_fiber *slot;
+
+  slot = (struct prof_fiber *)mrb_profiler_tab_get(mrb, &ps->fibers,
+                                                   &prof_fiber_tab, c,
+                                                   PROF_PTR_HASH(c));
+  if (!slot->c) {
+    slot->c = c;
+    ps->fibers.num++;
+  }
+
+  return slot;
+}
+
+//Swap the shadow stack for the one of the fiber now running
+//
+//The time from the last instruction of the fiber switched away from to
+//the first one of the fiber resumed is the switch's, the instruction that
+//switched is completed when its fiber runs again. Methods of a suspended
+//fiber aren't timed, their activations are closed and reopened.
+//
+//Slots of fibers that ended stay until their context is reused, a stack
+//restored that way doesn't match the VM and gets resynchronized.
+//
+//Arguments:
+// - mrb: Mruby state, mrb->c being the fiber resumed
+// - ps:  Profiler state of mrb
+// - now: Current time
+static void
+prof_fiber_switch(mrb_state *mrb, struct prof_state *ps, uint64_t now)
+{
+  struct prof_fiber *f;
+  struct prof_call *stack;
+  int capa;
+  int i;
+
+  if (ps->current) {
+    uint64_t ticks = now - ps->old_time;
+
+    if (ticks > ps->overhead) {
+      ps->result.switch_ticks += ticks - ps->overhead;
+      ps->result.overhead += ps->overhead;
+    }
+    else {
+      ps->result.overhead += ticks;
+    }
+    ps->result.switch_num++;
+
+    prof_leave(ps->current, ps->enter, now);
+    for (i = 0; i < ps->stack_depth; i++) {
+      prof_leave(ps->stack[i].node, ps->stack[i].enter, now);
+    }
+
+    //The slot's spare buffer becomes the one of the running fiber
+    f = prof_fiber_slot(mrb, ps, ps->ctx);
+    stack = f->stack;
+    capa = f->stack_capa;
+    f->current = ps->current;
+    f->ci_depth = ps->ci_depth;
+    f->stack = ps->stack;
+    f->stack_depth = ps->stack_depth;
+    f->stack_capa = ps->stack_capa;
+    f->old_pc = ps->old_pc;
+    ps->stack = stack;
+    ps->stack_capa = capa;
+  }
+  ps->current = NULL;
+  ps->stack_depth = 0;
+  ps->ctx = mrb->c;
+
+  f = prof_fiber_slot(mrb, ps, mrb->c);
+  if (!f->current) {
+    //First instructions of the fiber, the hook resyncs
+    return;
+  }
+  stack = ps->stack;
+  capa = ps->stack_capa;
+  ps->current = f->current;
+  ps->enter = now;
+  ps->ci_depth = f->ci_depth;
+  ps->stack = f->stack;
+  ps->stack_depth = f->stack_depth;
+  ps->stack_capa = f->stack_capa;
+  ps->old_pc = f->old_pc;
+  ps->old_time = now;
+  ps->overhead = ps->result.call_ticks;
+  f->current = NULL;
+  f->stack = stack;
+  f->stack_capa = capa;
+  f->stack_depth = 0;
+
+  ps->current->active++;
+  for (i = 0; i < ps->stack_depth; i++) {
+    ps->stack[i].node->active++;
+    ps->stack[i].enter = now;
+  }
+  //Nor is the switch charged to the counters of the instruction
+  prof_gc_mark(mrb, ps);
+  ps->old_live = mrb->gc.live;
+  if (ps->pmu.num) {
+    mrb_profiler_pmu_read(&ps->pmu, ps->pmu.old);
+  }
+  prof_node_counters(mrb, ps, ps->current);
+}
+
+//Forget the shadow stacks of the fibers switched away from
+//
+//Their activations were closed when they were saved.
+static void
+prof_fiber_drop(struct prof_state *ps)
+{
+  struct prof_fiber *tab = (struct prof_fiber *)ps->fibers.ent;
+  uint32_t i;
+
+  for (i = 0; i < ps->fibers.capa; i++) {
+    tab[i].current = NULL;
+    tab[i].stack_depth = 0;
+  }
+}
+
+//Get the node of the C method called without entering Ruby code by the
+//instruction at old_pc of cur, NULL if it wasn't a call of one
+//
+//The VM leaves the call info of the method returned from above the
+//current one, which tells whether it was implemented in C.
+static struct prof_irep *
+prof_native_callee(mrb_state *mrb, struct prof_state *ps,
+                   struct prof_irep *cur, mrb_code *old_pc)
+{
+  mrb_callinfo *ci = mrb->c->ci + 1;
+
+  if (ci >= mrb->c->ciend || !ci->proc || !MRB_PROC_CFUNC_P(ci->proc) ||
+      ci->mid != cur->irep->syms[GETARG_B(*old_pc)] ||
+      !prof_native_on(mrb, ps, ci->target_class, ci->mid)) {
+    return NULL;
+  }
+
+  return prof_native_child(mrb, ps, cur, ci->target_class, ci->mid);
+}
+
+//Charge a call of a C method that ran no Ruby code for ticks to its node
+static inline void
+prof_native_call(mrb_state *mrb, struct prof_state *ps,
+                 struct prof_irep *native, uint64_t ticks)
+{
+  native->time[0] += ticks;
+  native->num[0]++;
+  native->calls++;
+  //Running on the stack already, the outer activation covers the call
+  if (native->active == 0) {
+    native->incl += ticks;
+    if (native->max < ticks) {
+      native->max = ticks;
+    }
+    if (ps->hist_on) {
+      prof_hist_record(mrb_profiler_call_hist(mrb, &ps->result, native),
+                       ticks);
+    }
+  }
+}
+
+//Whether the filters let the current activation running irep be profiled
+//
+//The decision of the last irep is kept apart, so staying in a method
+//costs a compare.
+static inline mrb_bool
+prof_filter_on(mrb_state *mrb, struct prof_state *ps, struct mrb_irep *irep)
+{
+  struct prof_filter *pf = &ps->filter;
+
+  if (irep != pf->last) {
+    pf->last_on = mrb_profiler_filter_pass(mrb, ps, irep,
+                                           mrb->c->ci->target_class,
+                                           mrb->c->ci->mid);
+    pf->last = irep;
+  }
+  return pf->last_on;
+}
+
+//Find the nearest profiled caller of an activation the filters leave out
+//
+//Arguments:
+// - mrb:   Mruby state
+// - ps:    Profiler state of mrb
+// - irep:  Set to the irep of the caller
+// - pc:    Set to its instruction calling the code left out
+// - depth: Set to its VM call depth
+//Returns:
+// - Whether a Ruby activation below the current one is profiled
+static mrb_bool
+prof_filter_caller(mrb_state *mrb, struct prof_state *ps,
+                   struct mrb_irep **irep, mrb_code **pc, int *depth)
+{
+  mrb_callinfo *ci;
+
+  for (ci = mrb->c->ci - 1; ci >= mrb->c->cibase; ci--) {
+    struct RProc *proc = ci->proc;
+
+    if (!proc || MRB_PROC_CFUNC_P(proc) || proc->body.irep->ilen == 1 ||
+        !mrb_profiler_filter_pass(mrb, ps, proc->body.irep,
+                                  ci->target_class, ci->mid)) {
+      continue;
+    }
+    *irep = proc->body.irep;
+    *pc = ci[1].pc - 1;
+    *depth = ci - mrb->c->cibase;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+//Whether the instruction at from jumps to to
+//
+//retry and redo jump back to the first instruction of their activation,
+//which must not be mistaken for a new call.
+static inline mrb_bool
+prof_jump_p(const mrb_code *from, const mrb_code *to)
+{
+  switch (GET_OPCODE(*from)) {
+  case OP_JMP:
+  case OP_JMPIF:
+  case OP_JMPNOT:
+    return from + GETARG_sBx(*from) == to;
+  default:
+    return FALSE;
+  }
+}
+
+//VM Execution Hook
+//
+//Calls and returns are told apart by the depth of the VM call stack, so
+//recursion and unwinding are followed exactly. An activation restarting at
+//the first instruction of its irep at the same depth is a new call, unless
+//the instruction before it in that activation jumped there.
+//
+//Arguments:
+// - mrb: mruby state
+// - irep: current instruction context
+// - pc:   current VM instruction
+// - regs: current VM registers (unused)
+void
+prof_code_fetch_hook(struct mrb_state *mrb,
+                     struct mrb_irep *irep,
+                     mrb_code *pc,
+                     mrb_value *regs)
+{
+  struct prof_state *ps;
+  struct prof_irep *cur;
+  uint64_t curtime;
+  uint64_t ticks;
+  uint64_t ovh;
+  struct prof_irep *newirep;
+  struct prof_irep *native = NULL;
+  mrb_bool moved = FALSE;
+  mrb_bool folded = FALSE;
+  int depth;
+  int off;
+  (void) regs;
+
+  curtime = prof_curtime();
+
+  if (irep->ilen == 1) {
+    /* CALL ISEQ */
+    return;
+  }
+
+  ps = mrb_profiler_state(mrb);
+  if (ps->cont.request) {
+    //A delta of continuous profiling is due. Building it isn't charged to
+    //anything, the counters start over when it is taken.
+    mrb_profiler_cont_flush(mrb, ps);
+    prof_gc_mark(mrb, ps);
+    curtime = prof_curtime();
+  }
+  if (mrb->c != ps->ctx) {
+    //A fiber was resumed or yielded
+    prof_fiber_switch(mrb, ps, curtime);
+  }
+  depth = mrb->c->ci - mrb->c->cibase;
+  if (ps->filter.num > 0) {
+    if (!prof_filter_on(mrb, ps, irep)) {
+      //Code left out is charged as a whole to the call instruction of the
+      //nearest profiled caller, at its first instruction. A frame reused
+      //by a later call starts over at the first instruction.
+      if (mrb->c->ci == ps->filter.ci &&
+          mrb->c->ci->proc == ps->filter.proc &&
+          (pc != irep->iseq || prof_jump_p(ps->filter.pc, pc))) {
+        ps->filter.pc = pc;
+        return;
+      }
+      ps->filter.ci = mrb->c->ci;
+      ps->filter.proc = mrb->c->ci->proc;
+      ps->filter.pc = pc;
+      if (!prof_filter_caller(mrb, ps, &irep, &pc, &depth)) {
+        return;
+      }
+      folded = TRUE;
+    }
+    else {
+      ps->filter.ci = NULL;
+    }
+  }
+  cur = ps->current;
+  if (!cur) {
+    //First VM instruction, first one after switching to exact mode or of
+    //a new fiber
+    prof_resync(mrb, ps, curtime);
+    ps->old_pc = pc;
+    ps->old_time = curtime;
+    ps->overhead = ps->result.call_ticks;
+    ps->filter.folded = FALSE;
+    prof_gc_mark(mrb, ps);
+    prof_node_counters(mrb, ps, ps->current);
+    ps->old_live = mrb->gc.live;
+    if (ps->pmu.num) {
+      mrb_profiler_pmu_read(&ps->pmu, ps->pmu.old);
+    }
+    return;
+  }
+
+  newirep = cur;
+  ovh = ps->result.hook_ticks;
+  if (depth != ps->ci_depth || cur->irep != irep ||
+      (pc == irep->iseq && !folded && !prof_jump_p(ps->old_pc, pc))) {
+    newirep = prof_transfer(mrb, ps, irep, depth, curtime);
+    ovh = ps->result.call_ticks;
+    moved = TRUE;
+  }
+
+  //Update instruction level profilt info, without the calibrated time of
+  //the profiler itself. GC steps triggered by the instruction are
+  //accounted apart.
+  off = ps->old_pc - cur->irep->iseq;
+  ticks = curtime - ps->old_time;
+  if (ticks > ps->overhead) {
+    ticks -= ps->overhead;
+    ps->result.overhead += ps->overhead;
+  }
+  else {
+    ps->result.overhead += ticks;
+    ticks = 0;
+  }
+  ps->overhead = ovh;
+  //Durations of selected instructions, with the GC steps and the C method
+  //they ran. A call running code left out is charged in several parts.
+  if (ps->hist_insn && ps->hist_op[GET_OPCODE(*ps->old_pc)] &&
+      !folded && !ps->filter.folded) {
+    prof_hist_record(mrb_profiler_insn_hist(mrb, &ps->result, cur, off),
+                     ticks);
+  }
+  //A send that stayed in the method called C, which gets the time, unless
+  //it called code left out
+  if (!moved && !folded && !ps->filter.folded &&
+      (GET_OPCODE(*ps->old_pc) == OP_SEND ||
+       GET_OPCODE(*ps->old_pc) == OP_SENDB)) {
+    native = prof_native_callee(mrb, ps, cur, ps->old_pc);
+  }
+  if (prof_gc_ran(mrb, ps)) {
+    ticks = native ? prof_split_gc(mrb, ps, native, 0, ticks)
+                   : prof_split_gc(mrb, ps, cur, off, ticks);
+  }
+  if (native) {
+    prof_native_call(mrb, ps, native, ticks);
+    ticks = 0;
+  }
+  cur->time[off] += ticks;
+  //A call running code left out is counted once, however many
+  //instructions its time is charged in
+  if (!ps->filter.folded) {
+    cur->num[off]++;
+  }
+  if (ps->opstat_on) {
+    struct prof_opstat *os = ps->opstat;
+    int op = GET_OPCODE(*ps->old_pc);
+
+    if (!ps->filter.folded) {
+      os->num[op]++;
+      os->pair[op][GET_OPCODE(*pc)]++;
+    }
+    os->time[op] += ticks;
+  }
+  ps->filter.folded = folded;
+  if (ps->track_alloc) {
+    prof_count_objects(mrb, ps, cur, off);
+  }
+  if (ps->pmu.num) {
+    prof_count_events(ps, cur, off);
+  }
+  ps->old_pc = pc;
+  //Profiler bookkeeping is charged to the next instruction rather than
+  //paying for a second clock read
+  ps->old_time = curtime;
+  if (newirep) {
+    ps->current = newirep;
+  }
+  else {
+    prof_resync(mrb, ps, curtime);
+  }
+  if (ps->current != cur && (ps->track_alloc || ps->pmu.num)) {
+    prof_node_counters(mrb, ps, ps->current);
+  }
+}
+
+#define PROF_CALIB_ILEN   64
+#define PROF_CALIB_ROUNDS 50
+
+//Measure what the exact mode hook costs between two clock reads
+//
+//The hook runs over fake methods of NOP instructions, first fetching
+//instructions of one method, then alternately entering two methods. The
+//fastest round is kept, as the others were disturbed by interrupts or
+//cold caches. Tracking of allocations, opcodes and performance counters
+//adds to the cost and isn't measured.
+//
+//Arguments:
+// - mrb: mruby state, not running Ruby code yet
+// - ps:  profiler state of mrb, with an empty call tree
+static void
+prof_calibrate(mrb_state *mrb, struct prof_state *ps)
+{
+  static mrb_code iseq[PROF_CALIB_ILEN];
+  struct prof_result *pr = &ps->result;
+  mrb_irep calls[3];
+  mrb_value classes;
+  uint64_t hook = UINT64_MAX;
+  uint64_t call = UINT64_MAX;
+  uint64_t start;
+  uint64_t ticks;
+  int depth = mrb->c->ci - mrb->c->cibase;
+  int round;
+  int i;
+
+  ps->ctx = mrb->c;
+  memset(calls, 0, sizeof(calls));
+  for (i = 0; i < 3; i++) {
+    calls[i].iseq = iseq;
+    calls[i].ilen = PROF_CALIB_ILEN;
+    calls[i].refcnt = 1;
+  }
+
+  //calls[0] is the root calling calls[1], which is running
+  pr->irep_root =
+    mrb_profiler_alloc_prof_irep(mrb, pr, &calls[0], NULL, 0, NULL);
+  ps->current = mrb_profiler_add_child(mrb, pr, pr->irep_root, &calls[1],
+                                       0, NULL);
+  prof_stack_reserve(mrb, ps, 1);
+  ps->stack[0].node = pr->irep_root;
+  ps->stack[0].enter = prof_curtime();
+  ps->stack[0].ci_depth = depth - 1;
+  ps->stack_depth = 1;
+  ps->ci_depth = depth;
+  ps->enter = ps->old_time = prof_curtime();
+  ps->old_pc = iseq;
+  prof_gc_mark(mrb, ps);
+
+  for (round = 0; round < PROF_CALIB_ROUNDS; round++) {
+    start = prof_curtime();
+    for (i = 1; i < PROF_CALIB_ILEN; i++) {
+      prof_code_fetch_hook(mrb, ps->current->irep, &iseq[i], NULL);
+    }
+    ticks = (prof_curtime() - start) / (PROF_CALIB_ILEN - 1);
+    if (hook > ticks) {
+      hook = ticks;
+    }
+
+    //Each first instruction at the same depth ends the running method and
+    //calls the other one
+    start = prof_curtime();
+    for (i = 0; i < PROF_CALIB_ILEN; i++) {
+      prof_code_fetch_hook(mrb, &calls[1 + (i + 1) % 2], iseq, NULL);
+    }
+    ticks = (prof_curtime() - start) / PROF_CALIB_ILEN;
+    if (call > ticks) {
+      call = ticks;
+    }
+  }
+
+  //The class records live in the arena freed with the fake methods, and
+  //the classes they rooted are let go so their slots serve again
+  mrb_profiler_result_free(mrb, pr);
+  mrb_profiler_tab_free(&ps->classes);
+  classes = mrb_iv_get(mrb, ps->module, PROF_CLASSES_SYM);
+  if (mrb_array_p(classes)) {
+    for (i = 0; i < (int)ps->class_rooted && i < RARRAY_LEN(classes); i++) {
+      mrb_ary_set(mrb, classes, i, mrb_nil_value());
+    }
+  }
+  ps->class_rooted = 0;
+  ps->current = NULL;
+  ps->stack_depth = 0;
+  pr->hook_ticks = hook;
+  pr->call_ticks = call;
+}
+
+//Allocator installed while allocations are tracked
+//
+//Bytes requested, reallocations included, are charged to the instruction
+//the exact mode hook last fetched. ud is the allocator wrapped, which
+//stays valid after the profiler state is freed, so an allocator installed
+//over the wrapper can keep calling it until the VM is closed.
+static void *
+prof_allocf(mrb_state *mrb, void *p, size_t size, void *ud)
+{
+  struct prof_allocf_link *link = (struct prof_allocf_link *)ud;
+  struct prof_state *ps = mrb_profiler_state(mrb);
+
+  if (size > 0 && ps && ps->track_alloc && ps->current &&
+      ps->current->alloc) {
+    struct prof_irep *cur = ps->current;
+
+    cur->alloc[ps->old_pc - cur->irep->iseq].bytes += size;
+  }
+
+  return link->allocf(mrb, p, size, link->ud);
+}
+
+//Start or stop tracking allocations
+//
+//Arguments:
+// - mrb: mruby state
+// - ps:  profiler state of mrb
+// - on:  whether to track them
+static void
+prof_set_track_alloc(mrb_state *mrb, struct prof_state *ps, mrb_bool on)
+{
+  if (on && !ps->track_alloc) {
+    //The wrapper may still be chained from a previous run
+    if (!ps->alloc_link) {
+      struct prof_allocf_link *link =
+        (struct prof_allocf_link *)malloc(sizeof(struct prof_allocf_link));
+
+      if (!link) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+      }
+      link->allocf = mrb->allocf;
+      link->ud = mrb->allocf_ud;
+      mrb->allocf = prof_allocf;
+      mrb->allocf_ud = link;
+      ps->alloc_link = link;
+    }
+    ps->old_live = mrb->gc.live;
+    if (ps->current) {
+      mrb_profiler_alloc_counters(mrb, &ps->result, ps->current);
+    }
+  }
+  //An allocator installed over the wrapper keeps calling it, which then
+  //only forwards. Its link is left allocated for as long as it may be
+  //called.
+  else if (!on && ps->track_alloc && mrb->allocf == prof_allocf &&
+           mrb->allocf_ud == ps->alloc_link) {
+    mrb->allocf = ps->alloc_link->allocf;
+    mrb->allocf_ud = ps->alloc_link->ud;
+    free(ps->alloc_link);
+    ps->alloc_link = NULL;
+  }
+  ps->track_alloc = on;
+}
+
+//Install the hook of the current mode
+static void
+prof_install(mrb_state *mrb, struct prof_state *ps)
+{
+  prof_class_reserve(mrb, ps);
+  switch (ps->mode) {
+  case PROF_MODE_EXACT:
+    //The call chain may have changed since the hook last ran
+    ps->current = NULL;
+    mrb->code_fetch_hook = prof_code_fetch_hook;
+    break;
+  case PROF_MODE_SAMPLED:
+    mrb->code_fetch_hook = mrb_profiler_sample_hook;
+    mrb_profiler_sample_start(mrb, ps);
+    break;
+  }
+}
+
+//Remove the hook of the current mode
+static void
+prof_uninstall(mrb_state *mrb, struct prof_state *ps)
+{
+  mrb->code_fetch_hook = NULL;
+  mrb_profiler_sample_stop(mrb, ps);
+  //Methods still running are timed up to now, suspended fibers may run
+  //unprofiled from now
+  prof_stack_close(ps, prof_curtime());
+  prof_fiber_drop(ps);
+}
+
+//Select how the VM is observed
+//
+//Arguments:
+// - mrb:  mruby state
+// - ps:   profiler state of mrb
+// - mode: new profiling mode
+static void
+prof_set_mode(mrb_state *mrb, struct prof_state *ps, enum prof_mode mode)
+{
+  if (ps->running) {
+    prof_uninstall(mrb, ps);
+  }
+  ps->mode = mode;
+  if (ps->running) {
+    prof_install(mrb, ps);
+  }
+}
+
+MRB_API void
+mrb_profiler_start(mrb_state *mrb)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+
+  if (ps && !ps->running) {
+    prof_install(mrb, ps);
+    ps->running = TRUE;
+  }
+}
+
+MRB_API void
+mrb_profiler_stop(mrb_state *mrb)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+
+  if (ps && ps->running) {
+    prof_uninstall(mrb, ps);
+    ps->running = FALSE;
+  }
+}
+
+MRB_API mrb_bool
+mrb_profiler_running_p(mrb_state *mrb)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+
+  return ps && ps->running;
+}
+
+MRB_API void
+mrb_profiler_reset(mrb_state *mrb)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+  int i;
+
+  if (!ps) {
+    return;
+  }
+  //Pending samples are dropped along with the counters
+  mrb_profiler_sample_flush(mrb, ps);
+  prof_class_reserve(mrb, ps);
+  for (i = 0; i < ps->result.irep_num; i++) {
+    struct prof_irep *prof = ps->result.irep_tab[i];
+
+    memset(prof->time, 0, prof->irep->ilen * sizeof(uint64_t));
+    memset(prof->num, 0, prof->irep->ilen * sizeof(uint32_t));
+    memset(prof->ccall_num, 0, prof->child_num * sizeof(int));
+    if (prof->alloc) {
+      memset(prof->alloc, 0, prof->irep->ilen * sizeof(struct prof_alloc));
+    }
+    if (prof->gc) {
+      memset(prof->gc, 0, prof->irep->ilen * sizeof(uint64_t));
+    }
+    if (prof->events) {
+      memset(prof->events, 0,
+             prof->irep->ilen * ps->result.event_num * sizeof(uint64_t));
+    }
+    if (prof->hist) {
+      memset(prof->hist, 0, sizeof(struct prof_hist));
+    }
+    if (prof->insn_hist && !PROF_SHARED(prof)) {
+      int j;
+
+      for (j = 0; j < (int)prof->irep->ilen; j++) {
+        if (prof->insn_hist[j]) {
+          memset(prof->insn_hist[j], 0, sizeof(struct prof_hist));
+        }
+      }
+    }
+    prof->calls = 0;
+    prof->incl = 0;
+    prof->max = 0;
+  }
+  ps->result.overhead = 0;
+  ps->result.switch_ticks = 0;
+  ps->result.switch_num = 0;
+  ps->result.wall_start = mrb_profiler_wall_usec();
+  mrb_profiler_opstat_reset(ps);
+  //Don't charge the time before the reset to the pending instruction or
+  //the running methods
+  ps->old_time = ps->enter = prof_curtime();
+  ps->old_live = mrb->gc.live;
+  if (ps->pmu.num) {
+    mrb_profiler_pmu_read(&ps->pmu, ps->pmu.old);
+  }
+  for (i = 0; i < ps->stack_depth; i++) {
+    ps->stack[i].enter = ps->old_time;
+  }
+}
+
+//Get Profiler::Snapshot
+static struct RClass *
+prof_snapshot_class(mrb_state *mrb)
+{
+  return mrb_class_get_under(mrb, mrb_module_get(mrb, "Profiler"),
+                             "Snapshot");
+}
+
+MRB_API mrb_value
+mrb_profiler_snapshot(mrb_state *mrb)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+
+  if (!ps) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "profiler is finalized");
+  }
+  mrb_profiler_sample_flush(mrb, ps);
+  prof_class_reserve(mrb, ps);
+
+  return mrb_profiler_snapshot_new(mrb, prof_snapshot_class(mrb),
+                                   &ps->result);
+}
+
+MRB_API mrb_value
+mrb_profiler_merge(mrb_state *mrb, mrb_state **srcs, int nsrc)
+{
+  int i;
+
+  //Fold pending samples of every VM before reading its tree
+  for (i = 0; i < nsrc; i++) {
+    struct prof_state *ps = mrb_profiler_state(srcs[i]);
+
+    if (!ps) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "VM without profiler state");
+    }
+    mrb_profiler_sample_flush(srcs[i], ps);
+  }
+
+  return mrb_profiler_snapshot_merge(mrb, prof_snapshot_class(mrb),
+                                     srcs, nsrc);
+}
+
+MRB_API void
+mrb_profiler_dump(mrb_state *mrb, const char *path)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+
+  if (!ps) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "profiler is finalized");
+  }
+  mrb_profiler_sample_flush(mrb, ps);
+  mrb_profiler_dump_result(mrb, &ps->result, path);
+}
+
+//Get the profile a reporting method was called on
+//
+//Profiler itself reports the live profile, Profiler::Snapshot instances
+//report their copy.
+static struct prof_result *
+prof_result_of(mrb_state *mrb, mrb_value self)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+
+  if (mrb_obj_ptr(self) == mrb_obj_ptr(ps->module)) {
+    //Fold pending samples into the call tree before it is reported
+    mrb_profiler_sample_flush(mrb, ps);
+    return &ps->result;
+  }
+  return mrb_profiler_snapshot_result(mrb, self);
+}
+
+//Get a node of the profile a reporting method was called on
+static struct prof_irep *
+prof_irep_of(mrb_state *mrb, mrb_value self, mrb_int irepno)
+{
+  struct prof_result *res = prof_result_of(mrb, self);
+
+  if (irepno < 0 || irepno >= res->irep_num) {
+    mrb_raisef(mrb, E_INDEX_ERROR, "irep number %S out of range",
+               mrb_fixnum_value(irepno));
+  }
+  return res->irep_tab[irepno];
+}
+
+//Check that an instruction offset lies within an irep
+static void
+prof_iseq_check(mrb_state *mrb, mrb_irep *irep, mrb_int iseqoff)
+{
+  if (iseqoff < 0 || iseqoff >= (mrb_int)irep->ilen) {
+    mrb_raisef(mrb, E_INDEX_ERROR, "instruction offset %S out of range",
+               mrb_fixnum_value(iseqoff));
+  }
+}
+
+//Get total number of profiled ireps
+static mrb_value
+mrb_mruby_profiler_irep_num(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(prof_result_of(mrb, self)->irep_num);
+}
+
+//Get number of instructions in a given irep/method
+static mrb_value
+mrb_mruby_profiler_ilen(mrb_state *mrb, mrb_value self)
+{
+  mrb_int irepno;
+  mrb_get_args(mrb, "i", &irepno);
+
+  return mrb_fixnum_value(prof_irep_of(mrb, self, irepno)->irep->ilen);
+}
+
+//Get number of instructions in a given irep/method
+static mrb_value
+mrb_mruby_profiler_irep_id(mrb_state *mrb, void *v)
+{
+  char addr[128];
+  snprintf(addr, sizeof(addr), "%p", v);
+  return mrb_str_new_cstr(mrb, addr);
+}
+
+//Read source file
+//
+//Arguments:
+// - file name
+//Returns:
+// - Array of files's contents split by newline
+static mrb_value
+mrb_mruby_profiler_read(mrb_state *mrb, mrb_value self)
+{
+  char *fn;
+  int len;
+  mrb_value res;
+  FILE *fp;
+  char buf[256];
+  (void) self;
+
+  mrb_get_args(mrb, "s", &fn, &len);
+  fn[len] = '\0';
+
+  res = mrb_ary_new_capa(mrb, 6);
+  fp = fopen(fn, "r");
+  //Dumps may be analyzed where the sources aren't around
+  if (!fp) {
+    return res;
+  }
+  while (fgets(buf, 255, fp)) {
+    int ai = mrb_gc_arena_save(mrb);
+    mrb_value ele = mrb_str_new_cstr(mrb, buf);
+
+    mrb_ary_push(mrb, res, ele);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  fclose(fp);
+  return res;
+}
+
+//Produce String representation of provided irep code
+//Arguments
+//  - mrb:  mruby state
+//  - irep: VM instruction's irep
+//  - c:    VM instruction
+static mrb_value
+mrb_mruby_profiler_disasm_once(mrb_state *mrb, mrb_irep *irep, mrb_code c)
+{
+  int    i = 0;
+  char   buf[256] = {0};
+  size_t len = sizeof(buf);
+
+  if (PROF_NATIVE_P(irep)) {
+    return mrb_str_new_lit(mrb, "(native code)");
+  }
+  switch (GET_OPCODE(c)) {
+  case OP_NOP:
+    snprintf(buf, len, "OP_NOP\n");
+    break;
+  case OP_MOVE:
+    snprintf(buf, len, "OP_MOVE\tR%d\tR%d", GETARG_A(c), GETARG_B(c));
+    break;
+  case OP_LOADL:
+    {
+      mrb_value v = irep->pool[GETARG_Bx(c)];
+      mrb_value s = mrb_inspect(mrb, v);
+      snprintf(buf, len, "OP_LOADL\tR%d\tL(%d)\t; %s",
+          GETARG_A(c), GETARG_Bx(c), RSTRING_PTR(s));
+    }
+    break;
+  case OP_LOADI:
     snprintf(buf, len, "OP_LOADI\tR%d\t%d", GETARG_A(c), GETARG_sBx(c));
     break;
   case OP_LOADSYM:
@@ -486,360 +2129,1578 @@ mrb_mruby_profiler_disasm_once(mrb_state *mrb, mrb_irep *irep, mrb_code c)
             (GETARG_Bx(c)>>0)&0xf);
     break;
 
-  case OP_ENTER:
-    snprintf(buf, len, "OP_ENTER\t%d:%d:%d:%d:%d:%d:%d",
-            (GETARG_Ax(c)>>18)&0x1f,
-            (GETARG_Ax(c)>>13)&0x1f,
-            (GETARG_Ax(c)>>12)&0x1,
-            (GETARG_Ax(c)>>7)&0x1f,
-            (GETARG_Ax(c)>>2)&0x1f,
-            (GETARG_Ax(c)>>1)&0x1,
-            GETARG_Ax(c) & 0x1);
-    break;
-  case OP_RETURN:
-    snprintf(buf, len, "OP_RETURN\tR%d", GETARG_A(c));
-    switch (GETARG_B(c)) {
-    case OP_R_NORMAL:
-    case OP_R_RETURN:
-      strncat(buf, "\treturn", len); break;
-    case OP_R_BREAK:
-      strncat(buf, "\tbreak", len); break;
-    default:
-      strncat(buf, "\tbroken", len); break;
-      break;
-    }
-    break;
-  case OP_BLKPUSH:
-    snprintf(buf, len, "OP_BLKPUSH\tR%d\t%d:%d:%d:%d", GETARG_A(c),
-            (GETARG_Bx(c)>>10)&0x3f,
-            (GETARG_Bx(c)>>9)&0x1,
-            (GETARG_Bx(c)>>4)&0x1f,
-            (GETARG_Bx(c)>>0)&0xf);
-    break;
+  case OP_ENTER:
+    snprintf(buf, len, "OP_ENTER\t%d:%d:%d:%d:%d:%d:%d",
+            (GETARG_Ax(c)>>18)&0x1f,
+            (GETARG_Ax(c)>>13)&0x1f,
+            (GETARG_Ax(c)>>12)&0x1,
+            (GETARG_Ax(c)>>7)&0x1f,
+            (GETARG_Ax(c)>>2)&0x1f,
+            (GETARG_Ax(c)>>1)&0x1,
+            GETARG_Ax(c) & 0x1);
+    break;
+  case OP_RETURN:
+    snprintf(buf, len, "OP_RETURN\tR%d", GETARG_A(c));
+    switch (GETARG_B(c)) {
+    case OP_R_NORMAL:
+    case OP_R_RETURN:
+      strncat(buf, "\treturn", len); break;
+    case OP_R_BREAK:
+      strncat(buf, "\tbreak", len); break;
+    default:
+      strncat(buf, "\tbroken", len); break;
+      break;
+    }
+    break;
+  case OP_BLKPUSH:
+    snprintf(buf, len, "OP_BLKPUSH\tR%d\t%d:%d:%d:%d", GETARG_A(c),
+            (GETARG_Bx(c)>>10)&0x3f,
+            (GETARG_Bx(c)>>9)&0x1,
+            (GETARG_Bx(c)>>4)&0x1f,
+            (GETARG_Bx(c)>>0)&0xf);
+    break;
+
+  case OP_LAMBDA:
+    snprintf(buf, len, "OP_LAMBDA\tR%d\tI(%+d)\t%d",
+        GETARG_A(c), GETARG_b(c)+1, GETARG_c(c));
+    break;
+  case OP_RANGE:
+    snprintf(buf, len, "OP_RANGE\tR%d\tR%d\t%d",
+        GETARG_A(c), GETARG_B(c), GETARG_C(c));
+    break;
+  case OP_METHOD:
+    snprintf(buf, len, "OP_METHOD\tR%d\t:%s", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]));
+    break;
+
+  case OP_ADD:
+    snprintf(buf, len, "OP_ADD\tR%d\t:%s\t%d", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
+            GETARG_C(c));
+    break;
+  case OP_ADDI:
+    snprintf(buf, len, "OP_ADDI\tR%d\t:%s\t%d", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
+            GETARG_C(c));
+    break;
+  case OP_SUB:
+    snprintf(buf, len, "OP_SUB\tR%d\t:%s\t%d", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
+            GETARG_C(c));
+    break;
+  case OP_SUBI:
+    snprintf(buf, len, "OP_SUBI\tR%d\t:%s\t%d", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
+            GETARG_C(c));
+    break;
+  case OP_MUL:
+    snprintf(buf, len, "OP_MUL\tR%d\t:%s\t%d", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
+            GETARG_C(c));
+    break;
+  case OP_DIV:
+    snprintf(buf, len, "OP_DIV\tR%d\t:%s\t%d", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
+            GETARG_C(c));
+    break;
+  case OP_LT:
+    snprintf(buf, len, "OP_LT\tR%d\t:%s\t%d", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
+            GETARG_C(c));
+    break;
+  case OP_LE:
+    snprintf(buf, len, "OP_LE\tR%d\t:%s\t%d", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
+            GETARG_C(c));
+    break;
+  case OP_GT:
+    snprintf(buf, len, "OP_GT\tR%d\t:%s\t%d", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
+            GETARG_C(c));
+    break;
+  case OP_GE:
+    snprintf(buf, len, "OP_GE\tR%d\t:%s\t%d", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
+            GETARG_C(c));
+    break;
+  case OP_EQ:
+    snprintf(buf, len, "OP_EQ\tR%d\t:%s\t%d", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
+            GETARG_C(c));
+    break;
+
+  case OP_STOP:
+    snprintf(buf, len, "OP_STOP");
+    break;
+
+  case OP_ARRAY:
+    snprintf(buf, len, "OP_ARRAY\tR%d\tR%d\t%d",
+        GETARG_A(c), GETARG_B(c), GETARG_C(c));
+    break;
+  case OP_ARYCAT:
+    snprintf(buf, len, "OP_ARYCAT\tR%d\tR%d", GETARG_A(c), GETARG_B(c));
+    break;
+  case OP_ARYPUSH:
+    snprintf(buf, len, "OP_ARYPUSH\tR%d\tR%d", GETARG_A(c), GETARG_B(c));
+    break;
+  case OP_AREF:
+    snprintf(buf, len, "OP_AREF\tR%d\tR%d\t%d",
+        GETARG_A(c), GETARG_B(c), GETARG_C(c));
+    break;
+  case OP_APOST:
+    snprintf(buf, len, "OP_APOST\tR%d\t%d\t%d",
+        GETARG_A(c), GETARG_B(c), GETARG_C(c));
+    break;
+  case OP_STRING:
+    {
+      mrb_value v = irep->pool[GETARG_Bx(c)];
+      mrb_value s = mrb_str_dump(mrb,
+          mrb_str_new(mrb, RSTRING_PTR(v), RSTRING_LEN(v)));
+      snprintf(buf, len, "OP_STRING\tR%d\tL(%d)\t; %s",
+          GETARG_A(c), GETARG_Bx(c), RSTRING_PTR(s));
+    }
+    break;
+  case OP_STRCAT:
+    snprintf(buf, len, "OP_STRCAT\tR%d\tR%d", GETARG_A(c), GETARG_B(c));
+    break;
+  case OP_HASH:
+    snprintf(buf, len, "OP_HASH\tR%d\tR%d\t%d",
+        GETARG_A(c), GETARG_B(c), GETARG_C(c));
+    break;
+
+  case OP_OCLASS:
+    snprintf(buf, len, "OP_OCLASS\tR%d", GETARG_A(c));
+    break;
+  case OP_CLASS:
+    snprintf(buf, len, "OP_CLASS\tR%d\t:%s", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]));
+    break;
+  case OP_MODULE:
+    snprintf(buf, len, "OP_MODULE\tR%d\t:%s", GETARG_A(c),
+            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]));
+    break;
+  case OP_EXEC:
+    snprintf(buf, len, "OP_EXEC\tR%d\tI(%+d)", GETARG_A(c), GETARG_Bx(c)+1);
+    break;
+  case OP_SCLASS:
+    snprintf(buf, len, "OP_SCLASS\tR%d\tR%d", GETARG_A(c), GETARG_B(c));
+    break;
+  case OP_TCLASS:
+    snprintf(buf, len, "OP_TCLASS\tR%d", GETARG_A(c));
+    break;
+  case OP_ERR:
+    {
+      mrb_value v = irep->pool[GETARG_Bx(c)];
+      mrb_value s =
+        mrb_str_dump(mrb, mrb_str_new(mrb, RSTRING_PTR(v), RSTRING_LEN(v)));
+      snprintf(buf, len, "OP_ERR\t%s", RSTRING_PTR(s));
+    }
+    break;
+  case OP_EPUSH:
+    snprintf(buf, len, "OP_EPUSH\t:I(%+d)", GETARG_Bx(c)+1);
+    break;
+  case OP_ONERR:
+    snprintf(buf, len, "OP_ONERR\t%03d", i+GETARG_sBx(c));
+    break;
+  case OP_RESCUE:
+    snprintf(buf, len, "OP_RESCUE\tR%d", GETARG_A(c));
+    break;
+  case OP_RAISE:
+    snprintf(buf, len, "OP_RAISE\tR%d", GETARG_A(c));
+    break;
+  case OP_POPERR:
+    snprintf(buf, len, "OP_POPERR\t%d", GETARG_A(c));
+    break;
+  case OP_EPOP:
+    snprintf(buf, len, "OP_EPOP\t%d", GETARG_A(c));
+    break;
+
+  default:
+    snprintf(buf, len, "OP_unknown %d\t%d\t%d\t%d", GET_OPCODE(c),
+            GETARG_A(c), GETARG_B(c), GETARG_C(c));
+    break;
+  }
+  assert(strlen(buf) < sizeof(buf));
+
+  return mrb_str_new_cstr(mrb, buf);
+}
+
+//Get the performance counter counts of an instruction
+//
+//Arguments:
+// - pr:   Call tree of prof
+// - prof: Node of the instruction
+// - off:  Instruction offset
+//Returns:
+// - Array of counts in the order of event_names, empty if none was read
+static mrb_value
+prof_event_values(mrb_state *mrb, struct prof_result *pr,
+                  struct prof_irep *prof, size_t off)
+{
+  int num = prof->events && !PROF_SHARED(prof) ? pr->event_num : 0;
+  mrb_value res = mrb_ary_new_capa(mrb, num);
+  int i;
+
+  for (i = 0; i < num; i++) {
+    mrb_ary_push(mrb, res,
+        mrb_fixnum_value((mrb_int)prof->events[off * num + i]));
+  }
+
+  return res;
+}
+
+//Get instruction profiling information
+//Arguments:
+// - irepno  - Instruction number
+// - iseqoff - Instruction sequence offset
+//Returns:
+// - Ten value array
+//  0. File name or method name
+//  1. Line number of instruction (if available)
+//  2. Execution count of instruction
+//  3. Cumulative execution time
+//  4. Address
+//  5. Code
+//  6. Bytes allocated (0 unless allocations were tracked)
+//  7. Objects allocated
+//  8. Time of GC steps run by the instruction, excluded from 3
+//  9. Array of performance counter counts, see event_names
+static mrb_value
+mrb_mruby_profiler_get_inst_info(mrb_state *mrb, mrb_value self)
+{
+  mrb_int irepno=0;
+  mrb_int iseqoff=0;
+  mrb_value res;
+  const char *str;
+  struct prof_irep *prof;
+  mrb_code *code;
+  mrb_bool own;
+  char addr[128];
+  mrb_get_args(mrb, "ii", &irepno, &iseqoff);
+
+  prof = prof_irep_of(mrb, self, irepno);
+  prof_iseq_check(mrb, prof->irep, iseqoff);
+  own  = !PROF_SHARED(prof);
+  res  = mrb_ary_new_capa(mrb, 10);
+  /* 0 file name or method name */
+  str  = prof->irep->filename;
+  if (str) {
+    mrb_ary_push(mrb, res, mrb_str_new_cstr(mrb, str));
+  }
+  else {
+    mrb_value cls_mname = mrb_ary_new_capa(mrb, 2);
+    mrb_ary_push(mrb, cls_mname,
+        mrb_str_new_cstr(mrb, mrb_profiler_irep_klass(mrb, prof)));
+    mrb_ary_push(mrb, cls_mname,
+        mrb_str_new_cstr(mrb, mrb_profiler_irep_mname(mrb, prof)));
+
+    mrb_ary_push(mrb, res, cls_mname);
+  }
+
+  /* 1 Line no */
+  if (prof->irep->lines) {
+    mrb_ary_push(mrb, res, mrb_fixnum_value(prof->irep->lines[iseqoff]));
+  }
+  else {
+    mrb_ary_push(mrb, res, mrb_nil_value());
+  }
+
+  /* 2 Execution Count */
+  mrb_ary_push(mrb, res, mrb_fixnum_value(own ? prof->num[iseqoff] : 0));
+  /* 3 Execution Time */
+  mrb_ary_push(mrb, res, mrb_float_value(mrb,
+      own ? PROF_TICK2SEC(prof->time[iseqoff]) : 0.0));
+
+  /* 4 Address */
+  code = &prof->irep->iseq[iseqoff];
+  snprintf(addr, sizeof(addr), "%p", code);
+  mrb_ary_push(mrb, res, mrb_str_new_cstr(mrb, addr));
+
+  /* 5 code   */
+  mrb_ary_push(mrb, res,
+      mrb_mruby_profiler_disasm_once(mrb, prof->irep, *code));
+
+  /* 6 Allocated bytes, 7 Allocated objects */
+  if (own && prof->alloc) {
+    mrb_ary_push(mrb, res,
+        mrb_fixnum_value((mrb_int)prof->alloc[iseqoff].bytes));
+    mrb_ary_push(mrb, res, mrb_fixnum_value(prof->alloc[iseqoff].objs));
+  }
+  else {
+    mrb_ary_push(mrb, res, mrb_fixnum_value(0));
+    mrb_ary_push(mrb, res, mrb_fixnum_value(0));
+  }
+
+  /* 8 GC time */
+  mrb_ary_push(mrb, res, mrb_float_value(mrb,
+      own && prof->gc ? PROF_TICK2SEC(prof->gc[iseqoff]) : 0.0));
+
+  /* 9 Performance counters */
+  mrb_ary_push(mrb, res,
+      prof_event_values(mrb, prof_result_of(mrb, self), prof, iseqoff));
+
+  return res;
+}
+
+//Get the counters of every instruction of an irep at once
+//
+//Nodes sharing the counters of another one in flat mode have them all
+//zero or nil.
+//Arguments:
+// - irepno  - Irep number
+//Returns:
+// - Seven arrays indexed by instruction offset
+//  0. Execution counts
+//  1. Cumulative execution times in seconds, without GC
+//  2. Bytes allocated, nil if no allocation was tracked in the irep
+//  3. Objects allocated, nil likewise
+//  4. Times of GC steps in seconds, nil if the irep ran none
+//  5. Arrays of performance counter counts, nil if none was read in the
+//     irep
+//  6. Latencies as [count, p50, p90, p99, max] in seconds, nil for
+//     instructions without a histogram, nil if none has one
+static mrb_value
+mrb_mruby_profiler_irep_counters(mrb_state *mrb, mrb_value self)
+{
+  mrb_int irepno;
+  struct prof_irep *prof;
+  mrb_value counts;
+  mrb_value times;
+  mrb_value res;
+  mrb_bool own;
+  size_t i;
+
+  mrb_get_args(mrb, "i", &irepno);
+  prof = prof_irep_of(mrb, self, irepno);
+  own = !PROF_SHARED(prof);
+
+  counts = mrb_ary_new_capa(mrb, prof->irep->ilen);
+  times  = mrb_ary_new_capa(mrb, prof->irep->ilen);
+  for (i = 0; i < prof->irep->ilen; i++) {
+    mrb_ary_push(mrb, counts, mrb_fixnum_value(own ? prof->num[i] : 0));
+    mrb_ary_push(mrb, times, mrb_float_value(mrb,
+        own ? PROF_TICK2SEC(prof->time[i]) : 0.0));
+  }
+
+  res = mrb_ary_new_capa(mrb, 7);
+  mrb_ary_push(mrb, res, counts);
+  mrb_ary_push(mrb, res, times);
+  if (own && prof->alloc) {
+    mrb_value bytes = mrb_ary_new_capa(mrb, prof->irep->ilen);
+    mrb_value objs  = mrb_ary_new_capa(mrb, prof->irep->ilen);
+
+    for (i = 0; i < prof->irep->ilen; i++) {
+      mrb_ary_push(mrb, bytes,
+          mrb_fixnum_value((mrb_int)prof->alloc[i].bytes));
+      mrb_ary_push(mrb, objs, mrb_fixnum_value(prof->alloc[i].objs));
+    }
+    mrb_ary_push(mrb, res, bytes);
+    mrb_ary_push(mrb, res, objs);
+  }
+  else {
+    mrb_ary_push(mrb, res, mrb_nil_value());
+    mrb_ary_push(mrb, res, mrb_nil_value());
+  }
+  if (own && prof->gc) {
+    mrb_value gc = mrb_ary_new_capa(mrb, prof->irep->ilen);
+
+    for (i = 0; i < prof->irep->ilen; i++) {
+      mrb_ary_push(mrb, gc, mrb_float_value(mrb, PROF_TICK2SEC(prof->gc[i])));
+    }
+    mrb_ary_push(mrb, res, gc);
+  }
+  else {
+    mrb_ary_push(mrb, res, mrb_nil_value());
+  }
+  if (own && prof->events) {
+    struct prof_result *pr = prof_result_of(mrb, self);
+    mrb_value events = mrb_ary_new_capa(mrb, prof->irep->ilen);
+
+    for (i = 0; i < prof->irep->ilen; i++) {
+      mrb_ary_push(mrb, events, prof_event_values(mrb, pr, prof, i));
+    }
+    mrb_ary_push(mrb, res, events);
+  }
+  else {
+    mrb_ary_push(mrb, res, mrb_nil_value());
+  }
+  if (own && prof->insn_hist) {
+    mrb_value lat = mrb_ary_new_capa(mrb, prof->irep->ilen);
+
+    for (i = 0; i < prof->irep->ilen; i++) {
+      struct prof_hist *h = prof->insn_hist[i];
+
+      mrb_ary_push(mrb, lat, h && mrb_profiler_hist_count(h) > 0
+                             ? mrb_profiler_hist_summary(mrb, h)
+                             : mrb_nil_value());
+    }
+    mrb_ary_push(mrb, res, lat);
+  }
+  else {
+    mrb_ary_push(mrb, res, mrb_nil_value());
+  }
+
+  return res;
+}
+
+//Get the source line of every instruction of an irep
+//Arguments:
+// - irepno  - Irep number
+//Returns:
+// - Array of line numbers indexed by instruction offset, or nil if the
+//   irep has no line information
+static mrb_value
+mrb_mruby_profiler_irep_lines(mrb_state *mrb, mrb_value self)
+{
+  mrb_int irepno;
+  mrb_irep *irep;
+  mrb_value res;
+  size_t i;
+
+  mrb_get_args(mrb, "i", &irepno);
+  irep = prof_irep_of(mrb, self, irepno)->irep;
+  if (!irep->lines) {
+    return mrb_nil_value();
+  }
+
+  res = mrb_ary_new_capa(mrb, irep->ilen);
+  for (i = 0; i < irep->ilen; i++) {
+    mrb_ary_push(mrb, res, mrb_fixnum_value(irep->lines[i]));
+  }
+
+  return res;
+}
+
+//Disassemble one instruction
+//Arguments:
+// - irepno  - Irep number
+// - iseqoff - Instruction sequence offset
+//Returns:
+// - String representation of the instruction
+static mrb_value
+mrb_mruby_profiler_disasm(mrb_state *mrb, mrb_value self)
+{
+  mrb_int irepno;
+  mrb_int iseqoff;
+  mrb_irep *irep;
+
+  mrb_get_args(mrb, "ii", &irepno, &iseqoff);
+  irep = prof_irep_of(mrb, self, irepno)->irep;
+  prof_iseq_check(mrb, irep, iseqoff);
+
+  return mrb_mruby_profiler_disasm_once(mrb, irep, irep->iseq[iseqoff]);
+}
+
+#define IREP_ID(prof) (mrb_mruby_profiler_irep_id(mrb, (prof)->irep))
+
+//Get irep information
+//Arguments:
+// - irepno  - Irep number
+//Returns:
+// - Eleven value array
+//  0. ID of IRep
+//  1. Class of method
+//  2. Method name
+//  3. File name (if available)
+//  4. Array of child IDs
+//  5. Array of call numbers to children
+//  6. Number of activations (exact mode only)
+//  7. Inclusive time in seconds, including callees
+//  8. Longest activation in seconds (exact mode only)
+//  9. Array of child irep numbers
+//  10. Whether the method is implemented in C, its only instruction then
+//      counting the calls that ran no Ruby code
+static mrb_value
+mrb_mruby_profiler_get_irep_info(mrb_state *mrb, mrb_value self)
+{
+  mrb_int           irepno;
+  struct prof_irep *profi;
+  mrb_value         res;
+  mrb_value         ary;
+  const char       *filename;
+  int i;
+
+  mrb_get_args(mrb, "i", &irepno);
+
+  profi = prof_irep_of(mrb, self, irepno);
+  int ai = mrb_gc_arena_save(mrb);
+  res = mrb_ary_new_capa(mrb, 11);
+  /* 0 id of irep */
+  mrb_ary_push(mrb, res, IREP_ID(profi));
+
+  /* 1 Class of method */
+  mrb_ary_push(mrb, res,
+      mrb_str_new_cstr(mrb, mrb_profiler_irep_klass(mrb, profi)));
+
+  /* 2 method name */
+  mrb_ary_push(mrb, res,
+      mrb_str_new_cstr(mrb, mrb_profiler_irep_mname(mrb, profi)));
+
+  /* 3 file name */
+  filename = profi->irep->filename;
+  if (filename) {
+    mrb_ary_push(mrb, res, mrb_str_new_cstr(mrb, filename));
+  }
+  else {
+    mrb_ary_push(mrb, res, mrb_nil_value());
+  }
+
+  /* 4 Children */
+  ary = mrb_ary_new_capa(mrb, profi->child_num);
+  for (i = 0; i < profi->child_num; i++) {
+    mrb_ary_push(mrb, ary, IREP_ID(profi->child[i]));
+  }
+  mrb_ary_push(mrb, res, ary);
+
+  /* 5 Call num to Childs */
+  ary = mrb_ary_new_capa(mrb, profi->child_num);
+  for (i = 0; i < profi->child_num; i++) {
+    mrb_ary_push(mrb, ary, mrb_fixnum_value(profi->ccall_num[i]));
+  }
+  mrb_ary_push(mrb, res, ary);
+
+  /* 6 Activations */
+  mrb_ary_push(mrb, res, mrb_fixnum_value(profi->calls));
+
+  /* 7 Inclusive time */
+  mrb_ary_push(mrb, res, mrb_float_value(mrb, PROF_TICK2SEC(profi->incl)));
+
+  /* 8 Longest activation */
+  mrb_ary_push(mrb, res, mrb_float_value(mrb, PROF_TICK2SEC(profi->max)));
+
+  /* 9 Child irep numbers */
+  ary = mrb_ary_new_capa(mrb, profi->child_num);
+  for (i = 0; i < profi->child_num; i++) {
+    mrb_ary_push(mrb, ary, mrb_fixnum_value(profi->child[i]->no));
+  }
+  mrb_ary_push(mrb, res, ary);
+
+  /* 10 Implemented in C */
+  mrb_ary_push(mrb, res, mrb_bool_value(PROF_NATIVE_P(profi->irep)));
+  mrb_gc_arena_restore(mrb, ai);
+
+  return res;
+}
+
+//Append the frames from the root to a node to its key
+static void
+prof_node_key(mrb_state *mrb, struct prof_irep *node, mrb_value key)
+{
+  mrb_irep *irep = node->irep;
+  const char *klass = mrb_profiler_irep_klass(mrb, node);
+  const char *mname = mrb_profiler_irep_mname(mrb, node);
+
+  if (node->parent) {
+    prof_node_key(mrb, node->parent, key);
+    mrb_str_cat_lit(mrb, key, ";");
+  }
+  if (*mname) {
+    mrb_str_cat_cstr(mrb, key, *klass ? klass : "?");
+    mrb_str_cat_lit(mrb, key, "#");
+    mrb_str_cat_cstr(mrb, key, mname);
+  }
+  else {
+    mrb_str_cat_lit(mrb, key, "<top>");
+  }
+  if (irep->filename) {
+    char line[16];
+
+    snprintf(line, sizeof(line), ":%d", irep->lines ? irep->lines[0] : 0);
+    mrb_str_cat_lit(mrb, key, " ");
+    mrb_str_cat_cstr(mrb, key, irep->filename);
+    mrb_str_cat_cstr(mrb, key, line);
+  }
+}
+
+//Get an identity of a node that doesn't depend on addresses
+//
+//Unlike the irep IDs, keys stay the same from one run to the next, so
+//profiles of different runs, processes or hosts can be lined up.
+//Arguments:
+// - irepno  - Irep number
+//Returns:
+// - Frames from the root to the node separated by ';', each being
+//   "Class#method file:line" with the first line of the code run ("<top>"
+//   for code outside methods), file and line being left out for methods
+//   implemented in C
+static mrb_value
+mrb_mruby_profiler_node_key(mrb_state *mrb, mrb_value self)
+{
+  mrb_int irepno;
+  mrb_value key = mrb_str_buf_new(mrb, 64);
+
+  mrb_get_args(mrb, "i", &irepno);
+  prof_node_key(mrb, prof_irep_of(mrb, self, irepno), key);
+
+  return key;
+}
+
+//Get the profiling mode
+//Returns:
+// - :exact or :sampled
+static mrb_value
+mrb_mruby_profiler_mode(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+
+  if (mrb_profiler_state(mrb)->mode == PROF_MODE_SAMPLED) {
+    return mrb_symbol_value(mrb_intern_lit(mrb, "sampled"));
+  }
+  return mrb_symbol_value(mrb_intern_lit(mrb, "exact"));
+}
+
+//Set the profiling mode
+//Arguments:
+// - mode - :exact or :sampled
+static mrb_value
+mrb_mruby_profiler_set_mode(mrb_state *mrb, mrb_value self)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+  mrb_sym mode;
+  (void) self;
+
+  mrb_get_args(mrb, "n", &mode);
+  if (mode == mrb_intern_lit(mrb, "exact")) {
+    prof_set_mode(mrb, ps, PROF_MODE_EXACT);
+  }
+  else if (mode == mrb_intern_lit(mrb, "sampled")) {
+    prof_set_mode(mrb, ps, PROF_MODE_SAMPLED);
+  }
+  else {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown profiling mode :%S",
+               mrb_symbol_value(mode));
+  }
+
+  return mrb_symbol_value(mode);
+}
+
+//Get the sampling timer interval in microseconds
+static mrb_value
+mrb_mruby_profiler_sample_interval(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+  return mrb_fixnum_value(mrb_profiler_state(mrb)->sampler.interval);
+}
+
+//Set the sampling timer interval
+//Arguments:
+// - usec - Interval between samples in microseconds of CPU time
+static mrb_value
+mrb_mruby_profiler_set_sample_interval(mrb_state *mrb, mrb_value self)
+{
+  mrb_int usec;
+  (void) self;
+
+  mrb_get_args(mrb, "i", &usec);
+  if (usec <= 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "sample interval must be positive");
+  }
+  mrb_profiler_sample_set_interval(mrb, mrb_profiler_state(mrb), usec);
+
+  return mrb_fixnum_value(usec);
+}
+
+//Whether allocations are tracked
+static mrb_value
+mrb_mruby_profiler_track_alloc_p(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+  return mrb_bool_value(mrb_profiler_state(mrb)->track_alloc);
+}
+
+//Start or stop tracking allocations
+//
+//While tracked in exact mode, the bytes requested from the allocator and
+//the objects allocated are charged to the instruction executing.
+//Arguments:
+// - on - true to track allocations
+static mrb_value
+mrb_mruby_profiler_set_track_alloc(mrb_state *mrb, mrb_value self)
+{
+  mrb_bool on;
+  (void) self;
+
+  mrb_get_args(mrb, "b", &on);
+  prof_set_track_alloc(mrb, mrb_profiler_state(mrb), on);
+
+  return mrb_bool_value(on);
+}
+
+//Whether new call contexts share the instruction counters of their irep
+static mrb_value
+mrb_mruby_profiler_flat_p(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+  return mrb_bool_value(mrb_profiler_state(mrb)->result.flat);
+}
+
+//Share the instruction counters of each irep between its call contexts
+//
+//Memory then grows with the code profiled rather than with the number of
+//call contexts, which keep their calls and times. Contexts created before
+//keep counters of their own.
+//Arguments:
+// - on - true for flat counters
+static mrb_value
+mrb_mruby_profiler_set_flat(mrb_state *mrb, mrb_value self)
+{
+  mrb_bool on;
+  (void) self;
 
-  case OP_LAMBDA:
-    snprintf(buf, len, "OP_LAMBDA\tR%d\tI(%+d)\t%d",
-        GETARG_A(c), GETARG_b(c)+1, GETARG_c(c));
-    break;
-  case OP_RANGE:
-    snprintf(buf, len, "OP_RANGE\tR%d\tR%d\t%d",
-        GETARG_A(c), GETARG_B(c), GETARG_C(c));
-    break;
-  case OP_METHOD:
-    snprintf(buf, len, "OP_METHOD\tR%d\t:%s", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]));
-    break;
+  mrb_get_args(mrb, "b", &on);
+  mrb_profiler_state(mrb)->result.flat = on;
 
-  case OP_ADD:
-    snprintf(buf, len, "OP_ADD\tR%d\t:%s\t%d", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
-            GETARG_C(c));
-    break;
-  case OP_ADDI:
-    snprintf(buf, len, "OP_ADDI\tR%d\t:%s\t%d", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
-            GETARG_C(c));
-    break;
-  case OP_SUB:
-    snprintf(buf, len, "OP_SUB\tR%d\t:%s\t%d", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
-            GETARG_C(c));
-    break;
-  case OP_SUBI:
-    snprintf(buf, len, "OP_SUBI\tR%d\t:%s\t%d", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
-            GETARG_C(c));
-    break;
-  case OP_MUL:
-    snprintf(buf, len, "OP_MUL\tR%d\t:%s\t%d", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
-            GETARG_C(c));
-    break;
-  case OP_DIV:
-    snprintf(buf, len, "OP_DIV\tR%d\t:%s\t%d", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
-            GETARG_C(c));
-    break;
-  case OP_LT:
-    snprintf(buf, len, "OP_LT\tR%d\t:%s\t%d", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
-            GETARG_C(c));
-    break;
-  case OP_LE:
-    snprintf(buf, len, "OP_LE\tR%d\t:%s\t%d", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
-            GETARG_C(c));
-    break;
-  case OP_GT:
-    snprintf(buf, len, "OP_GT\tR%d\t:%s\t%d", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
-            GETARG_C(c));
-    break;
-  case OP_GE:
-    snprintf(buf, len, "OP_GE\tR%d\t:%s\t%d", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
-            GETARG_C(c));
-    break;
-  case OP_EQ:
-    snprintf(buf, len, "OP_EQ\tR%d\t:%s\t%d", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]),
-            GETARG_C(c));
-    break;
+  return mrb_bool_value(on);
+}
 
-  case OP_STOP:
-    snprintf(buf, len, "OP_STOP");
-    break;
+//Whether opcode statistics are collected
+static mrb_value
+mrb_mruby_profiler_opcode_stats_p(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+  return mrb_bool_value(mrb_profiler_state(mrb)->opstat_on);
+}
 
-  case OP_ARRAY:
-    snprintf(buf, len, "OP_ARRAY\tR%d\tR%d\t%d",
-        GETARG_A(c), GETARG_B(c), GETARG_C(c));
-    break;
-  case OP_ARYCAT:
-    snprintf(buf, len, "OP_ARYCAT\tR%d\tR%d", GETARG_A(c), GETARG_B(c));
-    break;
-  case OP_ARYPUSH:
-    snprintf(buf, len, "OP_ARYPUSH\tR%d\tR%d", GETARG_A(c), GETARG_B(c));
-    break;
-  case OP_AREF:
-    snprintf(buf, len, "OP_AREF\tR%d\tR%d\t%d",
-        GETARG_A(c), GETARG_B(c), GETARG_C(c));
-    break;
-  case OP_APOST:
-    snprintf(buf, len, "OP_APOST\tR%d\t%d\t%d",
-        GETARG_A(c), GETARG_B(c), GETARG_C(c));
-    break;
-  case OP_STRING:
-    {
-      mrb_value v = irep->pool[GETARG_Bx(c)];
-      mrb_value s = mrb_str_dump(mrb,
-          mrb_str_new(mrb, RSTRING_PTR(v), RSTRING_LEN(v)));
-      snprintf(buf, len, "OP_STRING\tR%d\tL(%d)\t; %s",
-          GETARG_A(c), GETARG_Bx(c), RSTRING_PTR(s));
+//Start or stop collecting opcode statistics
+//
+//In exact mode, executions and time of each opcode and the number of times
+//each opcode is followed by each other are counted over the whole run.
+//Arguments:
+// - on - true to collect them
+static mrb_value
+mrb_mruby_profiler_set_opcode_stats(mrb_state *mrb, mrb_value self)
+{
+  mrb_bool on;
+  (void) self;
+
+  mrb_get_args(mrb, "b", &on);
+  mrb_profiler_opstat_enable(mrb, mrb_profiler_state(mrb), on);
+
+  return mrb_bool_value(on);
+}
+
+//Get the opcode histogram
+//Returns:
+// - Array of [opcode name, executions, seconds] of the opcodes executed
+static mrb_value
+mrb_mruby_profiler_opcode_counts(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+  return mrb_profiler_opstat_counts(mrb, mrb_profiler_state(mrb));
+}
+
+//Get the opcode pair counts
+//Returns:
+// - Array of [opcode name, next opcode name, count] of the pairs executed
+static mrb_value
+mrb_mruby_profiler_opcode_pairs(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+  return mrb_profiler_opstat_pairs(mrb, mrb_profiler_state(mrb));
+}
+
+//Whether the durations of method calls are recorded in histograms
+static mrb_value
+mrb_mruby_profiler_latency_histograms_p(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+  return mrb_bool_value(mrb_profiler_state(mrb)->hist_on);
+}
+
+//Record the duration of each method call in a histogram
+//
+//Each call context gets a log-linear histogram of its activations, of
+//about 2KB allocated when it is first entered while recording. The
+//recorded histograms are kept when recording stops.
+//Arguments:
+// - on - true to record
+static mrb_value
+mrb_mruby_profiler_set_latency_histograms(mrb_state *mrb, mrb_value self)
+{
+  mrb_bool on;
+  (void) self;
+
+  mrb_get_args(mrb, "b", &on);
+  mrb_profiler_state(mrb)->hist_on = on;
+
+  return mrb_bool_value(on);
+}
+
+//Get the opcodes of the instructions whose durations are recorded
+//Returns:
+// - Array of opcode names
+static mrb_value
+mrb_mruby_profiler_latency_opcodes(mrb_state *mrb, mrb_value self)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+  mrb_value res = mrb_ary_new(mrb);
+  int op;
+  (void) self;
+
+  for (op = 0; op < PROF_OPCODES; op++) {
+    if (ps->hist_op[op]) {
+      mrb_ary_push(mrb, res, mrb_profiler_opcode_name(mrb, op));
     }
-    break;
-  case OP_STRCAT:
-    snprintf(buf, len, "OP_STRCAT\tR%d\tR%d", GETARG_A(c), GETARG_B(c));
-    break;
-  case OP_HASH:
-    snprintf(buf, len, "OP_HASH\tR%d\tR%d\t%d",
-        GETARG_A(c), GETARG_B(c), GETARG_C(c));
-    break;
+  }
 
-  case OP_OCLASS:
-    snprintf(buf, len, "OP_OCLASS\tR%d", GETARG_A(c));
-    break;
-  case OP_CLASS:
-    snprintf(buf, len, "OP_CLASS\tR%d\t:%s", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]));
-    break;
-  case OP_MODULE:
-    snprintf(buf, len, "OP_MODULE\tR%d\t:%s", GETARG_A(c),
-            mrb_sym2name(mrb, irep->syms[GETARG_B(c)]));
-    break;
-  case OP_EXEC:
-    snprintf(buf, len, "OP_EXEC\tR%d\tI(%+d)", GETARG_A(c), GETARG_Bx(c)+1);
-    break;
-  case OP_SCLASS:
-    snprintf(buf, len, "OP_SCLASS\tR%d\tR%d", GETARG_A(c), GETARG_B(c));
-    break;
-  case OP_TCLASS:
-    snprintf(buf, len, "OP_TCLASS\tR%d", GETARG_A(c));
-    break;
-  case OP_ERR:
-    {
-      mrb_value v = irep->pool[GETARG_Bx(c)];
-      mrb_value s =
-        mrb_str_dump(mrb, mrb_str_new(mrb, RSTRING_PTR(v), RSTRING_LEN(v)));
-      snprintf(buf, len, "OP_ERR\t%s", RSTRING_PTR(s));
+  return res;
+}
+
+//Record the duration of each execution of the instructions of some
+//opcodes in a histogram
+//
+//Each instruction gets a histogram when first executed, reported by
+//irep_counters. The duration of a send covers the C method it calls.
+//Arguments:
+// - ops - Array of opcode names like "OP_SEND" or :OP_SEND, empty to stop
+static mrb_value
+mrb_mruby_profiler_set_latency_opcodes(mrb_state *mrb, mrb_value self)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+  uint8_t sel[PROF_OPCODES];
+  mrb_value *ops;
+  mrb_int n;
+  mrb_int i;
+  (void) self;
+
+  mrb_get_args(mrb, "a", &ops, &n);
+  memset(sel, 0, sizeof(sel));
+  for (i = 0; i < n; i++) {
+    const char *name = mrb_symbol_p(ops[i])
+      ? mrb_sym2name(mrb, mrb_symbol(ops[i]))
+      : mrb_string_value_cstr(mrb, &ops[i]);
+    int op = mrb_profiler_opcode_of(name);
+
+    if (op < 0) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown opcode %S",
+                 mrb_str_new_cstr(mrb, name));
     }
-    break;
-  case OP_EPUSH:
-    snprintf(buf, len, "OP_EPUSH\t:I(%+d)", GETARG_Bx(c)+1);
-    break;
-  case OP_ONERR:
-    snprintf(buf, len, "OP_ONERR\t%03d", i+GETARG_sBx(c));
-    break;
-  case OP_RESCUE:
-    snprintf(buf, len, "OP_RESCUE\tR%d", GETARG_A(c));
-    break;
-  case OP_RAISE:
-    snprintf(buf, len, "OP_RAISE\tR%d", GETARG_A(c));
-    break;
-  case OP_POPERR:
-    snprintf(buf, len, "OP_POPERR\t%d", GETARG_A(c));
-    break;
-  case OP_EPOP:
-    snprintf(buf, len, "OP_EPOP\t%d", GETARG_A(c));
-    break;
+    sel[op] = 1;
+  }
+  memcpy(ps->hist_op, sel, sizeof(sel));
+  ps->hist_insn = n > 0;
+
+  return mrb_ary_new_from_values(mrb, n, ops);
+}
+
+//Get the latency of the activations of a call context
+//Arguments:
+// - irepno  - Irep number
+//Returns:
+// - [calls, p50, p90, p99, max], durations in seconds of the calls
+//   recorded, nil if none was
+static mrb_value
+mrb_mruby_profiler_latency(mrb_state *mrb, mrb_value self)
+{
+  mrb_int irepno;
+  struct prof_irep *prof;
+
+  mrb_get_args(mrb, "i", &irepno);
+  prof = prof_irep_of(mrb, self, irepno);
+  if (!prof->hist || mrb_profiler_hist_count(prof->hist) == 0) {
+    return mrb_nil_value();
+  }
+
+  return mrb_profiler_hist_summary(mrb, prof->hist);
+}
+
+//Get the names of the performance counters being read
+//Returns:
+// - Array of event names, empty when the counters are off
+static mrb_value
+mrb_mruby_profiler_perf_counters(mrb_state *mrb, mrb_value self)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+  mrb_value res = mrb_ary_new_capa(mrb, ps->pmu.num);
+  int i;
+  (void) self;
 
-  default:
-    snprintf(buf, len, "OP_unknown %d\t%d\t%d\t%d", GET_OPCODE(c),
-            GETARG_A(c), GETARG_B(c), GETARG_C(c));
-    break;
+  for (i = 0; i < ps->pmu.num; i++) {
+    mrb_ary_push(mrb, res, mrb_str_new_cstr(mrb, ps->result.event_name[i]));
   }
-  assert(strlen(buf) < sizeof(buf));
 
-  return mrb_str_new_cstr(mrb, buf);
+  return res;
 }
 
-//Get instruction profiling information
+//Start or stop reading performance counters for each instruction
+//
+//In exact mode, cycles, instructions, cache misses and branch misses of
+//the thread are charged to each instruction like its time. Where hardware
+//counters are unavailable, software counters are used instead.
 //Arguments:
-// - irepno  - Instruction number
-// - iseqoff - Instruction sequence offset
+// - on - true, :software to skip the hardware counters, or false
 //Returns:
-// - Six value array
-//  0. File name or method name
-//  1. Line number of instruction (if available)
-//  2. Execution count of instruction
-//  3. Cumulative execution time
-//  4. Address
-//  5. Code
+// - Array of the names of the counters opened
 static mrb_value
-mrb_mruby_profiler_get_inst_info(mrb_state *mrb, mrb_value self)
+mrb_mruby_profiler_set_perf_counters(mrb_state *mrb, mrb_value self)
 {
-  mrb_int irepno=0;
-  mrb_int iseqoff=0;
-  mrb_value res;
-  const char *str;
-  struct prof_irep *prof;
-  mrb_code *code;
-  char addr[128];
-  (void) self;
-  mrb_get_args(mrb, "ii", &irepno, &iseqoff);
+  struct prof_state *ps = mrb_profiler_state(mrb);
+  mrb_value on;
 
-  res  = mrb_ary_new_capa(mrb, 7);
-  prof = result.irep_tab[irepno];
-  /* 0 file name or method name */
-  str  = prof->irep->filename;
-  if (str) {
-    mrb_ary_push(mrb, res, mrb_str_new_cstr(mrb, str));
+  mrb_get_args(mrb, "o", &on);
+  if (!mrb_test(on)) {
+    mrb_profiler_pmu_close(ps);
   }
   else {
-    mrb_value cls_mname = mrb_ary_new_capa(mrb, 2);
-    mrb_ary_push(mrb, cls_mname, mrb_str_new_cstr(mrb,prof->klass));
-    mrb_ary_push(mrb, cls_mname, mrb_str_new_cstr(mrb,prof->mname));
+    mrb_bool hardware = !(mrb_symbol_p(on) &&
+        mrb_symbol(on) == mrb_intern_lit(mrb, "software"));
 
-    mrb_ary_push(mrb, res, cls_mname);
+    mrb_profiler_pmu_open(mrb, ps, hardware);
   }
 
-  /* 1 Line no */
-  if (prof->irep->lines) {
-    mrb_ary_push(mrb, res, mrb_fixnum_value(prof->irep->lines[iseqoff]));
-  }
-  else {
-    mrb_ary_push(mrb, res, mrb_nil_value());
+  return mrb_mruby_profiler_perf_counters(mrb, self);
+}
+
+//Get the names of the performance counters recorded in the profile
+//Returns:
+// - Array of event names, in the order of the counts of get_inst_info
+static mrb_value
+mrb_mruby_profiler_event_names(mrb_state *mrb, mrb_value self)
+{
+  struct prof_result *pr = prof_result_of(mrb, self);
+  mrb_value res = mrb_ary_new_capa(mrb, pr->event_num);
+  int i;
+
+  for (i = 0; i < pr->event_num; i++) {
+    mrb_ary_push(mrb, res, mrb_str_new_cstr(mrb, pr->event_name[i]));
   }
 
-  /* 2 Execution Count */
-  mrb_ary_push(mrb, res, mrb_fixnum_value(prof->cnt[iseqoff].num));
-  /* 3 Execution Time */
-  mrb_ary_push(mrb, res, mrb_float_value(mrb, prof->cnt[iseqoff].time));
+  return res;
+}
 
-  /* 4 Address */
-  code = &prof->irep->iseq[iseqoff];
-  snprintf(addr, sizeof(addr), "%p", code);
-  mrb_ary_push(mrb, res, mrb_str_new_cstr(mrb, addr));
+//Get the profiler overhead taken out of the counters
+//Returns:
+// - [seconds per instruction, seconds per call or return, total seconds]
+static mrb_value
+mrb_mruby_profiler_overhead(mrb_state *mrb, mrb_value self)
+{
+  struct prof_result *pr = prof_result_of(mrb, self);
+  mrb_value res = mrb_ary_new_capa(mrb, 3);
 
-  /* 5 code   */
+  mrb_ary_push(mrb, res, mrb_float_value(mrb, PROF_TICK2SEC(pr->hook_ticks)));
+  mrb_ary_push(mrb, res, mrb_float_value(mrb, PROF_TICK2SEC(pr->call_ticks)));
+  mrb_ary_push(mrb, res, mrb_float_value(mrb, PROF_TICK2SEC(pr->overhead)));
+
+  return res;
+}
+
+//Get the fiber switches seen in exact mode
+//Returns:
+// - [number of switches, seconds from the last instruction of a fiber to
+//   the first one of the next]
+static mrb_value
+mrb_mruby_profiler_fiber_switches(mrb_state *mrb, mrb_value self)
+{
+  struct prof_result *pr = prof_result_of(mrb, self);
+  mrb_value res = mrb_ary_new_capa(mrb, 2);
+
+  mrb_ary_push(mrb, res, mrb_fixnum_value(pr->switch_num));
   mrb_ary_push(mrb, res,
-      mrb_mruby_profiler_disasm_once(mrb, prof->irep, *code));
+               mrb_float_value(mrb, PROF_TICK2SEC(pr->switch_ticks)));
 
   return res;
 }
 
-#define IREP_ID(prof) (mrb_mruby_profiler_irep_id(mrb, (prof)->irep))
+//Get the name of the clock used for timing
+//Returns:
+// - "tsc", "rdtscp", "monotonic_raw" or "monotonic"
+static mrb_value
+mrb_mruby_profiler_clock(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+  return mrb_str_new_cstr(mrb, mrb_profiler_clock.name);
+}
 
-//Get irep information
+//Get the measured resolution of the clock used for timing in seconds
+static mrb_value
+mrb_mruby_profiler_clock_resolution(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+  return mrb_float_value(mrb, mrb_profiler_clock.resolution);
+}
+
+//Start profiling, collecting into the existing profile
+static mrb_value
+mrb_mruby_profiler_start(mrb_state *mrb, mrb_value self)
+{
+  mrb_profiler_start(mrb);
+  return self;
+}
+
+//Stop profiling, the VM runs without the hook until restarted
+static mrb_value
+mrb_mruby_profiler_stop(mrb_state *mrb, mrb_value self)
+{
+  mrb_profiler_stop(mrb);
+  return self;
+}
+
+//Whether the profiling hook is installed
+static mrb_value
+mrb_mruby_profiler_running_p(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+  return mrb_bool_value(mrb_profiler_running_p(mrb));
+}
+
+//Zero every counter, keeping the call tree
+static mrb_value
+mrb_mruby_profiler_reset(mrb_state *mrb, mrb_value self)
+{
+  mrb_profiler_reset(mrb);
+  return self;
+}
+
+//Copy the profile
+//Returns:
+// - Profiler::Snapshot answering the same reports as Profiler
+static mrb_value
+mrb_mruby_profiler_snapshot(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+  return mrb_profiler_snapshot(mrb);
+}
+
+//Write the profile to a binary dump
 //Arguments:
-// - irepno  - Irep number
+// - path - file to create
+static mrb_value
+mrb_mruby_profiler_dump(mrb_state *mrb, mrb_value self)
+{
+  char *path;
+
+  mrb_get_args(mrb, "z", &path);
+  mrb_profiler_dump_result(mrb, prof_result_of(mrb, self), path);
+
+  return self;
+}
+
+//Write the call tree as folded stacks for flamegraph.pl
+//Arguments:
+// - path - file to create, "-" for stdout
+static mrb_value
+mrb_mruby_profiler_export_folded(mrb_state *mrb, mrb_value self)
+{
+  char *path;
+
+  mrb_get_args(mrb, "z", &path);
+  mrb_profiler_export_folded(mrb, prof_result_of(mrb, self), path);
+
+  return self;
+}
+
+//Write the call tree as a speedscope JSON profile
+//Arguments:
+// - path - file to create, "-" for stdout
+static mrb_value
+mrb_mruby_profiler_export_speedscope(mrb_state *mrb, mrb_value self)
+{
+  char *path;
+
+  mrb_get_args(mrb, "z", &path);
+  mrb_profiler_export_speedscope(mrb, prof_result_of(mrb, self), path);
+
+  return self;
+}
+
+//Load a binary dump
+//Arguments:
+// - path - file written by Profiler.dump
 //Returns:
-// - Six value array
-//  0. ID of IRep
-//  1. Class of method
-//  2. Method name
-//  3. File name (if available)
-//  4. Array of child IDs
-//  5. Array of call numbers to children
+// - Profiler::Snapshot answering the same reports as Profiler
 static mrb_value
-mrb_mruby_profiler_get_irep_info(mrb_state *mrb, mrb_value self)
+mrb_mruby_profiler_load(mrb_state *mrb, mrb_value self)
 {
-  mrb_int           irepno;
-  struct prof_irep *profi;
-  mrb_value         res;
-  mrb_value         ary;
-  const char       *filename;
-  int i;
+  char *path;
   (void) self;
 
-  mrb_get_args(mrb, "i", &irepno);
+  mrb_get_args(mrb, "z", &path);
 
-  int ai = mrb_gc_arena_save(mrb);
-  res = mrb_ary_new_capa(mrb, 3);
-  profi = result.irep_tab[irepno];
-  /* 0 id of irep */
-  mrb_ary_push(mrb, res, IREP_ID(profi));
+  return mrb_profiler_load_result(mrb, prof_snapshot_class(mrb), path);
+}
 
-  /* 1 Class of method */
-  mrb_ary_push(mrb, res, mrb_str_new_cstr(mrb,profi->klass));
+//Get wall clock microseconds from a Time or seconds since the epoch, 0 for
+//nil
+static uint64_t
+prof_epoch_usec(mrb_state *mrb, mrb_value t)
+{
+  mrb_float sec;
 
-  /* 2 method name */
-  mrb_ary_push(mrb, res, mrb_str_new_cstr(mrb,profi->mname));
+  if (mrb_nil_p(t)) {
+    return 0;
+  }
+  sec = mrb_to_flo(mrb, mrb_funcall(mrb, t, "to_f", 0));
+  return sec > 0 ? (uint64_t)(sec * 1e6) : 0;
+}
 
-  /* 3 file name */
-  filename = profi->irep->filename;
-  if (filename) {
-    mrb_ary_push(mrb, res, mrb_str_new_cstr(mrb, filename));
+//Combine binary dumps, typically deltas of continuous profiling
+//Arguments:
+// - paths - Array of dump files
+// - from  - Time or seconds since the epoch, dumps that ended before are
+//           skipped, nil for no limit
+// - to    - Time or seconds since the epoch, dumps that began after are
+//           skipped, nil for no limit
+//Returns:
+// - Profiler::Snapshot of the sum of the dumps in the range
+static mrb_value
+mrb_mruby_profiler_merge_dumps(mrb_state *mrb, mrb_value self)
+{
+  mrb_value paths;
+  mrb_value from = mrb_nil_value();
+  mrb_value to = mrb_nil_value();
+  (void) self;
+
+  mrb_get_args(mrb, "A|oo", &paths, &from, &to);
+
+  return mrb_profiler_snapshot_merge_dumps(mrb, prof_snapshot_class(mrb),
+                                           paths,
+                                           prof_epoch_usec(mrb, from),
+                                           prof_epoch_usec(mrb, to));
+}
+
+//Get the wall clock period the counters cover
+//Returns:
+// - [start, end] in seconds since the epoch, end nil while the profile is
+//   still counting, or nil if unknown
+static mrb_value
+mrb_mruby_profiler_period(mrb_state *mrb, mrb_value self)
+{
+  struct prof_result *pr = prof_result_of(mrb, self);
+  mrb_value res;
+
+  if (!pr->wall_start) {
+    return mrb_nil_value();
+  }
+  res = mrb_ary_new_capa(mrb, 2);
+  mrb_ary_push(mrb, res, mrb_float_value(mrb, pr->wall_start * 1e-6));
+  mrb_ary_push(mrb, res, pr->wall_end
+               ? mrb_float_value(mrb, pr->wall_end * 1e-6)
+               : mrb_nil_value());
+
+  return res;
+}
+
+//Write deltas of the profile to rotating files
+//
+//Every interval and on SIGUSR2, the counters since the previous delta are
+//written with the whole call tree to prefix.NNNNNN.prof, then zeroed. A
+//thread does the writing, the VM only builds each delta in memory.
+//Arguments:
+// - prefix   - start of the file names, nil to write a last delta and stop
+// - interval - seconds between deltas, 0 for SIGUSR2 only (60)
+// - keep     - number of files kept, older ones are removed, 0 for all (0)
+static mrb_value
+mrb_mruby_profiler_continuous(mrb_state *mrb, mrb_value self)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+  mrb_value prefix;
+  mrb_float interval = 60;
+  mrb_int keep = 0;
+
+  mrb_get_args(mrb, "o|fi", &prefix, &interval, &keep);
+  if (mrb_nil_p(prefix)) {
+    mrb_profiler_cont_stop(mrb, ps);
   }
   else {
-    mrb_ary_push(mrb, res, mrb_nil_value());
+    if (keep < 0) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "number of files kept is negative");
+    }
+    mrb_profiler_cont_start(mrb, ps, mrb_string_value_cstr(mrb, &prefix),
+                            interval, (uint32_t)keep);
   }
 
-  /* 4 Children */
-  ary = mrb_ary_new_capa(mrb, profi->child_num);
-  for (i = 0; i < profi->child_num; i++) {
-    mrb_ary_push(mrb, ary, IREP_ID(profi->child[i]));
-  }
-  mrb_ary_push(mrb, res, ary);
+  return self;
+}
 
-  /* 5 Call num to Childs */
-  ary = mrb_ary_new_capa(mrb, profi->child_num);
-  for (i = 0; i < profi->child_num; i++) {
-    mrb_ary_push(mrb, ary, mrb_fixnum_value(profi->ccall_num[i]));
+//Follow the VM from scratch after the filter rules changed
+//
+//The shadow stacks may hold methods the rules now leave out, or miss
+//methods they now profile.
+static void
+prof_filter_changed(struct prof_state *ps)
+{
+  prof_stack_close(ps, prof_curtime());
+  prof_fiber_drop(ps);
+}
+
+//Profile part of the code only
+//
+//Rules are matched once for each irep, the first time it runs. Code is
+//profiled when it matches an :include rule, or there are none, and no
+//:exclude rule. Blocks follow the method they run in. Code left out runs
+//as part of the call that entered it, which the nearest profiled caller
+//is charged for, so the time it takes stays in the profile.
+//Arguments:
+// - action  - :include or :exclude
+// - kind    - :file, :class or :method, what pattern is matched against
+// - pattern - glob matching the source file, the name of the class
+//             implementing the method or the method name
+// - block   - instead of kind and pattern, called with the source file,
+//             class name and method name (nil when unknown), matching when
+//             true
+static mrb_value
+mrb_mruby_profiler_filter(mrb_state *mrb, mrb_value self)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+  mrb_sym action;
+  mrb_sym kind = 0;
+  char *pattern = NULL;
+  mrb_value blk;
+  enum prof_filter_kind k;
+
+  mrb_get_args(mrb, "n|nz&", &action, &kind, &pattern, &blk);
+  if (action != mrb_intern_lit(mrb, "include") &&
+      action != mrb_intern_lit(mrb, "exclude")) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "action must be :include or :exclude");
+  }
+  if (!pattern) {
+    if (mrb_nil_p(blk)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "kind and pattern or block required");
+    }
+    k = PROF_FILTER_PROC;
+  }
+  else if (kind == mrb_intern_lit(mrb, "file")) {
+    k = PROF_FILTER_FILE;
+  }
+  else if (kind == mrb_intern_lit(mrb, "class")) {
+    k = PROF_FILTER_CLASS;
+  }
+  else if (kind == mrb_intern_lit(mrb, "method")) {
+    k = PROF_FILTER_METHOD;
+  }
+  else {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "kind must be :file, :class or :method");
   }
-  mrb_ary_push(mrb, res, ary);
-  mrb_gc_arena_restore(mrb, ai);
 
-  return res;
+  mrb_profiler_filter_add(mrb, ps, action == mrb_intern_lit(mrb, "exclude"),
+                          k, pattern,
+                          k == PROF_FILTER_PROC ? blk : mrb_nil_value());
+  prof_filter_changed(ps);
+
+  return self;
+}
+
+//Get the filter rules
+//Returns:
+// - Array of [action, kind, pattern] in the order added, kind being :proc
+//   and pattern the block for rules given as a block
+static mrb_value
+mrb_mruby_profiler_filters(mrb_state *mrb, mrb_value self)
+{
+  (void) self;
+  return mrb_profiler_filter_list(mrb, mrb_profiler_state(mrb));
+}
+
+//Remove every filter rule, profiling all code again
+static mrb_value
+mrb_mruby_profiler_clear_filters(mrb_state *mrb, mrb_value self)
+{
+  struct prof_state *ps = mrb_profiler_state(mrb);
+
+  mrb_profiler_filter_clear(mrb, ps);
+  prof_filter_changed(ps);
+
+  return self;
+}
+
+//Release all profiler data of a VM
+static void
+prof_free(mrb_state *mrb, struct prof_state *ps)
+{
+  struct prof_fiber *fibers = (struct prof_fiber *)ps->fibers.ent;
+  struct prof_native *natives = (struct prof_native *)ps->natives.ent;
+  uint32_t i;
+
+  prof_set_track_alloc(mrb, ps, FALSE);
+  mrb_profiler_opstat_free(ps);
+  mrb_profiler_pmu_close(ps);
+  mrb_profiler_sample_release(mrb, ps);
+  mrb_profiler_filter_free(mrb, ps);
+  mrb_profiler_result_free(mrb, &ps->result);
+  free(ps->stack);
+  for (i = 0; i < ps->fibers.capa; i++) {
+    free(fibers[i].stack);
+  }
+  mrb_profiler_tab_free(&ps->fibers);
+  for (i = 0; i < ps->natives.capa; i++) {
+    if (natives[i].irep) {
+      mrb_irep_decref(mrb, natives[i].irep);
+    }
+  }
+  mrb_profiler_tab_free(&ps->natives);
+  mrb_profiler_tab_free(&ps->classes);
+  mrb_iv_set(mrb, ps->module, PROF_CLASSES_SYM, mrb_nil_value());
+  mrb_profiler_state_free(ps);
 }
 
 //Map C methods onto ruby
 void
 mrb_mruby_profiler_gem_init(mrb_state* mrb) {
+  struct prof_state *ps;
   struct RObject *m;
+  struct RClass *snapshot;
+  const char *env;
 
-  //Preallocate results
-  result.irep_capa = 64;
-  result.irep_tab = (struct prof_irep**)
-    mrb_realloc(mrb, result.irep_tab,
-        result.irep_capa * sizeof(struct prof_irep *));
-  result.irep_num = 0;
+  mrb_profiler_clock_init();
+  ps = mrb_profiler_state_new(mrb);
 
   m = (struct RObject *)mrb_define_module(mrb, "Profiler");
-  prof_module = mrb_obj_value(m);
-  mrb->code_fetch_hook = prof_code_fetch_hook;
+  ps->module = mrb_obj_value(m);
+  mrb_iv_set(mrb, ps->module, PROF_CLASSES_SYM, mrb_ary_new(mrb));
   mrb_define_singleton_method(mrb, m, "get_inst_info",
       mrb_mruby_profiler_get_inst_info, MRB_ARGS_REQ(2));
   mrb_define_singleton_method(mrb, m, "get_irep_info",
       mrb_mruby_profiler_get_irep_info, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "irep_counters",
+      mrb_mruby_profiler_irep_counters, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "irep_lines",
+      mrb_mruby_profiler_irep_lines, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "node_key",
+      mrb_mruby_profiler_node_key, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "disasm",
+      mrb_mruby_profiler_disasm, MRB_ARGS_REQ(2));
   mrb_define_singleton_method(mrb, m, "irep_num",
       mrb_mruby_profiler_irep_num, MRB_ARGS_NONE());
   mrb_define_singleton_method(mrb, m, "ilen",
       mrb_mruby_profiler_ilen, MRB_ARGS_REQ(1));
   mrb_define_singleton_method(mrb, m, "read",
       mrb_mruby_profiler_read, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "mode",
+      mrb_mruby_profiler_mode, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "mode=",
+      mrb_mruby_profiler_set_mode, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "sample_interval",
+      mrb_mruby_profiler_sample_interval, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "sample_interval=",
+      mrb_mruby_profiler_set_sample_interval, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "track_alloc?",
+      mrb_mruby_profiler_track_alloc_p, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "track_alloc=",
+      mrb_mruby_profiler_set_track_alloc, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "flat?",
+      mrb_mruby_profiler_flat_p, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "flat=",
+      mrb_mruby_profiler_set_flat, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "opcode_stats?",
+      mrb_mruby_profiler_opcode_stats_p, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "opcode_stats=",
+      mrb_mruby_profiler_set_opcode_stats, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "opcode_counts",
+      mrb_mruby_profiler_opcode_counts, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "opcode_pairs",
+      mrb_mruby_profiler_opcode_pairs, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "latency_histograms?",
+      mrb_mruby_profiler_latency_histograms_p, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "latency_histograms=",
+      mrb_mruby_profiler_set_latency_histograms, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "latency_opcodes",
+      mrb_mruby_profiler_latency_opcodes, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "latency_opcodes=",
+      mrb_mruby_profiler_set_latency_opcodes, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "latency",
+      mrb_mruby_profiler_latency, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "perf_counters",
+      mrb_mruby_profiler_perf_counters, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "perf_counters=",
+      mrb_mruby_profiler_set_perf_counters, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "event_names",
+      mrb_mruby_profiler_event_names, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "overhead",
+      mrb_mruby_profiler_overhead, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "fiber_switches",
+      mrb_mruby_profiler_fiber_switches, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "clock",
+      mrb_mruby_profiler_clock, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "clock_resolution",
+      mrb_mruby_profiler_clock_resolution, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "start",
+      mrb_mruby_profiler_start, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "stop",
+      mrb_mruby_profiler_stop, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "running?",
+      mrb_mruby_profiler_running_p, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "reset",
+      mrb_mruby_profiler_reset, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "snapshot",
+      mrb_mruby_profiler_snapshot, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "dump",
+      mrb_mruby_profiler_dump, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "load",
+      mrb_mruby_profiler_load, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "merge_dumps",
+      mrb_mruby_profiler_merge_dumps, MRB_ARGS_ARG(1, 2));
+  mrb_define_singleton_method(mrb, m, "period",
+      mrb_mruby_profiler_period, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "continuous",
+      mrb_mruby_profiler_continuous, MRB_ARGS_ARG(1, 2));
+  mrb_define_singleton_method(mrb, m, "filter",
+      mrb_mruby_profiler_filter, MRB_ARGS_ARG(1, 2) | MRB_ARGS_BLOCK());
+  mrb_define_singleton_method(mrb, m, "filters",
+      mrb_mruby_profiler_filters, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "clear_filters",
+      mrb_mruby_profiler_clear_filters, MRB_ARGS_NONE());
+  mrb_define_singleton_method(mrb, m, "export_folded",
+      mrb_mruby_profiler_export_folded, MRB_ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, m, "export_speedscope",
+      mrb_mruby_profiler_export_speedscope, MRB_ARGS_REQ(1));
+
+  //Snapshots answer the same reports as the live profile
+  snapshot = mrb_define_class_under(mrb, (struct RClass *)m, "Snapshot",
+                                    mrb->object_class);
+  MRB_SET_INSTANCE_TT(snapshot, MRB_TT_DATA);
+  mrb_undef_class_method(mrb, snapshot, "new");
+  mrb_define_method(mrb, snapshot, "get_inst_info",
+      mrb_mruby_profiler_get_inst_info, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, snapshot, "get_irep_info",
+      mrb_mruby_profiler_get_irep_info, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, snapshot, "irep_counters",
+      mrb_mruby_profiler_irep_counters, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, snapshot, "irep_lines",
+      mrb_mruby_profiler_irep_lines, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, snapshot, "latency",
+      mrb_mruby_profiler_latency, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, snapshot, "node_key",
+      mrb_mruby_profiler_node_key, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, snapshot, "disasm",
+      mrb_mruby_profiler_disasm, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, snapshot, "irep_num",
+      mrb_mruby_profiler_irep_num, MRB_ARGS_NONE());
+  mrb_define_method(mrb, snapshot, "ilen",
+      mrb_mruby_profiler_ilen, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, snapshot, "read",
+      mrb_mruby_profiler_read, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, snapshot, "event_names",
+      mrb_mruby_profiler_event_names, MRB_ARGS_NONE());
+  mrb_define_method(mrb, snapshot, "overhead",
+      mrb_mruby_profiler_overhead, MRB_ARGS_NONE());
+  mrb_define_method(mrb, snapshot, "fiber_switches",
+      mrb_mruby_profiler_fiber_switches, MRB_ARGS_NONE());
+  mrb_define_method(mrb, snapshot, "period",
+      mrb_mruby_profiler_period, MRB_ARGS_NONE());
+  mrb_define_method(mrb, snapshot, "dump",
+      mrb_mruby_profiler_dump, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, snapshot, "export_folded",
+      mrb_mruby_profiler_export_folded, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, snapshot, "export_speedscope",
+      mrb_mruby_profiler_export_speedscope, MRB_ARGS_REQ(1));
+
+  //MRUBY_PROFILER_CALIBRATE=0 keeps the profiler's own time in the
+  //counters
+  env = getenv("MRUBY_PROFILER_CALIBRATE");
+  if (!env || strcmp(env, "0") != 0) {
+    prof_calibrate(mrb, ps);
+  }
+  //Calibration clears the result, the counters start from here
+  ps->result.wall_start = mrb_profiler_wall_usec();
+
+  //Initial mode can be chosen from the environment, since interpreter
+  //startup is profiled before any Ruby code can call Profiler.mode=
+  env = getenv("MRUBY_PROFILER_INTERVAL");
+  if (env && atoi(env) > 0) {
+    mrb_profiler_sample_set_interval(mrb, ps, atoi(env));
+  }
+  env = getenv("MRUBY_PROFILER_MODE");
+  if (env && strcmp(env, "sampled") == 0) {
+    prof_set_mode(mrb, ps, PROF_MODE_SAMPLED);
+  }
+  env = getenv("MRUBY_PROFILER_ALLOC");
+  if (env && strcmp(env, "1") == 0) {
+    prof_set_track_alloc(mrb, ps, TRUE);
+  }
+  env = getenv("MRUBY_PROFILER_FLAT");
+  if (env && strcmp(env, "1") == 0) {
+    ps->result.flat = TRUE;
+  }
+  env = getenv("MRUBY_PROFILER_OPCODES");
+  if (env && strcmp(env, "1") == 0) {
+    mrb_profiler_opstat_enable(mrb, ps, TRUE);
+  }
+  //MRUBY_PROFILER_LATENCY=1 records call durations,
+  //MRUBY_PROFILER_LATENCY_OPCODES=OP_SEND,OP_SENDB those of instructions
+  env = getenv("MRUBY_PROFILER_LATENCY");
+  if (env && strcmp(env, "1") == 0) {
+    ps->hist_on = TRUE;
+  }
+  env = getenv("MRUBY_PROFILER_LATENCY_OPCODES");
+  while (env && *env) {
+    size_t len = strcspn(env, ",");
+    char name[32];
+    int op = -1;
+
+    if (len < sizeof(name)) {
+      memcpy(name, env, len);
+      name[len] = '\0';
+      op = mrb_profiler_opcode_of(name);
+    }
+    if (op >= 0) {
+      ps->hist_op[op] = 1;
+      ps->hist_insn = TRUE;
+    }
+    else if (len > 0) {
+      fprintf(stderr, "mruby-profiler: unknown opcode %.*s\n", (int)len, env);
+    }
+    env += len + (env[len] == ',');
+  }
+  //MRUBY_PROFILER_COUNTERS=software skips the hardware counters
+  env = getenv("MRUBY_PROFILER_COUNTERS");
+  if (env && (strcmp(env, "1") == 0 || strcmp(env, "software") == 0)) {
+    mrb_profiler_pmu_open(mrb, ps, strcmp(env, "1") == 0);
+  }
+  //MRUBY_PROFILER_CONTINUOUS=prefix writes deltas from the start, every
+  //MRUBY_PROFILER_CONT_INTERVAL seconds keeping MRUBY_PROFILER_CONT_KEEP
+  //files
+  env = getenv("MRUBY_PROFILER_CONTINUOUS");
+  if (env && *env) {
+    const char *interval = getenv("MRUBY_PROFILER_CONT_INTERVAL");
+    const char *keep = getenv("MRUBY_PROFILER_CONT_KEEP");
+
+    mrb_profiler_cont_start(mrb, ps, env, interval ? atof(interval) : 60,
+                            keep && atoi(keep) > 0 ? atoi(keep) : 0);
+  }
+  //MRUBY_PROFILER_INCLUDE and MRUBY_PROFILER_EXCLUDE add filter rules,
+  //like "file:*/app/*,class:Net*"
+  env = getenv("MRUBY_PROFILER_INCLUDE");
+  if (env && *env) {
+    mrb_profiler_filter_parse(mrb, ps, FALSE, env);
+  }
+  env = getenv("MRUBY_PROFILER_EXCLUDE");
+  if (env && *env) {
+    mrb_profiler_filter_parse(mrb, ps, TRUE, env);
+  }
+  //MRUBY_PROFILER_AUTOSTART=0 leaves profiling to Profiler.start
+  env = getenv("MRUBY_PROFILER_AUTOSTART");
+  if (!env || strcmp(env, "0") != 0) {
+    mrb_profiler_start(mrb);
+  }
 }
 
 void
 mrb_mruby_profiler_gem_final(mrb_state* mrb) {
-  mrb_funcall(mrb, prof_module, "analyze", 0);
+  struct prof_state *ps = mrb_profiler_state(mrb);
+  const char *dump = getenv("MRUBY_PROFILER_DUMP");
+
+  mrb_profiler_stop(mrb);
+  //Continuous profiling leaves the reports to the deltas, the last of
+  //which is written here
+  if (ps->cont.prefix) {
+    mrb_profiler_cont_stop(mrb, ps);
+  }
+  //Nothing to report if profiling never ran
+  else if (ps->result.irep_num > 0 || ps->sampler.sample_num > 0) {
+    //MRUBY_PROFILER_DUMP leaves the reports to an offline mruby-profiler
+    if (dump && *dump) {
+      mrb_funcall(mrb, ps->module, "dump", 1, mrb_str_new_cstr(mrb, dump));
+    }
+    else {
+      mrb_funcall(mrb, ps->module, "analyze", 0);
+      if (ps->opstat && !mrb->exc) {
+        mrb_funcall(mrb, ps->module, "analyze_opcodes", 0);
+      }
+    }
+    if (mrb->exc) {
+      mrb_print_error(mrb);
+      mrb->exc = NULL;
+    }
+  }
+  prof_free(mrb, ps);
 }
@@ -0,0 +1,600 @@
+/* Profiler for ruby - definitions shared between profiler sources */
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "mruby.h"
+#include "mruby/irep.h"
+#include <time.h>
+
+//Allocations of one instruction
+struct prof_alloc {
+  uint64_t bytes; //Bytes requested from the allocator
+  uint32_t objs;  //Objects allocated
+};
+
+//Log-linear histogram of durations in clock ticks, see hist.c
+//
+//Durations below PROF_HIST_SUB ticks get a bucket each, each further power
+//of two is split into PROF_HIST_SUB buckets, so a bucket spans at most 1/8
+//of its values.
+#define PROF_HIST_SUB_BITS 3
+#define PROF_HIST_SUB      (1 << PROF_HIST_SUB_BITS)
+#define PROF_HIST_BUCKETS  ((64 - PROF_HIST_SUB_BITS + 1) * PROF_HIST_SUB)
+
+struct prof_hist {
+  uint64_t max;                      //Longest duration recorded
+  uint32_t count[PROF_HIST_BUCKETS]; //Durations recorded in each bucket
+};
+
+//Get the bucket of a duration
+static inline int
+prof_hist_bucket(uint64_t ticks)
+{
+  int e;
+
+  if (ticks < PROF_HIST_SUB) {
+    return (int)ticks;
+  }
+#if defined(__GNUC__)
+  e = 63 - __builtin_clzll(ticks);
+#else
+  for (e = PROF_HIST_SUB_BITS; ticks >> (e + 1); e++);
+#endif
+  return (e - PROF_HIST_SUB_BITS + 1) * PROF_HIST_SUB +
+         (int)((ticks >> (e - PROF_HIST_SUB_BITS)) & (PROF_HIST_SUB - 1));
+}
+
+//Record a duration
+static inline void
+prof_hist_record(struct prof_hist *h, uint64_t ticks)
+{
+  h->count[prof_hist_bucket(ticks)]++;
+  if (h->max < ticks) {
+    h->max = ticks;
+  }
+}
+
+//Class seen by the profiler, kept alive until the profiler is freed
+struct prof_class {
+  struct RClass *klass;     //Class or module implementing methods
+  const char *name;         //Name, resolved when first reported
+};
+
+struct prof_irep {
+  mrb_irep *irep;           //VM instructions
+  mrb_sym mid;              //Method name
+  const char *mname;        //Name of mid, resolved when first reported
+  struct prof_class *klass; //Class implementing method
+  uint64_t *time;           //Execution time of each instruction in clock
+                            //ticks [ilen]
+  uint32_t *num;            //Executions of each instruction [ilen]
+  struct prof_irep *owner;  //Node the instruction counters above and below
+                            //belong to, itself unless shared in flat mode
+  struct prof_alloc *alloc; //Allocations, NULL until tracked [ilen]
+  uint64_t *gc;             //Ticks of GC steps run by each instruction,
+                            //NULL until one is seen [ilen]
+  uint64_t *events;         //Performance counter deltas of each instruction,
+                            //NULL until counted [ilen * event_num]
+  struct prof_hist *hist;   //Durations of the activations, NULL until
+                            //recorded
+  struct prof_hist **insn_hist; //Durations of each instruction, NULL until
+                                //one is recorded [ilen], elements NULL
+                                //unless recorded
+
+  int child_num;            //Number of called methods
+  int child_capa;           //Child array capacity
+  struct prof_irep **child; //Children VM instructions/methods [child_num elements]
+
+  int *ccall_num;           //Number of calls to each child [child_num elements]
+  struct prof_irep *parent;
+  int child_idx;            //Index in the parent's child array
+  int no;                   //Index in the profile's irep_tab
+
+  uint32_t calls;           //Number of activations
+  uint64_t incl;            //Ticks spent in the method and its callees
+  uint64_t max;             //Ticks of the longest activation
+  int rec;                  //Number of ancestors running the same irep
+  int active;               //Activations on the shadow stack
+
+  int last_child;           //Most recently entered child, -1 if none
+  int *child_hash;          //Open addressing table of child index + 1 keyed
+                            //by irep, 0 for empty slots [child_capa * 2]
+};
+
+//Open addressing table of fixed size entries, see arena.c
+//
+//An entry starts with a pointer, NULL in empty slots only. The table is
+//kept at most half full.
+struct prof_tab {
+  void *ent;                   //Entries [capa]
+  uint32_t num;                //Entries used
+  uint32_t capa;               //Slots, a power of 2
+};
+
+//Hash of a used entry, the one its key is looked up with
+typedef uint32_t prof_tab_hash_f(const void *ent);
+
+//Whether a used entry is the one of key
+typedef mrb_bool prof_tab_match_f(const void *ent, const void *key);
+
+//How the entries of a table are sized, hashed and matched
+struct prof_tab_type {
+  size_t size;                 //Bytes of an entry
+  uint32_t init;               //Slots of a new table
+  prof_tab_hash_f *hash;
+  prof_tab_match_f *match;
+};
+
+//Whether an entry of a table is used
+#define PROF_TAB_USED(ent) (*(void * const *)(ent) != NULL)
+
+//Hash a pointer for the profiler's address keyed tables
+#define PROF_PTR_HASH(ptr) \
+  ((uint32_t)(((uintptr_t)(ptr) >> 3) * 2654435761u))
+
+//Bump allocator for profiler metadata, freed all at once
+struct prof_arena {
+  struct prof_arena_chunk *chunk; //Chunk being filled, linked to older ones
+  size_t total;                   //Bytes handed out
+  struct prof_tab strs;           //Interned strings
+};
+
+//Maximum number of performance counters read together
+#define PROF_EVENT_MAX 4
+
+struct prof_result {
+  struct prof_irep *irep_root; //First irep profiled
+  int irep_num;                //Number of ireps profiled
+  int irep_capa;               //Capacity of irep array
+  struct prof_irep **irep_tab; //Profiler results, one irep each
+  struct prof_arena arena;     //Storage of the nodes and their names
+  int event_num;               //Performance counters in the events arrays
+  const char *event_name[PROF_EVENT_MAX];
+  uint64_t hook_ticks;         //Calibrated overhead of a fetch, and of a
+  uint64_t call_ticks;         //fetch entering or leaving a method
+  uint64_t overhead;           //Ticks of overhead taken out of the counters
+  uint64_t switch_ticks;       //Ticks from the last instruction of a fiber
+  uint32_t switch_num;         //to the first one of the next, and switches
+  mrb_bool flat;               //Whether new nodes share the instruction
+                               //counters of their irep
+  struct prof_tab owners;      //Nodes owning the counters of each irep in
+                               //flat mode, keyed by irep
+  uint64_t wall_start;         //Wall clock microseconds the counters cover,
+  uint64_t wall_end;           //0 if unknown, wall_end 0 while still counting
+};
+
+//Code of the single instruction of the ireps standing for methods
+//implemented in C, an OP_NOP the compiler never emits alone
+#define PROF_NATIVE_CODE 0
+
+//Whether an irep stands for a method implemented in C. Its node counts
+//the calls that ran no Ruby code at its only instruction.
+#define PROF_NATIVE_P(irep) \
+  ((irep)->ilen == 1 && (irep)->iseq[0] == PROF_NATIVE_CODE)
+
+//Whether the instruction counters of a node are another node's. Reports
+//show them once, on the owner.
+#define PROF_SHARED(prof) ((prof)->owner != (prof))
+
+//Time sources for prof_curtime()
+enum prof_clock_kind {
+  PROF_CLOCK_TSC,       //x86 rdtsc
+  PROF_CLOCK_TSCP,      //x86 rdtscp, waits for preceding instructions
+  PROF_CLOCK_MONOTONIC, //clock_gettime(), raw monotonic clock if available
+};
+
+struct prof_clock {
+  enum prof_clock_kind kind;
+  const char *name;    //Name reported by Profiler.clock
+  clockid_t id;        //Clock read for PROF_CLOCK_MONOTONIC
+  double sec_per_tick; //Length of one tick in seconds
+  double resolution;   //Smallest observed step between reads in seconds
+};
+
+extern struct prof_clock mrb_profiler_clock;
+
+//Get current time in clock ticks
+static inline uint64_t
+prof_curtime(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t lo;
+  uint32_t hi;
+
+  switch (mrb_profiler_clock.kind) {
+  case PROF_CLOCK_TSC:
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+  case PROF_CLOCK_TSCP:
+    __asm__ volatile ("rdtscp" : "=a"(lo), "=d"(hi) : : "%ecx");
+    return ((uint64_t)hi << 32) | lo;
+  default:
+    break;
+  }
+#endif
+  {
+    struct timespec ts;
+
+    clock_gettime(mrb_profiler_clock.id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+  }
+}
+
+//Convert clock ticks to seconds
+#define PROF_TICK2SEC(t) ((double)(t) * mrb_profiler_clock.sec_per_tick)
+//Convert seconds to clock ticks
+#define PROF_SEC2TICK(s) ((uint64_t)((s) / mrb_profiler_clock.sec_per_tick))
+
+//How the profiler observes the VM
+enum prof_mode {
+  PROF_MODE_EXACT,   //Time and count every fetched VM instruction
+  PROF_MODE_SAMPLED, //Record the VM position on profiling timer ticks
+};
+
+//Maximum number of frames recorded for a call chain
+#define PROF_MAX_CALLCHAIN 256
+
+//Levels of recursion of a method kept as separate call tree nodes, deeper
+//calls fold into the deepest of them
+#define PROF_MAX_RECURSION 4
+
+//One method activation of a call chain, outermost first
+struct prof_frame {
+  mrb_irep *irep;           //VM instructions
+  mrb_sym mid;              //Method name
+  struct prof_class *klass; //Class implementing method, rooted when the
+                            //frame is recorded
+};
+
+//Sampler of one VM, see sample.c
+struct prof_sampler {
+  struct prof_sample *samples; //Samples waiting to be folded into the tree
+  int sample_num;
+  struct prof_frame *frames;   //Call chains of those samples
+  int frame_num;
+  mrb_int interval;            //Timer interval in microseconds of CPU time
+  int running;                 //Whether the timer is armed
+#if defined(__linux__)
+  timer_t timer;               //Timer signaling the thread which started it
+  int use_timer;               //Whether timer was created, else setitimer()
+#endif
+};
+
+//Caller of the current method on the shadow stack
+struct prof_call {
+  struct prof_irep *node;      //Calling method
+  uint64_t enter;              //Time the caller was entered at
+  int ci_depth;                //VM call depth of the caller
+};
+
+//Irep standing for a method implemented in C
+struct prof_native {
+  mrb_irep *irep;              //Irep of one OP_NOP referenced by the table,
+                               //NULL for empty slots
+  struct RClass *klass;        //Class implementing the method
+  mrb_sym mid;                 //Method name
+};
+
+//Shadow stack of a fiber switched away from
+struct prof_fiber {
+  struct mrb_context *c;       //Context of the fiber, NULL for empty slots
+  struct prof_irep *current;   //Method the fiber runs, NULL if none saved
+  int ci_depth;                //VM call depth of that method
+  struct prof_call *stack;     //Its callers, or a spare buffer
+  int stack_depth;
+  int stack_capa;
+  mrb_code *old_pc;            //Instruction that switched away
+};
+
+//Allocator wrapped by the profiler's, passed to it as user data
+struct prof_allocf_link {
+  mrb_allocf allocf;
+  void *ud;
+};
+
+//Performance counters of one thread, see pmu.c
+struct prof_pmu {
+  int num;                      //Counters open, 0 when off
+  int fd[PROF_EVENT_MAX];       //Event group, the first is the leader
+  void *page[PROF_EVENT_MAX];   //Pages mapped for rdpmc, NULL if unmapped
+  mrb_bool rdpmc;               //Whether every counter maps a page
+  uint64_t old[PROF_EVENT_MAX]; //Values when the last instruction began
+};
+
+//Number of opcodes, GET_OPCODE takes 7 bits
+#define PROF_OPCODES 128
+
+//Whole run statistics of the opcodes executed, see opstat.c
+struct prof_opstat {
+  uint64_t num[PROF_OPCODES];                //Executions of each opcode
+  uint64_t time[PROF_OPCODES];               //Ticks of each opcode
+  uint64_t pair[PROF_OPCODES][PROF_OPCODES]; //Executions of each opcode
+                                             //followed by each other
+};
+
+//Continuous profiling, writing the counters since the previous delta to a
+//new file at regular intervals
+//RITE binary of an irep alone, kept as ireps never change
+struct prof_rite {
+  mrb_irep *irep;              //Irep referenced by the cache, NULL for empty
+                               //slots
+  uint8_t *bin;                //From mrb_dump_irep
+  size_t size;
+};
+
+struct prof_cont {
+  volatile int request;        //Set by the writer thread when a delta is due,
+                               //the VM thread takes it at the next fetch
+  char *prefix;                //Files are prefix.NNNNNN.prof, NULL when off
+  uint64_t interval;           //Milliseconds between deltas, 0 for signals only
+  uint64_t due;                //Monotonic milliseconds of the next delta
+  uint32_t keep;               //Files kept, 0 to keep them all
+  uint32_t seq;                //Sequence number of the next file
+  struct prof_tab rite;        //RITE binaries of the ireps dumped so far,
+                               //keyed by irep
+};
+
+//What a filter rule matches
+enum prof_filter_kind {
+  PROF_FILTER_FILE,            //Source file of the code, glob
+  PROF_FILTER_CLASS,           //Class implementing the method, glob
+  PROF_FILTER_METHOD,          //Method name, glob
+  PROF_FILTER_PROC,            //Ruby predicate called with the three above
+};
+
+struct prof_filter_rule {
+  mrb_bool exclude;            //Whether matching code is left out
+  enum prof_filter_kind kind;
+  char *pattern;               //Glob, NULL for a predicate
+};
+
+//Whether an irep is profiled, as decided by the rules
+struct prof_filter_ent {
+  mrb_irep *irep;              //Referenced by the table, NULL for empty slots
+  mrb_bool on;
+};
+
+//Selective profiling, see filter.c
+//
+//Code left out runs as part of the call instruction of the nearest
+//profiled caller, which gets its time.
+struct prof_filter {
+  struct prof_filter_rule *rules; //Rules in the order added
+  int num;
+  int capa;
+  mrb_bool includes;           //Whether a rule includes, leaving out code
+                               //no rule includes
+  struct prof_tab tab;         //Decisions taken, keyed by irep
+  mrb_irep *last;              //Irep of the last decision looked up by the
+  mrb_bool last_on;            //hook, and that decision
+  mrb_callinfo *ci;            //Frame and proc of the activation of code
+  struct RProc *proc;          //left out that the hook last charged to a
+                               //caller
+  mrb_code *pc;                //Last instruction fetched in it
+  mrb_bool folded;             //Whether the last instruction charged was a
+                               //call already counted, running code left out
+};
+
+//Profiler state of one VM
+//
+//Each mrb_state gets its own, so VMs running on different threads never
+//share a call tree or counters.
+struct prof_state {
+  mrb_state *mrb;              //VM profiled
+  struct prof_state *next;     //Next registered state
+  struct prof_result result;   //Call tree
+  struct prof_irep *current;   //Current method, NULL to resync
+  uint64_t enter;              //Time the current method was entered at
+  int ci_depth;                //VM call depth of the current method
+  struct prof_call *stack;     //Callers of the current method, outermost first
+  int stack_depth;
+  int stack_capa;
+  mrb_code *old_pc;            //Last profiled instruction
+  uint64_t old_time;           //Time that last instruction was fetched at
+  uint64_t overhead;           //Overhead to take out of that instruction
+  struct mrb_context *ctx;     //Fiber of the shadow stack above
+  struct prof_tab fibers;      //Shadow stacks of the other fibers, keyed
+                               //by context
+  struct prof_tab natives;     //Ireps of C methods, keyed by class and
+                               //method name
+  mrb_value module;            //Profiler module
+  enum prof_mode mode;         //How the VM is observed
+  mrb_bool running;            //Whether the hook is installed
+  struct prof_tab classes;     //Classes referenced by nodes, keyed by class
+  uint32_t class_rooted;       //Slots of Profiler's classes array used
+  struct prof_sampler sampler;
+  mrb_bool track_alloc;        //Whether allocations are tracked
+  struct prof_allocf_link *alloc_link; //Allocator wrapped while tracking,
+                                       //NULL if the wrapper is unhooked
+  size_t old_live;             //Live objects when the last instruction began
+  size_t gc_threshold;         //GC threshold and state when the last
+  int gc_state;                //instruction began
+  struct prof_opstat *opstat;  //Opcode statistics, NULL until enabled
+  mrb_bool opstat_on;          //Whether they are collected
+  struct prof_pmu pmu;         //Performance counters
+  struct prof_cont cont;       //Continuous profiling
+  struct prof_filter filter;   //Code profiled
+  mrb_bool hist_on;            //Whether call durations are recorded
+  mrb_bool hist_insn;          //Whether instruction durations are recorded
+  uint8_t hist_op[PROF_OPCODES]; //Opcodes of the instructions recorded
+};
+
+//Thread local storage
+#if defined(_MSC_VER)
+#define PROF_TLS __declspec(thread)
+#else
+#define PROF_TLS __thread
+#endif
+
+//Last state looked up by the running thread
+struct prof_state_cache {
+  mrb_state *mrb;
+  struct prof_state *state;
+  unsigned int gen;            //mrb_profiler_state_gen when looked up
+};
+
+//arena.c
+void *mrb_profiler_arena_alloc(mrb_state *mrb, struct prof_arena *arena,
+                               size_t size);
+const char *mrb_profiler_arena_intern(mrb_state *mrb,
+                                      struct prof_arena *arena,
+                                      const char *str);
+void mrb_profiler_arena_free(struct prof_arena *arena);
+void *mrb_profiler_tab_get(mrb_state *mrb, struct prof_tab *tab,
+                           const struct prof_tab_type *type, const void *key,
+                           uint32_t hash);
+void mrb_profiler_tab_free(struct prof_tab *tab);
+
+//clock.c
+void mrb_profiler_clock_init(void);
+uint64_t mrb_profiler_wall_usec(void);
+
+//cont.c
+void mrb_profiler_cont_start(mrb_state *mrb, struct prof_state *ps,
+                             const char *prefix, double interval,
+                             uint32_t keep);
+void mrb_profiler_cont_stop(mrb_state *mrb, struct prof_state *ps);
+void mrb_profiler_cont_flush(mrb_state *mrb, struct prof_state *ps);
+
+//filter.c
+mrb_bool mrb_profiler_filter_pass(mrb_state *mrb, struct prof_state *ps,
+                                  mrb_irep *irep, struct RClass *klass,
+                                  mrb_sym mid);
+void mrb_profiler_filter_add(mrb_state *mrb, struct prof_state *ps,
+                             mrb_bool exclude, enum prof_filter_kind kind,
+                             const char *pattern, mrb_value proc);
+void mrb_profiler_filter_parse(mrb_state *mrb, struct prof_state *ps,
+                               mrb_bool exclude, const char *spec);
+void mrb_profiler_filter_clear(mrb_state *mrb, struct prof_state *ps);
+void mrb_profiler_filter_free(mrb_state *mrb, struct prof_state *ps);
+mrb_value mrb_profiler_filter_list(mrb_state *mrb, struct prof_state *ps);
+
+//state.c
+extern PROF_TLS struct prof_state_cache mrb_profiler_state_cache;
+extern volatile unsigned int mrb_profiler_state_gen;
+
+struct prof_state *mrb_profiler_state_new(mrb_state *mrb);
+void mrb_profiler_state_free(struct prof_state *ps);
+struct prof_state *mrb_profiler_state_lookup(mrb_state *mrb);
+void mrb_profiler_state_each(void (*fn)(struct prof_state *, void *),
+                             void *ud);
+
+//Get the profiler state of a VM, NULL once the profiler is finalized
+//
+//The state last looked up by the thread is cached, so the hook pays two
+//compares when the thread keeps running the same VM.
+static inline struct prof_state *
+mrb_profiler_state(mrb_state *mrb)
+{
+  struct prof_state_cache *cache = &mrb_profiler_state_cache;
+
+  if (cache->mrb == mrb && cache->gen == mrb_profiler_state_gen) {
+    return cache->state;
+  }
+  return mrb_profiler_state_lookup(mrb);
+}
+
+//profiler.c
+struct prof_irep *mrb_profiler_alloc_prof_irep(mrb_state *mrb,
+                                               struct prof_result *pr,
+                                               struct mrb_irep *irep,
+                                               struct prof_irep *parent,
+                                               mrb_sym mid,
+                                               struct prof_class *klass);
+struct prof_irep *mrb_profiler_add_child(mrb_state *mrb,
+                                         struct prof_result *pr,
+                                         struct prof_irep *parent,
+                                         struct mrb_irep *irep, mrb_sym mid,
+                                         struct prof_class *klass);
+void mrb_profiler_result_free(mrb_state *mrb, struct prof_result *pr);
+struct prof_alloc *mrb_profiler_alloc_counters(mrb_state *mrb,
+                                               struct prof_result *pr,
+                                               struct prof_irep *prof);
+uint64_t *mrb_profiler_gc_counters(mrb_state *mrb, struct prof_result *pr,
+                                   struct prof_irep *prof);
+uint64_t *mrb_profiler_event_counters(mrb_state *mrb, struct prof_result *pr,
+                                      struct prof_irep *prof);
+struct prof_hist *mrb_profiler_call_hist(mrb_state *mrb,
+                                         struct prof_result *pr,
+                                         struct prof_irep *prof);
+struct prof_hist *mrb_profiler_insn_hist(mrb_state *mrb,
+                                         struct prof_result *pr,
+                                         struct prof_irep *prof, int off);
+const char *mrb_profiler_irep_mname(mrb_state *mrb, struct prof_irep *prof);
+const char *mrb_profiler_irep_klass(mrb_state *mrb, struct prof_irep *prof);
+struct prof_irep *mrb_profiler_get_child(mrb_state *mrb,
+                                         struct prof_state *ps,
+                                         struct prof_irep *parent,
+                                         const struct prof_frame *frame);
+int mrb_profiler_callchain(mrb_state *mrb, struct prof_state *ps,
+                           struct prof_frame *frames, int capa,
+                           mrb_code **pc);
+struct prof_irep *mrb_profiler_callchain_node(mrb_state *mrb,
+                                              struct prof_state *ps,
+                                              const struct prof_frame *frames,
+                                              int nframes);
+
+//snapshot.c
+mrb_value mrb_profiler_snapshot_alloc(mrb_state *mrb, struct RClass *klass,
+                                      struct prof_result **resp);
+struct prof_result *mrb_profiler_snapshot_result(mrb_state *mrb,
+                                                 mrb_value self);
+mrb_value mrb_profiler_snapshot_new(mrb_state *mrb, struct RClass *klass,
+                                    struct prof_result *src);
+mrb_value mrb_profiler_snapshot_merge(mrb_state *mrb, struct RClass *klass,
+                                      mrb_state **srcs, int nsrc);
+mrb_value mrb_profiler_snapshot_merge_dumps(mrb_state *mrb,
+                                            struct RClass *klass,
+                                            mrb_value paths, uint64_t from,
+                                            uint64_t to);
+
+//dump.c
+mrb_value mrb_profiler_dump_build(mrb_state *mrb, struct prof_result *pr,
+                                  struct prof_tab *rite);
+void mrb_profiler_dump_rite_free(mrb_state *mrb, struct prof_tab *rite);
+void mrb_profiler_dump_result(mrb_state *mrb, struct prof_result *pr,
+                              const char *path);
+mrb_value mrb_profiler_load_result(mrb_state *mrb, struct RClass *klass,
+                                   const char *path);
+
+//export.c
+void mrb_profiler_export_folded(mrb_state *mrb, struct prof_result *pr,
+                                const char *path);
+void mrb_profiler_export_speedscope(mrb_state *mrb, struct prof_result *pr,
+                                    const char *path);
+
+//hist.c
+uint64_t mrb_profiler_hist_count(const struct prof_hist *h);
+uint64_t mrb_profiler_hist_value(const struct prof_hist *h, double q);
+void mrb_profiler_hist_add(struct prof_hist *to, const struct prof_hist *from,
+                           double scale);
+mrb_value mrb_profiler_hist_summary(mrb_state *mrb,
+                                    const struct prof_hist *h);
+
+//opstat.c
+int mrb_profiler_opcode_of(const char *name);
+mrb_value mrb_profiler_opcode_name(mrb_state *mrb, int op);
+void mrb_profiler_opstat_enable(mrb_state *mrb, struct prof_state *ps,
+                                mrb_bool on);
+void mrb_profiler_opstat_reset(struct prof_state *ps);
+void mrb_profiler_opstat_free(struct prof_state *ps);
+mrb_value mrb_profiler_opstat_counts(mrb_state *mrb, struct prof_state *ps);
+mrb_value mrb_profiler_opstat_pairs(mrb_state *mrb, struct prof_state *ps);
+
+//pmu.c
+int mrb_profiler_pmu_open(mrb_state *mrb, struct prof_state *ps,
+                          mrb_bool hardware);
+void mrb_profiler_pmu_close(struct prof_state *ps);
+void mrb_profiler_pmu_read(struct prof_pmu *pmu, uint64_t *val);
+
+//sample.c
+void mrb_profiler_sample_hook(struct mrb_state *mrb, struct mrb_irep *irep,
+                              mrb_code *pc, mrb_value *regs);
+void mrb_profiler_sample_start(mrb_state *mrb, struct prof_state *ps);
+void mrb_profiler_sample_stop(mrb_state *mrb, struct prof_state *ps);
+void mrb_profiler_sample_flush(mrb_state *mrb, struct prof_state *ps);
+void mrb_profiler_sample_release(mrb_state *mrb, struct prof_state *ps);
+void mrb_profiler_sample_set_interval(mrb_state *mrb, struct prof_state *ps,
+                                      mrb_int usec);
+
+#endif
@@ -0,0 +1,286 @@
+/* Profiler for ruby - timer driven sampling */
+#include "mruby.h"
+#include "mruby/irep.h"
+#include "profiler.h"
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+//Number of samples buffered before they are folded into the call tree
+#define PROF_SAMPLE_CAPA 4096
+//Number of frames buffered for the samples' call chains
+#define PROF_SAMPLE_FRAME_CAPA (PROF_SAMPLE_CAPA * 16)
+
+#if defined(__linux__) && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+struct prof_sample {
+  uint32_t frame; //Index of the outermost frame in the frame buffer
+  uint32_t depth; //Number of frames
+  uint32_t off;   //Instruction offset in the innermost frame
+};
+
+//Set by the timer signal, consumed by the next instruction the signaled
+//thread fetches
+static PROF_TLS volatile sig_atomic_t sample_pending = 0;
+//Number of running samplers sharing the SIGPROF handler
+static int sample_users = 0;
+static pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+//Signal disposition replaced by the sampler
+static struct sigaction sample_oldact;
+
+//SIGPROF handler, only flags the VM since it can't be touched here
+static void
+prof_sample_signal(int sig)
+{
+  (void) sig;
+  sample_pending = 1;
+}
+
+//Arm or disarm the profiling timer of a sampler
+//
+//Arguments:
+// - sp:   sampler
+// - usec: Interval in microseconds, 0 to disarm
+static void
+prof_sample_settimer(struct prof_sampler *sp, mrb_int usec)
+{
+  time_t sec  = (time_t)(usec / 1000000);
+  long   nsec = (long)(usec % 1000000) * 1000;
+
+#if defined(__linux__)
+  if (sp->use_timer) {
+    struct itimerspec its;
+
+    its.it_interval.tv_sec  = sec;
+    its.it_interval.tv_nsec = nsec;
+    its.it_value = its.it_interval;
+    timer_settime(sp->timer, 0, &its, NULL);
+    return;
+  }
+#else
+  (void) sp;
+#endif
+  {
+    struct itimerval itv;
+
+    itv.it_interval.tv_sec  = sec;
+    itv.it_interval.tv_usec = nsec / 1000;
+    itv.it_value = itv.it_interval;
+    setitimer(ITIMER_PROF, &itv, NULL);
+  }
+}
+
+//Install the SIGPROF handler and start the profiling timer of a VM
+//
+//On Linux the timer counts the CPU time of the calling thread and signals
+//that thread only, so VMs running on different threads sample
+//independently. Elsewhere the process wide setitimer() timer is shared.
+void
+mrb_profiler_sample_start(mrb_state *mrb, struct prof_state *ps)
+{
+  struct prof_sampler *sp = &ps->sampler;
+
+  if (sp->running) {
+    return;
+  }
+
+  //Preallocate the sample buffers, nothing is allocated per tick
+  if (!sp->samples) {
+    sp->samples = (struct prof_sample *)
+      mrb_profiler_arena_alloc(mrb, &ps->result.arena,
+                               PROF_SAMPLE_CAPA * sizeof(struct prof_sample));
+    sp->frames = (struct prof_frame *)
+      mrb_profiler_arena_alloc(mrb, &ps->result.arena,
+                               PROF_SAMPLE_FRAME_CAPA * sizeof(struct prof_frame));
+  }
+
+  pthread_mutex_lock(&sample_lock);
+  if (sample_users++ == 0) {
+    struct sigaction act;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = prof_sample_signal;
+    act.sa_flags   = SA_RESTART;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGPROF, &act, &sample_oldact);
+  }
+  pthread_mutex_unlock(&sample_lock);
+
+#if defined(__linux__)
+  {
+    struct sigevent sev;
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo  = SIGPROF;
+    sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+    //Fall back on setitimer() if POSIX timers are unavailable
+    sp->use_timer =
+      timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &sp->timer) == 0;
+  }
+#endif
+
+  sample_pending = 0;
+  prof_sample_settimer(sp, sp->interval);
+  sp->running = 1;
+}
+
+//Stop the profiling timer of a VM, restoring the previous SIGPROF handler
+//once no VM samples
+void
+mrb_profiler_sample_stop(mrb_state *mrb, struct prof_state *ps)
+{
+  struct prof_sampler *sp = &ps->sampler;
+  (void) mrb;
+
+  if (!sp->running) {
+    return;
+  }
+
+  prof_sample_settimer(sp, 0);
+#if defined(__linux__)
+  if (sp->use_timer) {
+    timer_delete(sp->timer);
+    sp->use_timer = 0;
+  }
+#endif
+  pthread_mutex_lock(&sample_lock);
+  if (--sample_users == 0) {
+    sigaction(SIGPROF, &sample_oldact, NULL);
+  }
+  pthread_mutex_unlock(&sample_lock);
+  sample_pending = 0;
+  sp->running = 0;
+}
+
+//Stop sampling and drop the buffers ahead of freeing the profiler arena
+void
+mrb_profiler_sample_release(mrb_state *mrb, struct prof_state *ps)
+{
+  mrb_profiler_sample_stop(mrb, ps);
+  mrb_profiler_sample_flush(mrb, ps);
+  ps->sampler.samples = NULL;
+  ps->sampler.frames = NULL;
+}
+
+//Change the sampling interval, rearming the timer if it is running
+void
+mrb_profiler_sample_set_interval(mrb_state *mrb, struct prof_state *ps,
+                                 mrb_int usec)
+{
+  struct prof_sampler *sp = &ps->sampler;
+
+  //Samples taken so far weigh the interval they were taken at
+  mrb_profiler_sample_flush(mrb, ps);
+  sp->interval = usec;
+  if (sp->running) {
+    prof_sample_settimer(sp, sp->interval);
+  }
+}
+
+//Fold buffered samples into the call tree
+//
+//Each sample is charged as one execution of its innermost instruction
+//taking a whole sampling interval. Calls to a child count the samples
+//taken below it.
+void
+mrb_profiler_sample_flush(mrb_state *mrb, struct prof_state *ps)
+{
+  struct prof_sampler *sp = &ps->sampler;
+  uint64_t weight = PROF_SEC2TICK((double)sp->interval * 1e-6);
+  int i;
+  int j;
+
+  for (i = 0; i < sp->sample_num; i++) {
+    struct prof_sample *s = &sp->samples[i];
+    struct prof_frame *frames = &sp->frames[s->frame];
+    struct prof_irep *node;
+    struct prof_irep *up;
+
+    node = mrb_profiler_callchain_node(mrb, ps, frames, s->depth);
+    node->time[s->off] += weight;
+    node->num[s->off]++;
+
+    //A sample is inclusive time of every frame on the chain
+    for (up = node; up; up = up->parent) {
+      up->incl += weight;
+    }
+
+    //Nodes hold their own reference now
+    for (j = 0; j < (int)s->depth; j++) {
+      mrb_irep_decref(mrb, frames[j].irep);
+    }
+  }
+  sp->sample_num = 0;
+  sp->frame_num = 0;
+}
+
+//VM Execution Hook used in sampled mode
+//
+//Costs a single flag test per instruction until the timer fires; the next
+//fetched instruction then records its position and call chain.
+//
+//Arguments:
+// - mrb: mruby state
+// - irep: current instruction context
+// - pc:   current VM instruction
+// - regs: current VM registers (unused)
+void
+mrb_profiler_sample_hook(struct mrb_state *mrb,
+                         struct mrb_irep *irep,
+                         mrb_code *pc,
+                         mrb_value *regs)
+{
+  struct prof_state *ps;
+  struct prof_sampler *sp;
+  struct prof_sample *s;
+  int i;
+  (void) regs;
+
+  if (!sample_pending) {
+    return;
+  }
+  if (irep->ilen == 1) {
+    /* CALL ISEQ, take the sample in the called method instead */
+    return;
+  }
+  sample_pending = 0;
+
+  ps = mrb_profiler_state(mrb);
+  if (ps->cont.request) {
+    //A delta of continuous profiling is due, the sample goes to the next
+    mrb_profiler_cont_flush(mrb, ps);
+  }
+  sp = &ps->sampler;
+  if (sp->sample_num == PROF_SAMPLE_CAPA ||
+      PROF_SAMPLE_FRAME_CAPA - sp->frame_num < PROF_MAX_CALLCHAIN) {
+    mrb_profiler_sample_flush(mrb, ps);
+  }
+
+  s = &sp->samples[sp->sample_num];
+  s->frame = sp->frame_num;
+  s->depth = mrb_profiler_callchain(mrb, ps, &sp->frames[sp->frame_num],
+                                    PROF_MAX_CALLCHAIN, &pc);
+  if (s->depth == 0) {
+    return;
+  }
+  //Code the filters leave out is sampled at its call in the innermost
+  //frame kept
+  s->off = pc - sp->frames[sp->frame_num + s->depth - 1].irep->iseq;
+
+  //Keep the ireps alive until the sample is folded into the tree, the
+  //classes were rooted when the frames were recorded
+  for (i = 0; i < (int)s->depth; i++) {
+    sp->frames[sp->frame_num + i].irep->refcnt++;
+  }
+  sp->frame_num += s->depth;
+  sp->sample_num++;
+}
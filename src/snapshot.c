@@ -0,0 +1,599 @@
+/* Profiler for ruby - frozen copies of the profile */
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/irep.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/dump.h"
+#include "mruby/string.h"
+#include "profiler.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void
+prof_snapshot_free(mrb_state *mrb, void *p)
+{
+  struct prof_result *res = (struct prof_result *)p;
+
+  mrb_profiler_result_free(mrb, res);
+  free(res);
+}
+
+static const struct mrb_data_type prof_snapshot_type = {
+  "Profiler::Snapshot", prof_snapshot_free,
+};
+
+//Get the call tree held by a Profiler::Snapshot
+struct prof_result *
+mrb_profiler_snapshot_result(mrb_state *mrb, mrb_value self)
+{
+  struct prof_result *res = (struct prof_result *)
+    mrb_data_get_ptr(mrb, self, &prof_snapshot_type);
+
+  if (!res) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "uninitialized profiler snapshot");
+  }
+  return res;
+}
+
+//Allocate an empty Profiler::Snapshot
+mrb_value
+mrb_profiler_snapshot_alloc(mrb_state *mrb, struct RClass *klass,
+                            struct prof_result **resp)
+{
+  struct RData *data;
+  struct prof_result *res;
+
+  data = mrb_data_object_alloc(mrb, klass, NULL, &prof_snapshot_type);
+  res = (struct prof_result *)calloc(1, sizeof(struct prof_result));
+  if (!res) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+  }
+  data->data = res;
+  *resp = res;
+
+  return mrb_obj_value(data);
+}
+
+//Copy a call tree into a new Profiler::Snapshot
+//
+//Names are resolved while copying, so a snapshot doesn't depend on the
+//live profile and can outlive a reset. Copied nodes can't take new
+//children.
+//
+//Arguments:
+// - mrb:   mruby state
+// - klass: Profiler::Snapshot
+// - src:   call tree to copy
+mrb_value
+mrb_profiler_snapshot_new(mrb_state *mrb, struct RClass *klass,
+                          struct prof_result *src)
+{
+  mrb_value snap;
+  struct prof_result *res;
+  struct prof_arena *arena;
+  struct prof_irep **tab;
+  int i;
+  int j;
+
+  snap = mrb_profiler_snapshot_alloc(mrb, klass, &res);
+  arena = &res->arena;
+
+  tab = (struct prof_irep **)calloc(src->irep_num + 1, sizeof(*tab));
+  if (!tab) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+  }
+  res->irep_tab = tab;
+  res->irep_capa = src->irep_num + 1;
+  res->event_num = src->event_num;
+  for (i = 0; i < src->event_num; i++) {
+    res->event_name[i] =
+      mrb_profiler_arena_intern(mrb, arena, src->event_name[i]);
+  }
+  res->hook_ticks = src->hook_ticks;
+  res->call_ticks = src->call_ticks;
+  res->overhead = src->overhead;
+  res->switch_ticks = src->switch_ticks;
+  res->switch_num = src->switch_num;
+  res->wall_start = src->wall_start;
+  res->wall_end = src->wall_end ? src->wall_end : mrb_profiler_wall_usec();
+  for (i = 0; i < src->irep_num; i++) {
+    tab[i] = (struct prof_irep *)
+      mrb_profiler_arena_alloc(mrb, arena, sizeof(struct prof_irep));
+  }
+
+  for (i = 0; i < src->irep_num; i++) {
+    struct prof_irep *from = src->irep_tab[i];
+    struct prof_irep *to = tab[i];
+    size_t ilen = from->irep->ilen;
+    int nchild = from->child_num;
+
+    *to = *from;
+    to->mname = mrb_profiler_arena_intern(mrb, arena,
+                                          mrb_profiler_irep_mname(mrb, from));
+    to->klass = (struct prof_class *)
+      mrb_profiler_arena_alloc(mrb, arena, sizeof(struct prof_class));
+    to->klass->name = mrb_profiler_arena_intern(mrb, arena,
+                                          mrb_profiler_irep_klass(mrb, from));
+    to->parent = from->parent ? tab[from->parent->no] : NULL;
+
+    //Counters shared in flat mode stay shared, their owner comes first
+    to->owner = tab[from->owner->no];
+    if (PROF_SHARED(from)) {
+      to->time = to->owner->time;
+      to->num = to->owner->num;
+      to->alloc = to->owner->alloc;
+      to->gc = to->owner->gc;
+      to->events = to->owner->events;
+      to->insn_hist = to->owner->insn_hist;
+    }
+    else {
+      to->time = (uint64_t *)
+        mrb_profiler_arena_alloc(mrb, arena, ilen * sizeof(uint64_t));
+      memcpy(to->time, from->time, ilen * sizeof(uint64_t));
+      to->num = (uint32_t *)
+        mrb_profiler_arena_alloc(mrb, arena, ilen * sizeof(uint32_t));
+      memcpy(to->num, from->num, ilen * sizeof(uint32_t));
+    }
+    if (from->alloc && !PROF_SHARED(from)) {
+      size_t allocsize = ilen * sizeof(struct prof_alloc);
+
+      to->alloc = (struct prof_alloc *)
+        mrb_profiler_arena_alloc(mrb, arena, allocsize);
+      memcpy(to->alloc, from->alloc, allocsize);
+    }
+    if (from->gc && !PROF_SHARED(from)) {
+      size_t gcsize = ilen * sizeof(uint64_t);
+
+      to->gc = (uint64_t *)mrb_profiler_arena_alloc(mrb, arena, gcsize);
+      memcpy(to->gc, from->gc, gcsize);
+    }
+    if (from->events && !PROF_SHARED(from)) {
+      size_t evsize = ilen * src->event_num * sizeof(uint64_t);
+
+      to->events = (uint64_t *)mrb_profiler_arena_alloc(mrb, arena, evsize);
+      memcpy(to->events, from->events, evsize);
+    }
+    if (from->hist) {
+      to->hist = (struct prof_hist *)
+        mrb_profiler_arena_alloc(mrb, arena, sizeof(struct prof_hist));
+      memcpy(to->hist, from->hist, sizeof(struct prof_hist));
+    }
+    if (from->insn_hist && !PROF_SHARED(from)) {
+      to->insn_hist = (struct prof_hist **)
+        mrb_profiler_arena_alloc(mrb, arena, ilen * sizeof(*to->insn_hist));
+      for (j = 0; j < (int)ilen; j++) {
+        if (from->insn_hist[j]) {
+          to->insn_hist[j] = (struct prof_hist *)
+            mrb_profiler_arena_alloc(mrb, arena, sizeof(struct prof_hist));
+          memcpy(to->insn_hist[j], from->insn_hist[j],
+                 sizeof(struct prof_hist));
+        }
+      }
+    }
+
+    to->child_capa = nchild;
+    to->child = (struct prof_irep **)
+      mrb_profiler_arena_alloc(mrb, arena, (nchild + 1) * sizeof(*to->child));
+    to->ccall_num = (int *)
+      mrb_profiler_arena_alloc(mrb, arena, (nchild + 1) * sizeof(int));
+    for (j = 0; j < nchild; j++) {
+      to->child[j] = tab[from->child[j]->no];
+      to->ccall_num[j] = from->ccall_num[j];
+    }
+    to->last_child = -1;
+    to->child_hash = NULL;
+
+    //Released by prof_snapshot_free
+    to->irep->refcnt++;
+    res->irep_num = i + 1;
+  }
+
+  res->irep_root = src->irep_root ? tab[src->irep_root->no] : NULL;
+
+  return snap;
+}
+
+//Compare possibly NULL strings
+static int
+prof_str_eq(const char *a, const char *b)
+{
+  if (!a || !b) {
+    return a == b;
+  }
+  return strcmp(a, b) == 0;
+}
+
+//Whether a node of the merged tree and a node of a source VM run the same
+//method
+//
+//Ireps of different VMs are different objects, so methods are told apart
+//by their VM code, source position, name and class.
+//
+//Arguments:
+// - mrb:  merging VM
+// - dst:  node of the merged tree, its names already resolved
+// - smrb: source VM
+// - src:  node of the source VM's profile
+static int
+prof_same_method(mrb_state *mrb, struct prof_irep *dst,
+                 mrb_state *smrb, struct prof_irep *src)
+{
+  mrb_irep *a = dst->irep;
+  mrb_irep *b = src->irep;
+
+  if (a != b) {
+    if (a->ilen != b->ilen ||
+        memcmp(a->iseq, b->iseq, a->ilen * sizeof(mrb_code)) != 0 ||
+        !prof_str_eq(a->filename, b->filename) ||
+        (a->lines ? a->lines[0] : 0) != (b->lines ? b->lines[0] : 0)) {
+      return 0;
+    }
+  }
+
+  return strcmp(mrb_profiler_irep_mname(mrb, dst),
+                mrb_profiler_irep_mname(smrb, src)) == 0 &&
+         strcmp(mrb_profiler_irep_klass(mrb, dst),
+                mrb_profiler_irep_klass(smrb, src)) == 0;
+}
+
+//Ireps of a source VM already loaded into the merging VM
+struct prof_irep_map {
+  mrb_irep **from; //Source VM ireps, open addressing
+  mrb_irep **to;   //Their copies [capa]
+  uint32_t capa;
+};
+
+//Get an irep of the merging VM running the same code as a source VM irep
+//
+//Ireps are only valid in the VM that created them, so those of other VMs
+//are copied with the dump format. The caller owns a reference to the
+//returned irep.
+//
+//Arguments:
+// - mrb:  merging VM
+// - map:  copies already made from smrb
+// - smrb: source VM
+// - irep: irep of smrb
+static mrb_irep *
+prof_merge_irep(mrb_state *mrb, struct prof_irep_map *map,
+                mrb_state *smrb, mrb_irep *irep)
+{
+  uint32_t mask = map->capa - 1;
+  uint32_t h;
+  uint8_t *bin = NULL;
+  size_t binsize = 0;
+  size_t rlen;
+  mrb_irep *copy;
+  int ret;
+
+  if (smrb == mrb) {
+    irep->refcnt++;
+    return irep;
+  }
+
+  for (h = ((uintptr_t)irep >> 3) & mask; map->from[h]; h = (h + 1) & mask) {
+    if (map->from[h] == irep) {
+      map->to[h]->refcnt++;
+      return map->to[h];
+    }
+  }
+
+  //Nodes only run the instructions of the irep itself
+  rlen = irep->rlen;
+  irep->rlen = 0;
+  ret = mrb_dump_irep(smrb, irep, DUMP_DEBUG_INFO, &bin, &binsize);
+  irep->rlen = rlen;
+  if (ret != MRB_DUMP_OK) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't copy irep of profiled VM");
+  }
+  copy = mrb_read_irep(mrb, bin);
+  mrb_free(smrb, bin);
+  if (!copy) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't copy irep of profiled VM");
+  }
+
+  //The map holds the reference from mrb_read_irep
+  map->from[h] = irep;
+  map->to[h] = copy;
+  copy->refcnt++;
+
+  return copy;
+}
+
+//Create the merged node for a source node without a counterpart
+//
+//Arguments:
+// - mrb:    merging VM
+// - res:    merged tree
+// - parent: merged parent node, NULL for the root
+// - map:    copies already made from smrb
+// - smrb:   source VM
+// - src:    node of the source VM's profile
+static struct prof_irep *
+prof_merge_new_node(mrb_state *mrb, struct prof_result *res,
+                    struct prof_irep *parent, struct prof_irep_map *map,
+                    mrb_state *smrb, struct prof_irep *src)
+{
+  struct prof_class *klass;
+  struct prof_irep *node;
+  mrb_irep *irep;
+
+  klass = (struct prof_class *)
+    mrb_profiler_arena_alloc(mrb, &res->arena, sizeof(struct prof_class));
+  klass->name = mrb_profiler_arena_intern(mrb, &res->arena,
+                                          mrb_profiler_irep_klass(smrb, src));
+
+  irep = prof_merge_irep(mrb, map, smrb, src->irep);
+  if (parent) {
+    node = mrb_profiler_add_child(mrb, res, parent, irep, 0, klass);
+    parent->ccall_num[node->child_idx] = 0;
+  }
+  else {
+    node = mrb_profiler_alloc_prof_irep(mrb, res, irep, NULL, 0, klass);
+  }
+  //The node holds its own reference
+  mrb_irep_decref(mrb, irep);
+  node->mname = mrb_profiler_arena_intern(mrb, &res->arena,
+                                          mrb_profiler_irep_mname(smrb, src));
+
+  return node;
+}
+
+//Whether the performance counts of src can be added to res
+//
+//The first profile merged with counts decides the events.
+static mrb_bool
+prof_merge_events(mrb_state *mrb, struct prof_result *res,
+                  struct prof_result *src)
+{
+  int i;
+
+  if (src->event_num == 0) {
+    return FALSE;
+  }
+  if (res->event_num == 0) {
+    res->event_num = src->event_num;
+    for (i = 0; i < src->event_num; i++) {
+      res->event_name[i] =
+        mrb_profiler_arena_intern(mrb, &res->arena, src->event_name[i]);
+    }
+    return TRUE;
+  }
+  if (res->event_num != src->event_num) {
+    return FALSE;
+  }
+  for (i = 0; i < src->event_num; i++) {
+    if (strcmp(res->event_name[i], src->event_name[i]) != 0) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+//Widen the wall clock period of a merged tree to cover src
+static void
+prof_merge_period(struct prof_result *res, struct prof_result *src)
+{
+  uint64_t end = src->wall_end ? src->wall_end : mrb_profiler_wall_usec();
+
+  if (!src->wall_start) {
+    return;
+  }
+  if (!res->wall_start || src->wall_start < res->wall_start) {
+    res->wall_start = src->wall_start;
+  }
+  if (res->wall_end < end) {
+    res->wall_end = end;
+  }
+}
+
+//Add a profile to a merged tree
+//
+//Source nodes are visited in allocation order, which puts every parent
+//before its children.
+//
+//Arguments:
+// - mrb:  merging VM
+// - res:  merged tree
+// - smrb: VM owning the ireps of src, mrb for snapshots of mrb
+// - src:  profile to add
+static void
+prof_merge_result(mrb_state *mrb, struct prof_result *res, mrb_state *smrb,
+                  struct prof_result *src)
+{
+  struct prof_irep **nodes;
+  struct prof_irep_map map;
+  mrb_bool events;
+  int i;
+  int j;
+
+  if (!src->irep_root) {
+    return;
+  }
+  events = prof_merge_events(mrb, res, src);
+  //The calibration of the first VM stands for all of them
+  if (res->hook_ticks == 0 && res->call_ticks == 0) {
+    res->hook_ticks = src->hook_ticks;
+    res->call_ticks = src->call_ticks;
+  }
+  res->overhead += src->overhead;
+  res->switch_ticks += src->switch_ticks;
+  res->switch_num += src->switch_num;
+  prof_merge_period(res, src);
+
+  //Temporaries live as long as the snapshot, so nothing leaks on errors
+  nodes = (struct prof_irep **)
+    mrb_profiler_arena_alloc(mrb, &res->arena, src->irep_num * sizeof(*nodes));
+  for (map.capa = 16; map.capa < (uint32_t)src->irep_num * 2; map.capa *= 2);
+  map.from = (mrb_irep **)
+    mrb_profiler_arena_alloc(mrb, &res->arena, map.capa * sizeof(mrb_irep *));
+  map.to = (mrb_irep **)
+    mrb_profiler_arena_alloc(mrb, &res->arena, map.capa * sizeof(mrb_irep *));
+
+  for (i = 0; i < src->irep_num; i++) {
+    struct prof_irep *from = src->irep_tab[i];
+    struct prof_irep *parent;
+    struct prof_irep *to = NULL;
+
+    if (from->parent) {
+      parent = nodes[from->parent->no];
+    }
+    else if (!res->irep_root) {
+      parent = NULL;
+      to = res->irep_root =
+        prof_merge_new_node(mrb, res, NULL, &map, smrb, from);
+    }
+    else if (prof_same_method(mrb, res->irep_root, smrb, from)) {
+      parent = NULL;
+      to = res->irep_root;
+    }
+    else {
+      //Unrelated top level code goes below the merged root
+      parent = res->irep_root;
+    }
+
+    if (!to) {
+      for (j = 0; j < parent->child_num; j++) {
+        if (prof_same_method(mrb, parent->child[j], smrb, from)) {
+          to = parent->child[j];
+          break;
+        }
+      }
+      if (!to) {
+        to = prof_merge_new_node(mrb, res, parent, &map, smrb, from);
+      }
+      parent->ccall_num[to->child_idx] +=
+        from->parent ? from->parent->ccall_num[from->child_idx] : 1;
+    }
+
+    to->calls += from->calls;
+    to->incl += from->incl;
+    if (to->max < from->max) {
+      to->max = from->max;
+    }
+    if (from->hist) {
+      mrb_profiler_hist_add(mrb_profiler_call_hist(mrb, res, to), from->hist,
+                            1.0);
+    }
+    nodes[i] = to;
+
+    //Counters shared in flat mode are added once, to the owner's node
+    if (PROF_SHARED(from)) {
+      continue;
+    }
+    for (j = 0; j < (int)from->irep->ilen; j++) {
+      to->time[j] += from->time[j];
+      to->num[j]  += from->num[j];
+    }
+    if (from->alloc) {
+      struct prof_alloc *alloc = mrb_profiler_alloc_counters(mrb, res, to);
+
+      for (j = 0; j < (int)from->irep->ilen; j++) {
+        alloc[j].bytes += from->alloc[j].bytes;
+        alloc[j].objs  += from->alloc[j].objs;
+      }
+    }
+    if (from->gc) {
+      uint64_t *gc = mrb_profiler_gc_counters(mrb, res, to);
+
+      for (j = 0; j < (int)from->irep->ilen; j++) {
+        gc[j] += from->gc[j];
+      }
+    }
+    if (from->events && events) {
+      uint64_t *ev = mrb_profiler_event_counters(mrb, res, to);
+
+      for (j = 0; j < (int)from->irep->ilen * src->event_num; j++) {
+        ev[j] += from->events[j];
+      }
+    }
+    for (j = 0; from->insn_hist && j < (int)from->irep->ilen; j++) {
+      if (from->insn_hist[j]) {
+        mrb_profiler_hist_add(mrb_profiler_insn_hist(mrb, res, to, j),
+                              from->insn_hist[j], 1.0);
+      }
+    }
+  }
+
+  //Drop the references taken by mrb_read_irep, nodes hold their own
+  for (i = 0; i < (int)map.capa; i++) {
+    if (map.from[i]) {
+      mrb_irep_decref(mrb, map.to[i]);
+    }
+  }
+}
+
+//Combine the profiles of several VMs into a new Profiler::Snapshot
+//
+//Nodes running the same method from the same call path are merged. The
+//source VMs must not run while they are read; the snapshot doesn't refer
+//to them afterwards.
+//
+//Arguments:
+// - mrb:   VM the snapshot is created in
+// - klass: Profiler::Snapshot
+// - srcs:  profiled VMs, mrb may be one of them
+// - nsrc:  number of VMs
+mrb_value
+mrb_profiler_snapshot_merge(mrb_state *mrb, struct RClass *klass,
+                            mrb_state **srcs, int nsrc)
+{
+  mrb_value snap;
+  struct prof_result *res;
+  int i;
+
+  snap = mrb_profiler_snapshot_alloc(mrb, klass, &res);
+  for (i = 0; i < nsrc; i++) {
+    prof_merge_result(mrb, res, srcs[i],
+                      &mrb_profiler_state(srcs[i])->result);
+  }
+
+  return snap;
+}
+
+//Combine binary dumps into a new Profiler::Snapshot
+//
+//Meant for the deltas of continuous profiling, each covering the counters
+//of its own period. Dumps are loaded one at a time, so only the merged
+//tree stays in memory.
+//
+//Arguments:
+// - mrb:   mruby state
+// - klass: Profiler::Snapshot
+// - paths: Array of dump files
+// - from:  wall clock microseconds, dumps that ended earlier are skipped
+// - to:    wall clock microseconds, dumps that began later are skipped, 0
+//          for no limit
+mrb_value
+mrb_profiler_snapshot_merge_dumps(mrb_state *mrb, struct RClass *klass,
+                                  mrb_value paths, uint64_t from, uint64_t to)
+{
+  mrb_value snap;
+  struct prof_result *res;
+  int ai;
+  mrb_int i;
+
+  snap = mrb_profiler_snapshot_alloc(mrb, klass, &res);
+  ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < RARRAY_LEN(paths); i++) {
+    mrb_value path = mrb_str_to_str(mrb, mrb_ary_ref(mrb, paths, i));
+    mrb_value part;
+    struct prof_result *src;
+
+    part = mrb_profiler_load_result(mrb, klass,
+                                    mrb_string_value_cstr(mrb, &path));
+    src = mrb_profiler_snapshot_result(mrb, part);
+    //Dumps without a period only match an unbounded range
+    if ((from || to) &&
+        (!src->wall_start || src->wall_end < from ||
+         (to && src->wall_start > to))) {
+      mrb_gc_arena_restore(mrb, ai);
+      continue;
+    }
+    prof_merge_result(mrb, res, mrb, src);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  return snap;
+}
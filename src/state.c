@@ -0,0 +1,94 @@
+/* Profiler for ruby - profiler state of each VM */
+#include "mruby.h"
+#include "profiler.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+PROF_TLS struct prof_state_cache mrb_profiler_state_cache;
+//Bumped whenever a state is registered or freed, invalidating every
+//thread's cache
+volatile unsigned int mrb_profiler_state_gen = 1;
+
+//States of every VM with the profiler initialized
+static struct prof_state *prof_states = NULL;
+static pthread_mutex_t prof_states_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Create and register the profiler state of a VM
+struct prof_state *
+mrb_profiler_state_new(mrb_state *mrb)
+{
+  struct prof_state *ps;
+
+  ps = (struct prof_state *)calloc(1, sizeof(struct prof_state));
+  if (!ps) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "profiler out of memory");
+  }
+  ps->mrb = mrb;
+  ps->mode = PROF_MODE_EXACT;
+  ps->sampler.interval = 1000;
+
+  pthread_mutex_lock(&prof_states_lock);
+  ps->next = prof_states;
+  prof_states = ps;
+  mrb_profiler_state_gen++;
+  pthread_mutex_unlock(&prof_states_lock);
+
+  return ps;
+}
+
+//Unregister and free a state whose contents were already released
+void
+mrb_profiler_state_free(struct prof_state *ps)
+{
+  struct prof_state **link;
+
+  pthread_mutex_lock(&prof_states_lock);
+  for (link = &prof_states; *link; link = &(*link)->next) {
+    if (*link == ps) {
+      *link = ps->next;
+      break;
+    }
+  }
+  mrb_profiler_state_gen++;
+  pthread_mutex_unlock(&prof_states_lock);
+
+  free(ps);
+}
+
+//Find the state of a VM and cache it for the running thread
+struct prof_state *
+mrb_profiler_state_lookup(mrb_state *mrb)
+{
+  struct prof_state_cache *cache = &mrb_profiler_state_cache;
+  struct prof_state *ps;
+
+  pthread_mutex_lock(&prof_states_lock);
+  for (ps = prof_states; ps; ps = ps->next) {
+    if (ps->mrb == mrb) {
+      break;
+    }
+  }
+  cache->mrb = mrb;
+  cache->state = ps;
+  cache->gen = mrb_profiler_state_gen;
+  pthread_mutex_unlock(&prof_states_lock);
+
+  return ps;
+}
+
+//Call fn on every registered state
+//
+//The states list stays locked, so fn must not register or free states,
+//and the states can't be freed while fn looks at them. Used by threads
+//other than the VMs' ones.
+void
+mrb_profiler_state_each(void (*fn)(struct prof_state *, void *), void *ud)
+{
+  struct prof_state *ps;
+
+  pthread_mutex_lock(&prof_states_lock);
+  for (ps = prof_states; ps; ps = ps->next) {
+    fn(ps, ud);
+  }
+  pthread_mutex_unlock(&prof_states_lock);
+}
@@ -0,0 +1,43 @@
+# Binary dumps written by Profiler.dump and read back by Profiler.load
+
+def dump_test_work(n)
+  s = 0
+  n.times { |i| s += i }
+  s
+end
+
+def dump_test_keys(prof)
+  (0...prof.irep_num).map { |i| prof.node_key(i) }
+end
+
+assert('Profiler.load reads back what Profiler.dump wrote') do
+  dump_test_work(100)
+  snap = Profiler.snapshot
+  path = ProfilerTest.tmppath
+  begin
+    snap.dump(path)
+    loaded = Profiler.load(path)
+
+    assert_kind_of Profiler::Snapshot, loaded
+    assert_equal snap.irep_num, loaded.irep_num
+    assert_equal dump_test_keys(snap), dump_test_keys(loaded)
+    snap.irep_num.times do |i|
+      assert_equal snap.irep_counters(i)[0], loaded.irep_counters(i)[0]
+    end
+  ensure
+    ProfilerTest.unlink(path)
+  end
+end
+
+assert('Profiler.load rejects an irep larger than its record') do
+  dump_test_work(10)
+  path = ProfilerTest.tmppath
+  begin
+    Profiler.dump(path)
+    ProfilerTest.corrupt_rite(path)
+
+    assert_raise(RuntimeError) { Profiler.load(path) }
+  ensure
+    ProfilerTest.unlink(path)
+  end
+end
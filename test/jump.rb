@@ -0,0 +1,26 @@
+# Jumps back to the first instruction of an activation, as redo and retry
+# make, are no new calls
+
+def jump_test_redo
+  done = false
+  1.times do
+    unless done
+      done = true
+      redo
+    end
+  end
+end
+
+def jump_test_activations(prof, mname)
+  infos = (0...prof.irep_num).map { |i| prof.get_irep_info(i) }
+  infos.select { |info| info[2] == mname }.map { |info| info[6] }
+end
+
+assert('A block restarted by redo is called once') do
+  Profiler.reset
+  jump_test_redo
+  calls = jump_test_activations(Profiler.snapshot, 'jump_test_redo')
+
+  assert_false calls.empty?
+  calls.each { |n| assert_equal 1, n }
+end
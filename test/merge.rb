@@ -0,0 +1,20 @@
+# Profiles of VMs run by threads of their own, combined by
+# mrb_profiler_merge
+
+MERGE_TEST_CODE = <<'CODE'
+def merge_test_fib(n)
+  n < 2 ? n : merge_test_fib(n - 1) + merge_test_fib(n - 2)
+end
+a = []
+200.times { |i| a << i.to_s }
+merge_test_fib(15)
+CODE
+
+assert('mrb_profiler_merge sums the profiles of VMs run by threads') do
+  [1, 2, 4].each do |n|
+    merged, summed = ProfilerTest.merge_threads(n, MERGE_TEST_CODE)
+
+    assert_false merged.empty?
+    assert_equal summed, merged
+  end
+end
@@ -0,0 +1,246 @@
+/* Profiler for ruby - helpers for the mrbtest suite */
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/compile.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include "mruby/throw.h"
+#include "mruby/profiler.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//Most VMs merge_threads runs at once
+#define PROF_TEST_VMS 16
+
+//VM run by a thread of merge_threads
+struct prof_test_vm {
+  mrb_state *mrb;
+  const char *code;            //Ruby code to run with the profiler on
+  mrb_bool ok;                 //Whether it ran without raising
+};
+
+//Get the path of a new empty temporary file
+static mrb_value
+prof_test_tmppath(mrb_state *mrb, mrb_value self)
+{
+  char path[] = "/tmp/mruby-profiler-XXXXXX";
+  int fd = mkstemp(path);
+
+  if (fd < 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't create a temporary file");
+  }
+  close(fd);
+
+  return mrb_str_new_cstr(mrb, path);
+}
+
+//Remove a file
+//Arguments:
+// - path - file to remove
+static mrb_value
+prof_test_unlink(mrb_state *mrb, mrb_value self)
+{
+  char *path;
+
+  mrb_get_args(mrb, "z", &path);
+  unlink(path);
+
+  return mrb_nil_value();
+}
+
+//Make the RITE header of the first irep of a dump claim more bytes than
+//its record holds
+//Arguments:
+// - path - dump to damage
+static mrb_value
+prof_test_corrupt_rite(mrb_state *mrb, mrb_value self)
+{
+  static const uint8_t huge[4] = { 0x7f, 0xff, 0xff, 0xff };
+  char *path;
+  FILE *fp;
+  char *data;
+  long len;
+  long i;
+  mrb_bool done = FALSE;
+
+  mrb_get_args(mrb, "z", &path);
+  fp = fopen(path, "r+b");
+  if (!fp) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't open dump");
+  }
+  fseek(fp, 0, SEEK_END);
+  len = ftell(fp);
+  data = (char *)malloc(len > 0 ? len : 1);
+  rewind(fp);
+  if (data && fread(data, 1, len, fp) == (size_t)len) {
+    //The size follows the identifier, version and CRC
+    for (i = 0; i + 14 <= len; i++) {
+      if (memcmp(data + i, "RITE", 4) == 0) {
+        fseek(fp, i + 10, SEEK_SET);
+        done = fwrite(huge, 1, sizeof(huge), fp) == sizeof(huge);
+        break;
+      }
+    }
+  }
+  free(data);
+  fclose(fp);
+  if (!done) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "no irep found in dump");
+  }
+
+  return mrb_nil_value();
+}
+
+//Open a VM and run the code with the profiler on, then stop it so the VM
+//is idle when merged
+static void *
+prof_test_run(void *arg)
+{
+  struct prof_test_vm *vm = (struct prof_test_vm *)arg;
+
+  vm->mrb = mrb_open();
+  if (!vm->mrb) {
+    return NULL;
+  }
+  mrb_profiler_start(vm->mrb);
+  mrb_load_string(vm->mrb, vm->code);
+  vm->ok = !vm->mrb->exc;
+  mrb_profiler_stop(vm->mrb);
+
+  return NULL;
+}
+
+//Add the execution counts of every node of a profile of from to a hash of
+//mrb keyed by node key
+static void
+prof_test_tally(mrb_state *mrb, mrb_value tally, mrb_state *from,
+                mrb_value prof)
+{
+  mrb_int num = mrb_fixnum(mrb_funcall(from, prof, "irep_num", 0));
+  mrb_int i;
+
+  for (i = 0; i < num && !from->exc; i++) {
+    mrb_value key = mrb_funcall(from, prof, "node_key", 1,
+                                mrb_fixnum_value(i));
+    mrb_value info = mrb_funcall(from, prof, "irep_counters", 1,
+                                 mrb_fixnum_value(i));
+    mrb_value counts;
+    mrb_value k;
+    mrb_int sum = 0;
+    mrb_int j;
+
+    if (from->exc) {
+      break;
+    }
+    counts = mrb_ary_ref(from, info, 0);
+    for (j = 0; j < RARRAY_LEN(counts); j++) {
+      sum += mrb_fixnum(mrb_ary_ref(from, counts, j));
+    }
+    k = mrb_str_new(mrb, RSTRING_PTR(key), RSTRING_LEN(key));
+    sum += mrb_fixnum(mrb_hash_fetch(mrb, tally, k, mrb_fixnum_value(0)));
+    mrb_hash_set(mrb, tally, k, mrb_fixnum_value(sum));
+  }
+  if (from->exc) {
+    from->exc = NULL;
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't read the profile of a VM");
+  }
+}
+
+//Run code in VMs of their own on as many threads with the profiler on,
+//then merge their profiles
+//Arguments:
+// - num  - number of VMs and threads
+// - code - Ruby code each VM runs
+//Returns:
+// - Two hashes of node keys to execution counts
+//  0. Of the merged profile
+//  1. Summed over the profiles of the VMs
+static mrb_value
+prof_test_merge_threads(mrb_state *mrb, mrb_value self)
+{
+  struct prof_test_vm vms[PROF_TEST_VMS];
+  pthread_t threads[PROF_TEST_VMS];
+  mrb_state *srcs[PROF_TEST_VMS];
+  mrb_value merged = mrb_hash_new(mrb);
+  mrb_value summed = mrb_hash_new(mrb);
+  mrb_value res;
+  mrb_int num;
+  char *code;
+  int started;
+  int i;
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+  volatile mrb_bool failed = FALSE;
+
+  mrb_get_args(mrb, "iz", &num, &code);
+  if (num < 1 || num > PROF_TEST_VMS) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "number of VMs out of range");
+  }
+  memset(vms, 0, sizeof(vms));
+  for (started = 0; started < num; started++) {
+    vms[started].code = code;
+    if (pthread_create(&threads[started], NULL, prof_test_run,
+                       &vms[started]) != 0) {
+      break;
+    }
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+    srcs[i] = vms[i].mrb;
+    if (!vms[i].mrb || !vms[i].ok) {
+      failed = TRUE;
+    }
+  }
+
+  //Close the VMs whatever happens to the comparison
+  if (!failed && started == num) {
+    MRB_TRY(&c_jmp) {
+      mrb->jmp = &c_jmp;
+      prof_test_tally(mrb, merged, mrb,
+                      mrb_profiler_merge(mrb, srcs, (int)num));
+      for (i = 0; i < num; i++) {
+        prof_test_tally(mrb, summed, vms[i].mrb,
+                        mrb_profiler_snapshot(vms[i].mrb));
+      }
+      mrb->jmp = prev_jmp;
+    }
+    MRB_CATCH(&c_jmp) {
+      mrb->jmp = prev_jmp;
+      mrb->exc = NULL;
+      failed = TRUE;
+    }
+    MRB_END_EXC(&c_jmp);
+  }
+  for (i = 0; i < started; i++) {
+    if (vms[i].mrb) {
+      mrb_close(vms[i].mrb);
+    }
+  }
+  if (failed || started < num) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't profile the VMs");
+  }
+
+  res = mrb_ary_new_capa(mrb, 2);
+  mrb_ary_push(mrb, res, merged);
+  mrb_ary_push(mrb, res, summed);
+
+  return res;
+}
+
+void
+mrb_mruby_profiler_gem_test(mrb_state *mrb)
+{
+  struct RClass *m = mrb_define_module(mrb, "ProfilerTest");
+
+  mrb_define_module_function(mrb, m, "tmppath",
+      prof_test_tmppath, MRB_ARGS_NONE());
+  mrb_define_module_function(mrb, m, "unlink",
+      prof_test_unlink, MRB_ARGS_REQ(1));
+  mrb_define_module_function(mrb, m, "corrupt_rite",
+      prof_test_corrupt_rite, MRB_ARGS_REQ(1));
+  mrb_define_module_function(mrb, m, "merge_threads",
+      prof_test_merge_threads, MRB_ARGS_REQ(2));
+}
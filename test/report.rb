@@ -0,0 +1,18 @@
+# Reports of single instructions
+
+def report_test_work
+  [1, 2, 3].map { |x| x * 2 }
+end
+
+assert('Profiler.get_inst_info and disasm take offsets within the irep') do
+  report_test_work
+  snap = Profiler.snapshot
+  ilen = snap.ilen(0)
+
+  assert_kind_of Array, snap.get_inst_info(0, ilen - 1)
+  assert_kind_of String, snap.disasm(0, 0)
+  assert_raise(IndexError) { snap.get_inst_info(0, ilen) }
+  assert_raise(IndexError) { snap.get_inst_info(0, -1) }
+  assert_raise(IndexError) { snap.disasm(0, ilen) }
+  assert_raise(IndexError) { snap.disasm(0, -1) }
+end
@@ -0,0 +1,132 @@
+/* Profiler for ruby - offline reports from profiler dumps */
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/string.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void
+usage(const char *name)
+{
+  fprintf(stderr,
+          "Usage: %s [-k|-f|-s|-o out|-d base] [-t from,to] dumpfile...\n"
+          "  -k  kcachegrind output instead of the annotated source report\n"
+          "  -f  folded stacks for flamegraph.pl\n"
+          "  -s  speedscope JSON\n"
+          "  -o  write the merged dumps to out instead of a report\n"
+          "  -d  rank the regressions and improvements since the dump base\n"
+          "  -t  only merge dumps covering part of from..to, in seconds\n"
+          "      since the epoch, either end may be left empty\n"
+          "Several dumps, such as the deltas of continuous profiling, are\n"
+          "added up.\n",
+          name);
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *report = "analyze_normal";
+  const char *out = "-";
+  const char *range = NULL;
+  const char *base = NULL;
+  int argn = 0;
+  mrb_state *mrb;
+  mrb_value paths;
+  mrb_value from;
+  mrb_value to;
+  mrb_value snap;
+  int rc = 0;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-k") == 0) {
+      report = "analyze_kcached";
+    }
+    else if (strcmp(argv[i], "-f") == 0) {
+      report = "export_folded";
+      argn = 1;
+    }
+    else if (strcmp(argv[i], "-s") == 0) {
+      report = "export_speedscope";
+      argn = 1;
+    }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      report = "dump";
+      out = argv[++i];
+      argn = 1;
+    }
+    else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      report = "diff";
+      base = argv[++i];
+    }
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc &&
+             strchr(argv[i + 1], ',')) {
+      range = argv[++i];
+    }
+    else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    else {
+      break;
+    }
+  }
+  if (i == argc) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  //The reports themselves aren't profiled
+  setenv("MRUBY_PROFILER_AUTOSTART", "0", 1);
+  unsetenv("MRUBY_PROFILER_CONTINUOUS");
+  mrb = mrb_open();
+  if (!mrb) {
+    fprintf(stderr, "%s: can't open mruby\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  paths = mrb_ary_new(mrb);
+  for (; i < argc; i++) {
+    mrb_ary_push(mrb, paths, mrb_str_new_cstr(mrb, argv[i]));
+  }
+  from = to = mrb_nil_value();
+  if (range) {
+    const char *comma = strchr(range, ',');
+
+    if (comma != range) {
+      from = mrb_float_value(mrb, atof(range));
+    }
+    if (comma[1]) {
+      to = mrb_float_value(mrb, atof(comma + 1));
+    }
+  }
+  if (RARRAY_LEN(paths) == 1 && !range) {
+    snap = mrb_funcall(mrb, mrb_obj_value(mrb_module_get(mrb, "Profiler")),
+                       "load", 1, mrb_ary_ref(mrb, paths, 0));
+  }
+  else {
+    snap = mrb_funcall(mrb, mrb_obj_value(mrb_module_get(mrb, "Profiler")),
+                       "merge_dumps", 3, paths, from, to);
+  }
+  if (!mrb->exc && base) {
+    mrb_value prev = mrb_funcall(mrb,
+                                 mrb_obj_value(mrb_module_get(mrb, "Profiler")),
+                                 "load", 1, mrb_str_new_cstr(mrb, base));
+
+    if (!mrb->exc) {
+      mrb_funcall(mrb, snap, report, 1, prev);
+    }
+  }
+  else if (!mrb->exc) {
+    //Exporters write to stdout too
+    mrb_funcall(mrb, snap, report, argn, mrb_str_new_cstr(mrb, out));
+  }
+  if (mrb->exc) {
+    mrb_print_error(mrb);
+    rc = EXIT_FAILURE;
+  }
+  mrb_close(mrb);
+
+  return rc;
+}